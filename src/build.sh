@@ -14,7 +14,7 @@ if [ "$1" == "c" ]; then
 fi
 
 TARGET="../bin/sp-plus"
-SRC="platform/linux_platform.c sp_plus.c sp_raster.c"
+SRC="platform/linux_platform.c sp_plus.c sp_raster.c sp_voice.c sp_convert.c sp_trace.c sp_log.c"
 
 # pass 'r' for release mode
 if [ "$1" == "r" ]; then
@@ -30,5 +30,11 @@ LINKFLAGS="-lm -lasound -lX11 -L../lib -lsmarc"
 # Create the target directory if it doesn't exist
 mkdir -p ../bin
 
+# pass 'b' to build the headless engine benchmark instead
+if [ "$1" == "b" ]; then
+	gcc -O2 -Wextra -I./external -o ../bin/engine-bench ../test/engine-bench.c sp_raster.c sp_voice.c sp_convert.c sp_trace.c sp_log.c -lm -L../lib -lsmarc && echo "Compiled engine-bench"
+	exit 0
+fi
+
 # Compile and link
 gcc $CFLAGS -o $TARGET $SRC $LINKFLAGS && echo "Compiled" 
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Offline render */
+
+// renders a scripted pattern to a wav as fast as possible, without audio device or window
+// script lines, frames are counted at the render rate from the first frame rendered:
+//   load PAD PATH		load wav at PATH onto PAD, one of q w e r a s d f
+//   poly PAD N			max voices playing PAD at once
+//   gate PAD on|off		gate mode of PAD, off when loaded
+//   trigger FRAME PAD		trigger PAD on FRAME
+//   release FRAME PAD		close gate of PAD on FRAME, PAD must be in gate mode
+//   end FRAME			stop rendering on FRAME, default is --length seconds
+// # starts a comment
+
+static const char bounce_pads[NUM_PADS] = {'q', 'w', 'e', 'r', 'a', 's', 'd', 'f'};
+
+struct bounce_event {
+	uint64_t frame;
+	int pad;
+	int release;		// close gate instead of trigger
+	int line;		// script line, keeps events on one frame in script order
+};
+
+struct bounce_script {
+	struct bounce_event *events;
+	int num_events;
+	int next;		// next event to send to the engine
+	uint64_t end;		// frame to stop on, 0 if not set
+};
+
+// returns pad index of name or -1 if it is not a pad
+static int parse_bounce_pad(const char *name)
+{
+	if (!name || strlen(name) != 1) return -1;
+	for (int i = 0; i < NUM_PADS; i++) {
+		if (bounce_pads[i] == name[0]) return i;
+	}
+	return -1;
+}
+
+// returns 0 and frame parsed from s on success and -1 if s is not a frame
+static int parse_bounce_frame(const char *s, uint64_t *frame)
+{
+	if (!s) return -1;
+	char *end;
+	*frame = strtoull(s, &end, 10);
+	return *end || end == s ? -1 : 0;
+}
+
+static int compare_bounce_events(const void *a, const void *b)
+{
+	const struct bounce_event *x = a, *y = b;
+	if (x->frame != y->frame) return x->frame < y->frame ? -1 : 1;
+	return x->line - y->line;
+}
+
+// reads script at path into b, loading pads into sp_state as it goes
+// returns 0 on success and -1 on failure
+static int read_bounce_script(struct bounce_script *b, void *sp_state, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		log_msg(LOG_ERROR, "Could not open bounce script %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	int loaded[NUM_PADS] = {0};
+	int gated[NUM_PADS] = {0};
+	char line[PATH_MAX + 64];
+	int line_num = 0;
+	int err = 0;
+	while (!err && fgets(line, sizeof(line), f)) {
+		line_num++;
+		char *c = strchr(line, '#');
+		if (c) *c = '\0';
+
+		char *cmd = strtok(line, " \t\r\n");
+		if (!cmd) continue;
+
+		if (!strcmp(cmd, "load")) {
+			const int pad = parse_bounce_pad(strtok(NULL, " \t\r\n"));
+			// path is the rest of the line so it may contain spaces
+			char *file = strtok(NULL, "\r\n");
+			while (file && (*file == ' ' || *file == '\t')) file++;
+			if (pad < 0 || !file || !*file) {
+				err = -1;
+			} else if (sp_plus_load_pad(sp_state, pad, file)) {
+				log_msg(LOG_ERROR, "%s:%d: could not load %s", path, line_num, file);
+				err = -1;
+				continue;
+			} else {
+				loaded[pad] = 1;
+				gated[pad] = 0;
+			}
+		} else if (!strcmp(cmd, "poly")) {
+			const int pad = parse_bounce_pad(strtok(NULL, " \t\r\n"));
+			const char *n = strtok(NULL, " \t\r\n");
+			if (pad < 0 || !n || sp_plus_set_pad_polyphony(sp_state, pad, atoi(n)))
+				err = -1;
+		} else if (!strcmp(cmd, "gate")) {
+			const int pad = parse_bounce_pad(strtok(NULL, " \t\r\n"));
+			const char *mode = strtok(NULL, " \t\r\n");
+			const int on = mode && !strcmp(mode, "on");
+			if (pad < 0 || !mode || (!on && strcmp(mode, "off"))
+					|| sp_plus_set_pad_gate(sp_state, pad, on))
+				err = -1;
+			else
+				gated[pad] = on;
+		} else if (!strcmp(cmd, "trigger") || !strcmp(cmd, "release")) {
+			struct bounce_event e = { .release = cmd[0] == 'r', .line = line_num };
+			const int frame_err = parse_bounce_frame(strtok(NULL, " \t\r\n"), &e.frame);
+			e.pad = parse_bounce_pad(strtok(NULL, " \t\r\n"));
+			if (frame_err || e.pad < 0 || !loaded[e.pad]) {
+				err = -1;
+			} else if (e.release && !gated[e.pad]) {
+				// a release would silently do nothing
+				log_msg(LOG_ERROR, "%s:%d: pad %c is not in gate mode, add \"gate %c on\"",
+						path, line_num, bounce_pads[e.pad], bounce_pads[e.pad]);
+				err = -1;
+				continue;
+			} else {
+				b->events = realloc(b->events, sizeof(*b->events) * (b->num_events + 1));
+				b->events[b->num_events++] = e;
+			}
+		} else if (!strcmp(cmd, "end")) {
+			if (parse_bounce_frame(strtok(NULL, " \t\r\n"), &b->end) || !b->end)
+				err = -1;
+		} else {
+			err = -1;
+		}
+
+		if (err) log_msg(LOG_ERROR, "%s:%d: invalid line", path, line_num);
+	}
+	fclose(f);
+
+	qsort(b->events, b->num_events, sizeof(*b->events), compare_bounce_events);
+	return err;
+}
+
+// sends events due before frame + frames, called by render_wav before each period
+static void send_bounce_events(void *ctx, void *sp_state, uint64_t frame, unsigned long frames)
+{
+	struct bounce_script *b = ctx;
+	for (; b->next < b->num_events && b->events[b->next].frame < frame + frames; b->next++) {
+		const struct bounce_event *e = b->events + b->next;
+		if (e->release) sp_plus_release_pad(sp_state, e->pad, e->frame);
+		else sp_plus_trigger_pad(sp_state, e->pad, e->frame);
+	}
+}
+
+// renders script at cfg->bounce_path to cfg->out_path
+// returns 0 on success and -1 on failure
+static int bounce(const struct audio_config *cfg)
+{
+	void *sp_state = sp_plus_allocate_state(cfg->rate);
+	if (!sp_state) {
+		log_msg(LOG_ERROR, "Error allocating state memory");
+		return -1;
+	}
+
+	struct bounce_script script = {0};
+	if (read_bounce_script(&script, sp_state, cfg->bounce_path)) {
+		free(script.events);
+		return -1;
+	}
+
+	FILE *f = open_wav(cfg->out_path, cfg->rate, cfg->out_format);
+	if (!f) {
+		free(script.events);
+		return -1;
+	}
+
+	const uint64_t total = script.end ? script.end : (uint64_t) cfg->out_seconds * cfg->rate;
+	log_msg(LOG_INFO, "Bouncing %s, %d events, %lu frames at %uHz",
+			cfg->bounce_path, script.num_events, total, cfg->rate);
+	const int err = render_wav(f, sp_state, cfg, total, send_bounce_events, &script);
+	free(script.events);
+	return err;
+}
@@ -0,0 +1,153 @@
+#include <stdio.h>
+
+/* File backend */
+
+// renders cfg->out_seconds of output to a wav at cfg->out_path as fast as
+// the engine can fill it, then reports the realtime factor and carries on
+// as the null backend
+// the wav is 32 bit float or 24 bit, see cfg->out_format
+
+#define WAV_HEADER_BYTES 44
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+
+// called before each period is filled so events due in it can be sent
+typedef void (*render_hook)(void *ctx, void *sp_state, uint64_t frame, unsigned long frames);
+
+static void put_le16(uint8_t *p, uint16_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+// bytes per sample of a wav output format
+static int wav_sample_bytes(enum audio_format format)
+{
+	return format == AUDIO_FORMAT_S24_3 ? 3 : 4;
+}
+
+// writes a wav header for data_bytes of stereo samples in format at rate
+// format must be AUDIO_FORMAT_FLOAT or AUDIO_FORMAT_S24_3
+// returns 0 on success and -1 on failure
+static int write_wav_header(FILE *f, unsigned int rate, enum audio_format format, uint32_t data_bytes)
+{
+	const int sample_bytes = wav_sample_bytes(format);
+	const int frame_bytes = sample_bytes * NUM_CHANNELS;
+	uint8_t h[WAV_HEADER_BYTES];
+	memcpy(h, "RIFF", 4);
+	put_le32(h + 4, WAV_HEADER_BYTES - 8 + data_bytes);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le32(h + 16, 16);
+	put_le16(h + 20, format == AUDIO_FORMAT_FLOAT ? WAV_FORMAT_FLOAT : WAV_FORMAT_PCM);
+	put_le16(h + 22, NUM_CHANNELS);
+	put_le32(h + 24, rate);
+	put_le32(h + 28, rate * frame_bytes);
+	put_le16(h + 32, frame_bytes);
+	put_le16(h + 34, 8 * sample_bytes);
+	memcpy(h + 36, "data", 4);
+	put_le32(h + 40, data_bytes);
+
+	if (fseek(f, 0, SEEK_SET) || fwrite(h, sizeof(h), 1, f) != 1) return -1;
+	return 0;
+}
+
+// opens path for writing and reserves room for the header
+// returns NULL on failure
+static FILE *open_wav(const char *path, unsigned int rate, enum audio_format format)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		log_msg(LOG_ERROR, "Could not open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (write_wav_header(f, rate, format, 0)) {
+		log_msg(LOG_ERROR, "Could not write %s", path);
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+// fills total frames from the engine into wav f opened by open_wav and closes it
+// hook may be NULL
+// returns 0 on success and -1 on failure
+static int render_wav(FILE *f, void *sp_state, const struct audio_config *cfg,
+		uint64_t total, render_hook hook, void *ctx)
+{
+	const unsigned long period = cfg->period_frames;
+	const size_t frame_bytes = wav_sample_bytes(cfg->out_format) * NUM_CHANNELS;
+
+	void *buf = malloc(frame_bytes * period);
+	if (!buf) {
+		log_msg(LOG_ERROR, "Could not allocate render buffer");
+		fclose(f);
+		return -1;
+	}
+	publish_stream_info(cfg->rate, period, period, cfg->out_format);
+
+	int err = 0;
+	const uint64_t start = platform_get_time_ns();
+	uint64_t fill_ns = 0;
+	uint64_t frames = 0;
+	while (frames < total) {
+		const unsigned long n = total - frames < period ? total - frames : period;
+		if (hook) hook(ctx, sp_state, frames, n);
+
+		const uint64_t fill_start = platform_get_time_ns();
+		sp_plus_fill_audio_buffer(sp_state, buf, n, cfg->out_format);
+		const uint64_t ns = platform_get_time_ns() - fill_start;
+		record_period(cfg->rate, n, ns);
+		fill_ns += ns;
+
+		if (fwrite(buf, frame_bytes, n, f) != n) {
+			log_msg(LOG_ERROR, "Could not write %s", cfg->out_path);
+			err = -1;
+			break;
+		}
+		frames += n;
+	}
+	const uint64_t elapsed = platform_get_time_ns() - start;
+	free(buf);
+
+	// header is patched even after a failed write so the frames written are readable
+	const int header_err = write_wav_header(f, cfg->rate, cfg->out_format, frames * frame_bytes);
+	if (fclose(f) || header_err) {
+		log_msg(LOG_ERROR, "Could not finish %s", cfg->out_path);
+		err = -1;
+	}
+
+	// realtime factor of the engine alone and of engine plus disk writes
+	const double seconds = (double) frames / cfg->rate;
+	log_msg(LOG_INFO, "Wrote %lu frames to %s, %.1fx realtime (engine %.1fx)",
+			frames, cfg->out_path, seconds * 1e9 / elapsed,
+			fill_ns ? seconds * 1e9 / fill_ns : 0.0);
+	return err;
+}
+
+// opens cfg->out_path and reserves room for the header
+// returns 0 on success and -1 on failure
+static int open_file(struct audio_config *cfg, void **handle)
+{
+	FILE *f = open_wav(cfg->out_path, cfg->rate, cfg->out_format);
+	if (!f) return -1;
+	*handle = f;
+	return 0;
+}
+
+static void run_file(void *handle, void *sp_state, const struct audio_config *cfg)
+{
+	log_msg(LOG_INFO, "Rendering %us at %uHz to %s", cfg->out_seconds, cfg->rate, cfg->out_path);
+	render_wav(handle, sp_state, cfg, (uint64_t) cfg->out_seconds * cfg->rate, NULL, NULL);
+
+	// the ui keeps sending commands and retiring mix plans after the render,
+	// so the engine keeps consuming them on the null clock
+	run_null(NULL, sp_state, cfg);
+}
@@ -1,28 +1,127 @@
 #include <alsa/asoundlib.h>
+#include <poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define DEFAULT_DEVICE "plughw:1,0"
+#define DEFAULT_PERIOD_FRAMES 128
+#define DEFAULT_BUFFER_FRAMES 384
+#define MIN_PERIOD_FRAMES 32			// floor for the adaptive mode's first period
+
+// adaptive mode doubles the buffer after ADAPT_XRUNS xruns within ADAPT_WINDOW_NS
+// and halves it again after ADAPT_STABLE_NS without an xrun
+#define ADAPT_XRUNS 3
+#define ADAPT_WINDOW_NS (10 * 1000000000ULL)
+#define ADAPT_STABLE_NS (60 * 1000000000ULL)
+#define ADAPT_MAX_BUFFER_FRAMES 8192
+
+#define STACK_PREFAULT_BYTES (64 * 1024)	// audio thread stack touched before playing
+
+// opt-in realtime settings for the audio thread
+struct audio_rt_config {
+	int enabled;
+	int priority;		// SCHED_FIFO priority
+	int cpu;		// cpu to pin audio thread to, -1 to not pin
+};
+
+// audio settings read from the command line or config file
+struct audio_config {
+	const char *backend;	// name of audio backend, see audio_backends
+	const char *device;
+	unsigned int rate;	// preferred engine rate, replaced by the negotiated one
+	unsigned long period_frames;
+	unsigned long buffer_frames;
+	int adaptive;		// start at the lowest latency and adapt to xruns
+	struct audio_rt_config rt;
+	const char *out_path;	// file backend and bounce output
+	unsigned int out_seconds;	// length file backend renders
+	enum audio_format out_format;	// wav sample format, float or s24
+	const char *bounce_path;	// script to render offline, NULL to run normally
+	const char *trace_path;		// trace written at exit, NULL if not tracing
+	const char *log_path;		// log file, NULL for stderr
+	int stream_seconds;		// samples longer than this stream from disk, 0 never
+};
 
-static unsigned int period_time = 5000;		// period time in usec
-static unsigned int buffer_time = 10000;	// buffer time in usec
+// xrun history used by adaptive mode
+struct adapt_state {
+	int xruns;			// xruns in the current window
+	uint64_t window_start;		// time of first xrun in the window
+	uint64_t stable_since;		// time of last xrun or buffer change
+	unsigned long silent_frames;	// silent frames written in a row
+};
+
+// pcm stream owned by the audio thread
+struct audio_stream {
+	snd_pcm_t *pcm;
+	void *sp_state;
+	unsigned int rate;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+	enum audio_format format;
+	int adaptive;
+	struct adapt_state adapt;
+};
+
+// output formats in order of preference, the engine converts from float
+// so deeper formats skip requantization and S16 is dithered
+static const struct {
+	snd_pcm_format_t alsa;
+	enum audio_format format;
+	const char *name;
+} output_formats[] = {
+	{ SND_PCM_FORMAT_FLOAT_LE, AUDIO_FORMAT_FLOAT, "float" },
+	{ SND_PCM_FORMAT_S32_LE, AUDIO_FORMAT_S32, "s32" },
+	{ SND_PCM_FORMAT_S24_LE, AUDIO_FORMAT_S24, "s24" },
+	{ SND_PCM_FORMAT_S24_3LE, AUDIO_FORMAT_S24_3, "s24_3" },
+	{ SND_PCM_FORMAT_S16_LE, AUDIO_FORMAT_S16, "s16" },
+};
+#define NUM_OUTPUT_FORMATS (sizeof(output_formats) / sizeof(output_formats[0]))
+
+// current stream settings for platform_get_audio_info
+static _Atomic int stream_rate;
+static _Atomic int stream_period_frames;
+static _Atomic int stream_buffer_frames;
+static _Atomic int stream_format;
+
+// audio thread timing for platform_get_audio_stats
+// only the audio thread writes these, other threads ask for a reset through reset
+static struct {
+	_Atomic float load;
+	_Atomic float peak_load;
+	_Atomic uint64_t periods;
+	_Atomic uint64_t xruns;
+	_Atomic uint64_t suspends;
+	_Atomic uint64_t load_hist[LOAD_HIST_BUCKETS];
+	_Atomic int reset;
+} stats;
 
 // setup hardware parameters
+// rate must be one the device runs at natively, see negotiate_rate
+// period_size and buffer_size hold the requested sizes and receive the actual ones
+// a period size of 0 requests the smallest one the device allows
+// format receives the index into output_formats of the chosen sample format
 static int set_hwparams(
 		snd_pcm_t *pcm, 
+		unsigned int rate,
+		size_t *format,
 		snd_pcm_uframes_t *buffer_size, 
 		snd_pcm_uframes_t *period_size, 
 		snd_pcm_hw_params_t* params)
 {
-	int err, dir;
+	int err, dir = 0;
 
 	err = snd_pcm_hw_params_any(pcm, params);
 	if (err < 0) {
-		printf("Broken configuration for playback:"
-				"no configurations available: %s\n",
+		log_msg(LOG_ERROR, "Broken configuration for playback:"
+				"no configurations available: %s",
 				snd_strerror(err));
 		return err;
 	}
-	/* set hardware resampling */
-	err = snd_pcm_hw_params_set_rate_resample(pcm, params, 1);
+	/* disable alsa-lib resampling, the engine runs at the device rate */
+	err = snd_pcm_hw_params_set_rate_resample(pcm, params, 0);
 	if (err < 0) {
-		printf("Resampling setup failed for playback: %s\n",
+		log_msg(LOG_ERROR, "Resampling setup failed for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
@@ -30,71 +129,84 @@ static int set_hwparams(
 	err = snd_pcm_hw_params_set_access(pcm, params, 
 			SND_PCM_ACCESS_MMAP_INTERLEAVED);
 	if (err < 0) {
-		printf("Access type not available for playback: %s\n",
+		log_msg(LOG_ERROR, "Access type not available for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
-	/* set the sample format */
-	err = snd_pcm_hw_params_set_format(pcm, params, SND_PCM_FORMAT_S16_LE);
+	/* set the first sample format the device supports */
+	size_t f = 0;
+	while (f < NUM_OUTPUT_FORMATS - 1
+			&& snd_pcm_hw_params_test_format(pcm, params, output_formats[f].alsa))
+		f++;
+	err = snd_pcm_hw_params_set_format(pcm, params, output_formats[f].alsa);
 	if (err < 0) {
-		printf("Sample format not available for playback: %s\n",
+		log_msg(LOG_ERROR, "Sample format not available for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
+	*format = f;
 	/* set the count of channels */
 	err = snd_pcm_hw_params_set_channels(pcm, params, NUM_CHANNELS);
 	if (err < 0) {
-		printf("Channels count (%u) not available for playbacks: %s\n",
+		log_msg(LOG_ERROR, "Channels count (%u) not available for playbacks: %s",
 				NUM_CHANNELS, snd_strerror(err));
 		return err;
 	}
 	/* set the stream rate */
-	int rrate = SAMPLE_RATE;
+	unsigned int rrate = rate;
 	err = snd_pcm_hw_params_set_rate_near(pcm, params, &rrate, 0);
 	if (err < 0) {
-		printf("Rate %uHz not available for playback: %s\n",
-				SAMPLE_RATE, snd_strerror(err));
+		log_msg(LOG_ERROR, "Rate %uHz not available for playback: %s",
+				rate, snd_strerror(err));
 		return err;
 	}
-	if (rrate != SAMPLE_RATE) {
-		printf("Rate doesn't match (requested %uHz, get %iHz)\n", 
-				SAMPLE_RATE, err);
+	if (rrate != rate) {
+		log_msg(LOG_ERROR, "Rate doesn't match (requested %uHz, get %uHz)", 
+				rate, rrate);
 		return -EINVAL;
 	}
-	/* set the buffer time */
-	err = snd_pcm_hw_params_set_buffer_time_near(
-			pcm, params, 
-			&buffer_time, &dir);
+	/* set the period size */
+	snd_pcm_uframes_t period = *period_size;
+	if (!period) {
+		err = snd_pcm_hw_params_get_period_size_min(params, &period, &dir);
+		if (err < 0) {
+			log_msg(LOG_ERROR, "Unable to get minimum period size for playback: %s",
+					snd_strerror(err));
+			return err;
+		}
+		if (period < MIN_PERIOD_FRAMES) period = MIN_PERIOD_FRAMES;
+	}
+	err = snd_pcm_hw_params_set_period_size_near(pcm, params, &period, &dir);
 	if (err < 0) {
-		printf("Unable to set buffer time %u for playback: %s\n",
-				buffer_time, snd_strerror(err));
+		log_msg(LOG_ERROR, "Unable to set period size %lu for playback: %s",
+				*period_size, snd_strerror(err));
 		return err;
 	}
-	err = snd_pcm_hw_params_get_buffer_size(params, buffer_size);
+	/* set the buffer size, at least two periods */
+	snd_pcm_uframes_t buffer = *buffer_size;
+	if (buffer < 2 * period) buffer = 2 * period;
+	err = snd_pcm_hw_params_set_buffer_size_near(pcm, params, &buffer);
 	if (err < 0) {
-		printf("Unable to get buffer size for playback: %s\n",
-				snd_strerror(err));
+		log_msg(LOG_ERROR, "Unable to set buffer size %lu for playback: %s",
+				buffer, snd_strerror(err));
 		return err;
 	}
-	/* set the period time */
-	err = snd_pcm_hw_params_set_period_time_near(
-			pcm, params, &period_time, &dir);
+	/* write the parameters to device */
+	err = snd_pcm_hw_params(pcm, params);
 	if (err < 0) {
-		printf("Unable to set period time %u for playback: %s\n",
-				period_time, snd_strerror(err));
+		log_msg(LOG_ERROR, "Unable to set hw params for playback: %s",
+				snd_strerror(err));
 		return err;
 	}
-	err = snd_pcm_hw_params_get_period_size(
-			params, period_size, &dir);
+	err = snd_pcm_hw_params_get_period_size(params, period_size, &dir);
 	if (err < 0) {
-		printf("Unable to get period size for playback: %s\n",
+		log_msg(LOG_ERROR, "Unable to get period size for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
-	/* write the parameters to device */
-	err = snd_pcm_hw_params(pcm, params);
+	err = snd_pcm_hw_params_get_buffer_size(params, buffer_size);
 	if (err < 0) {
-		printf("Unable to set hw params for playback: %s\n",
+		log_msg(LOG_ERROR, "Unable to get buffer size for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
@@ -112,14 +224,14 @@ static int set_swparams(
 	/* get the current swparams */
 	err = snd_pcm_sw_params_current(pcm, params);
 	if (err < 0) {
-		printf("Unable to determine current swparams for playback:%s\n",
+		log_msg(LOG_ERROR, "Unable to determine current swparams for playback:%s",
 				snd_strerror(err));
 		return err;
 	}
 	/* start the transfer when the buffer is almost full: */
 	err = snd_pcm_sw_params_set_start_threshold(pcm, params, buffer_size);
 	if (err < 0) {
-		printf("Unable to set start threshold mode for playback: %s\n",
+		log_msg(LOG_ERROR, "Unable to set start threshold mode for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
@@ -128,14 +240,14 @@ static int set_swparams(
 	err = snd_pcm_sw_params_set_avail_min(
 			pcm, params, period_size);
 	if (err < 0) {
-		printf("Unable to set avail min for playback: %s\n", 
+		log_msg(LOG_ERROR, "Unable to set avail min for playback: %s", 
 				snd_strerror(err));
 		return err;
 	}
 	/* write the parameters to the playback device */
 	err = snd_pcm_sw_params(pcm, params);
 	if (err < 0) {
-		printf("Unable to set sw params for playback: %s\n",
+		log_msg(LOG_ERROR, "Unable to set sw params for playback: %s",
 				snd_strerror(err));
 		return err;
 	}
@@ -149,8 +261,8 @@ static int xrun_recovery(snd_pcm_t* pcm, int err)
 	if (err == -EPIPE) {    
 		err = snd_pcm_prepare(pcm);
 		if (err < 0)
-			printf("Can't recovery from underrun,"
-					"prepare failed: %s\n",
+			log_msg(LOG_ERROR, "Can't recovery from underrun,"
+					"prepare failed: %s",
 					snd_strerror(err));
 		return 0;
 	} else if (err == -ESTRPIPE) {
@@ -159,8 +271,8 @@ static int xrun_recovery(snd_pcm_t* pcm, int err)
 		if (err < 0) {
 			err = snd_pcm_prepare(pcm);
 			if (err < 0)
-				printf("Can't recovery from suspend,"
-						"prepare failed: %s\n",
+				log_msg(LOG_ERROR, "Can't recovery from suspend,"
+						"prepare failed: %s",
 						snd_strerror(err));
 		}
 		return 0;
@@ -168,249 +280,461 @@ static int xrun_recovery(snd_pcm_t* pcm, int err)
 	return err;
 }
 
-// container to be passed to callback on receiving signal from pcm device
-struct async_private_data {
-	snd_pcm_uframes_t period_size;
-	void *sp_state;
-};
+// touches the stack the audio thread will use so it does not fault while playing
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	volatile char stack[STACK_PREFAULT_BYTES];
+	for (int i = 0; i < STACK_PREFAULT_BYTES; i += 1024)
+		stack[i] = 0;
+	(void) stack[0];
+}
+
+// applies realtime settings to the calling thread
+// settings that cannot be applied are logged and skipped
+static void set_audio_thread_realtime(const struct audio_rt_config *rt)
+{
+	if (!rt->enabled) return;
+	int err;
+
+	const struct sched_param param = { .sched_priority = rt->priority };
+	err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (err) {
+		log_msg(LOG_WARN, "realtime: SCHED_FIFO priority %d not allowed (%s), "
+				"using normal scheduling", rt->priority, strerror(err));
+	}
+
+	if (rt->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			log_msg(LOG_WARN, "realtime: could not pin audio thread to cpu %d (%s)",
+					rt->cpu, strerror(err));
+		}
+	}
+
+	prefault_stack();
+}
+
+// increments a stat from the audio thread
+// there is only one writer so this needs no locked instruction
+static inline void stat_add(_Atomic uint64_t *stat, uint64_t n)
+{
+	atomic_store_explicit(stat,
+			atomic_load_explicit(stat, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// clears stats if a reset was requested, called from the audio thread
+static void apply_stats_reset(void)
+{
+	if (!atomic_load_explicit(&stats.reset, memory_order_acquire)) return;
+	atomic_store_explicit(&stats.load, 0.0f, memory_order_relaxed);
+	atomic_store_explicit(&stats.peak_load, 0.0f, memory_order_relaxed);
+	atomic_store_explicit(&stats.periods, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats.xruns, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats.suspends, 0, memory_order_relaxed);
+	for (int i = 0; i < LOAD_HIST_BUCKETS; i++)
+		atomic_store_explicit(stats.load_hist + i, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats.reset, 0, memory_order_release);
+}
+
+// publishes the settings a backend runs with for platform_get_audio_info
+static void publish_stream_info(unsigned int rate, unsigned long period_frames,
+		unsigned long buffer_frames, enum audio_format format)
+{
+	atomic_store_explicit(&stream_rate, rate, memory_order_relaxed);
+	atomic_store_explicit(&stream_period_frames, period_frames, memory_order_relaxed);
+	atomic_store_explicit(&stream_buffer_frames, buffer_frames, memory_order_relaxed);
+	atomic_store_explicit(&stream_format, format, memory_order_relaxed);
+}
+
+// records that filling a period of period_frames at rate took ns
+static void record_period(unsigned int rate, unsigned long period_frames, uint64_t ns)
+{
+	apply_stats_reset();
 
+	const float load = (double) ns * rate / (period_frames * 1e9);
+	int bucket = load * 10.0f;
+	if (bucket >= LOAD_HIST_BUCKETS) bucket = LOAD_HIST_BUCKETS - 1;
 
+	atomic_store_explicit(&stats.load, load, memory_order_relaxed);
+	if (load > atomic_load_explicit(&stats.peak_load, memory_order_relaxed))
+		atomic_store_explicit(&stats.peak_load, load, memory_order_relaxed);
+	stat_add(&stats.periods, 1);
+	stat_add(stats.load_hist + bucket, 1);
+}
+
+// returns 1 if every byte of buf is zero
+static int is_silent(const char *buf, size_t bytes)
+{
+	for (size_t i = 0; i < bytes; i++)
+		if (buf[i]) return 0;
+	return 1;
+}
 
-// executes on caught signal from pcm device
-// process requested frames from master bus and copy to pcm output buffer
-static void async_callback(snd_async_handler_t *ahandler)
+// fills one period of the pcm buffer through mmap
+// returns 0 on success or a negative error code from alsa
+static int write_period(struct audio_stream *st)
 {
-	snd_pcm_t *handle = snd_async_handler_get_pcm(ahandler);
-	struct async_private_data *data = 
-		snd_async_handler_get_callback_private(ahandler);
-	const snd_pcm_uframes_t period_size = data->period_size;
-	void *sp_state = data->sp_state;
-
-	const snd_pcm_channel_area_t *my_areas;
-	snd_pcm_uframes_t offset, frames, size;
-	snd_pcm_sframes_t avail, commitres;
-	snd_pcm_state_t state;
-	int first = 0;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t commitres;
 	int err;
 
-	while (1) {
-		state = snd_pcm_state(handle);
-		if (state == SND_PCM_STATE_XRUN) {
-			err = xrun_recovery(handle, -EPIPE);
-			if (err < 0) {
-				printf("XRUN recovery failed: %s\n",
-						snd_strerror(err));
-				exit(EXIT_FAILURE);
-			}
-			first = 1;
-		} else if (state == SND_PCM_STATE_SUSPENDED) {
-			err = xrun_recovery(handle, -ESTRPIPE);
-			if (err < 0) {
-				printf("SUSPEND recovery failed: %s\n",
-						snd_strerror(err));
-				exit(EXIT_FAILURE);
-			}
-		}
-		avail = snd_pcm_avail_update(handle);
-		if (avail < 0) {
-			err = xrun_recovery(handle, avail);
-			if (err < 0) {
-				printf("avail update failed: %s\n",
-						snd_strerror(err));
-				exit(EXIT_FAILURE);
-			}
-			first = 1;
-			continue;
-		}
-		if ((snd_pcm_uframes_t) avail < period_size) {
-			if (first) {
-				first = 0;
-				err = snd_pcm_start(handle);
-				if (err < 0) {
-					printf("Start error: %s\n", 
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
-				}
-			} else {
-				break;
-			}
-			continue;
+	snd_pcm_uframes_t size = st->period_size;
+	while (size > 0) {
+		// mmap area may wrap, so a period can take several chunks
+		frames = size;
+		err = snd_pcm_mmap_begin(st->pcm, &areas, &offset, &frames);
+		if (err < 0) return err;
+
+		// implemented by non-platform code
+		char *dest = (char *) areas[0].addr + offset * areas[0].step / 8;
+		sp_plus_fill_audio_buffer(st->sp_state, dest, frames, st->format);
+
+		// adaptive mode only shrinks the buffer while it holds silence
+		if (st->adaptive) {
+			if (is_silent(dest, frames * areas[0].step / 8))
+				st->adapt.silent_frames += frames;
+			else
+				st->adapt.silent_frames = 0;
 		}
 
-		size = period_size;
-		while (size > 0) {
-			frames = size;
+		commitres = snd_pcm_mmap_commit(st->pcm, offset, frames);
+		if (commitres < 0) return commitres;
+		if ((snd_pcm_uframes_t) commitres != frames) return -EPIPE;
+		size -= frames;
+	}
+	return 0;
+}
 
-			err = snd_pcm_mmap_begin(
-					handle, &my_areas, &offset, &frames);
-			if (err < 0) {
-				if ((err = xrun_recovery(handle, err)) < 0) {
-					printf("MMAP begin avail error: %s\n",
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
-				}
-				first = 1;
-			}
-			sp_plus_fill_audio_buffer(	
-					sp_state,
-					my_areas[0].addr + 
-					offset * my_areas[0].step / 8,
-					frames);
-
-			commitres = snd_pcm_mmap_commit(handle, offset, frames);
-			if (commitres < 0 || (snd_pcm_uframes_t)commitres != frames) {
-				if ((err = xrun_recovery(handle, commitres >= 0 ? 
-								-EPIPE : 
-								commitres)) < 0) {
-					printf("MMAP commit error: %s\n", 
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
-				}
-				first = 1;
-			}
-			size -= frames;
-		}
+// applies hw and sw params and prepares pcm
+// period_size and buffer_size hold the requested sizes and receive the actual ones
+// format receives the negotiated sample format
+static int configure_pcm(snd_pcm_t *pcm,
+		unsigned int rate,
+		snd_pcm_uframes_t *period_size,
+		snd_pcm_uframes_t *buffer_size,
+		enum audio_format *format)
+{
+	int err;
+	size_t f;
+	snd_pcm_hw_params_t* hwparams;
+	snd_pcm_sw_params_t* swparams;
+	snd_pcm_hw_params_alloca(&hwparams);
+	snd_pcm_sw_params_alloca(&swparams);
+
+	err = set_hwparams(pcm, rate, &f, buffer_size, period_size, hwparams);
+	if (err < 0) {
+		log_msg(LOG_ERROR, "Setting of hwparams failed: %s", snd_strerror(err));
+		return err;
+	}
+
+	err = set_swparams(pcm, *buffer_size, *period_size, swparams);
+	if (err < 0) {
+		log_msg(LOG_ERROR, "Setting of swparams failed: %s", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_prepare(pcm);
+	if (err < 0) {
+		log_msg(LOG_ERROR, "Failed to prepare pcm device");
+		return err;
 	}
+
+	*format = output_formats[f].format;
+	publish_stream_info(rate, *period_size, *buffer_size, *format);
+	log_msg(LOG_INFO, "Audio %uHz %s, period %lu frames, buffer %lu frames (%.1fms)",
+			rate, output_formats[f].name, *period_size, *buffer_size,
+			1000.0 * *buffer_size / rate);
+	return 0;
 }
 
-// initialize async callback and prep pcm buffer with frames
-static int async_init(
-		snd_pcm_t *handle, 
-		void *sp_state,
-		snd_pcm_uframes_t period_size)
+// drops pending frames and reopens stream with a new buffer size
+// pcm is left prepared
+static int resize_stream(struct audio_stream *st, snd_pcm_uframes_t buffer_size)
 {
-	// maybe need to free later
-	struct async_private_data* data = malloc(sizeof(struct async_private_data));
-	snd_async_handler_t *ahandler;
+	snd_pcm_drop(st->pcm);
+	st->buffer_size = buffer_size;
+	st->adapt.stable_since = platform_get_time_ns();
+	st->adapt.silent_frames = 0;
+	return configure_pcm(st->pcm, st->rate, &st->period_size, &st->buffer_size, &st->format);
+}
 
-	const snd_pcm_channel_area_t *my_areas;
-	snd_pcm_uframes_t offset, frames, size;
-	snd_pcm_sframes_t commitres;
-	int err, count;
+// recovers stream from err and grows the buffer after repeated xruns in adaptive mode
+// returns 0 on success or a negative error code if pcm can not be recovered
+static int recover_stream(struct audio_stream *st, int err)
+{
+	if (err == -EPIPE) stat_add(&stats.xruns, 1);
+	else if (err == -ESTRPIPE) stat_add(&stats.suspends, 1);
+
+	err = xrun_recovery(st->pcm, err);
+	if (err < 0 || !st->adaptive) return err;
+
+	struct adapt_state *a = &st->adapt;
+	const uint64_t now = platform_get_time_ns();
+	a->stable_since = now;
+	if (!a->xruns || now - a->window_start > ADAPT_WINDOW_NS) {
+		a->xruns = 0;
+		a->window_start = now;
+	}
+	if (++a->xruns < ADAPT_XRUNS || st->buffer_size * 2 > ADAPT_MAX_BUFFER_FRAMES)
+		return 0;
 
-	data->period_size = period_size;
-	data->sp_state = sp_state;
+	a->xruns = 0;
+	return resize_stream(st, st->buffer_size * 2);
+}
 
-	err = snd_async_add_pcm_handler(&ahandler, handle, async_callback, data);
+// shrinks the buffer in adaptive mode once it has been stable for a while
+// waits until the whole buffer is silent so nothing audible is dropped
+// returns 1 if the stream was resized, 0 if not, or a negative error code
+static int shrink_stream(struct audio_stream *st)
+{
+	const struct adapt_state *a = &st->adapt;
+	if (st->buffer_size <= 2 * st->period_size || a->silent_frames < st->buffer_size)
+		return 0;
+	if (platform_get_time_ns() - a->stable_since < ADAPT_STABLE_NS)
+		return 0;
+
+	snd_pcm_uframes_t buffer_size = st->buffer_size / 2;
+	if (buffer_size < 2 * st->period_size) buffer_size = 2 * st->period_size;
+	const int err = resize_stream(st, buffer_size);
+	return err < 0 ? err : 1;
+}
+
+// blocks until pcm has room for more frames
+// returns 0 when ready or a negative error code on xrun or suspend
+static int wait_for_poll(snd_pcm_t *pcm, struct pollfd *ufds, unsigned int count)
+{
+	unsigned short revents;
+	while (1) {
+		if (poll(ufds, count, -1) < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		snd_pcm_poll_descriptors_revents(pcm, ufds, count, &revents);
+		if (revents & POLLERR) {
+			const snd_pcm_state_t state = snd_pcm_state(pcm);
+			if (state == SND_PCM_STATE_XRUN) return -EPIPE;
+			if (state == SND_PCM_STATE_SUSPENDED) return -ESTRPIPE;
+			return -EIO;
+		}
+		if (revents & POLLOUT) return 0;
+	}
+}
+
+// audio thread main loop
+// sleeps on the pcm poll descriptors and writes a period whenever one is free
+// after an xrun the buffer is filled again before restarting the pcm
+// returns only on an unrecoverable error
+static void audio_loop(struct audio_stream *st)
+{
+	snd_pcm_t *pcm = st->pcm;
+	int err;
+
+	const int count = snd_pcm_poll_descriptors_count(pcm);
+	if (count <= 0) {
+		log_msg(LOG_ERROR, "Invalid poll descriptors count");
+		return;
+	}
+	struct pollfd *ufds = malloc(sizeof(struct pollfd) * count);
+	if (!ufds) {
+		log_msg(LOG_ERROR, "Unable to allocate poll descriptors");
+		return;
+	}
+	err = snd_pcm_poll_descriptors(pcm, ufds, count);
 	if (err < 0) {
-		printf("Unable to register async handler\n");
-		exit(EXIT_FAILURE);
-	}
-	for (count = 0; count < 2; count++) {
-		size = period_size;
-		while (size > 0) {
-			frames = size;
-			const int avail = snd_pcm_avail_update(handle);
-			if (avail < 0) {
-				err = xrun_recovery(handle, avail);
-				if (err < 0) {
-					printf("avail update failed: %s\n",
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
+		log_msg(LOG_ERROR, "Unable to obtain poll descriptors: %s", snd_strerror(err));
+		free(ufds);
+		return;
+	}
+
+	// pcm is prepared but not running, fill the buffer first
+	int running = 0;
+	while (1) {
+		if (running) {
+			err = wait_for_poll(pcm, ufds, count);
+			if (err < 0) {
+				if ((err = recover_stream(st, err)) < 0) {
+					log_msg(LOG_ERROR, "Poll error: %s", snd_strerror(err));
+					break;
 				}
+				running = 0;
 				continue;
 			}
+		}
 
-			err = snd_pcm_mmap_begin(
-					handle, &my_areas, &offset, &frames);
-			if (err < 0) {
-				if ((err = xrun_recovery(handle, err)) < 0) {
-					printf("MMAP begin avail error: %s\n",
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
-				}
+		const snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+		if (avail < 0) {
+			if ((err = recover_stream(st, avail)) < 0) {
+				log_msg(LOG_ERROR, "Avail update failed: %s", snd_strerror(err));
+				break;
 			}
+			running = 0;
+			continue;
+		}
 
-			// implemented by non-platform code
-			sp_plus_fill_audio_buffer(	
-					sp_state, 
-					my_areas[0].addr + 
-					offset * my_areas[0].step / 8, 
-					frames);
-			commitres = snd_pcm_mmap_commit(handle, offset, frames);
-			if (commitres < 0 || 
-					(snd_pcm_uframes_t)commitres != frames) {
-				if ((err = xrun_recovery(handle, commitres >= 0 ? 
-								-EPIPE : 
-								commitres)) < 0) {
-
-					printf("MMAP commit error: %s\n",
-							snd_strerror(err));
-					exit(EXIT_FAILURE);
+		if ((snd_pcm_uframes_t) avail < st->period_size) {
+			// buffer is full, start pcm unless the start threshold already did
+			if (!running && snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+				err = snd_pcm_start(pcm);
+				if (err < 0) {
+					log_msg(LOG_ERROR, "Start error: %s", snd_strerror(err));
+					break;
 				}
 			}
-			size -= frames;
+			running = 1;
+			continue;
+		}
+
+		const uint64_t start = platform_get_time_ns();
+		TRACE_BEGIN("audio_period");
+		err = write_period(st);
+		TRACE_END("audio_period");
+		record_period(st->rate, st->period_size, platform_get_time_ns() - start);
+		if (err < 0) {
+			if ((err = recover_stream(st, err)) < 0) {
+				log_msg(LOG_ERROR, "MMAP write error: %s", snd_strerror(err));
+				break;
+			}
+			running = 0;
+			continue;
+		}
+
+		if (st->adaptive) {
+			err = shrink_stream(st);
+			if (err < 0) {
+				log_msg(LOG_ERROR, "Unable to resize buffer: %s", snd_strerror(err));
+				break;
+			}
+			if (err) running = 0;
 		}
 	}
+	free(ufds);
+}
 
-	err = snd_pcm_start(handle);
-	if (err < 0) {
-		printf("Start error: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
+// returns 1 if pcm can play the engine's frame layout without the plug layer
+static int supports_direct_playback(snd_pcm_t *pcm)
+{
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	if (snd_pcm_hw_params_any(pcm, params) < 0
+			|| snd_pcm_hw_params_set_access(pcm, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0
+			|| snd_pcm_hw_params_set_channels(pcm, params, NUM_CHANNELS) < 0)
+		return 0;
+	for (size_t f = 0; f < NUM_OUTPUT_FORMATS; f++) {
+		if (!snd_pcm_hw_params_test_format(pcm, params, output_formats[f].alsa)) return 1;
 	}
 	return 0;
 }
 
-// open a pcm device and initialize parameters
-snd_pcm_t *init_alsa(void) 
+// open a pcm device
+// a plughw: device is opened as the matching hw: device when the hardware
+// takes the engine's frame layout directly, skipping the plug layer
+static snd_pcm_t *init_alsa(const char *device) 
 {
 	int err;
-	// TODO make device configurable
-	const char* dev_id = "plughw:1,0";
 	snd_pcm_t *pcm;
 
-	err = snd_pcm_open(&pcm, dev_id, SND_PCM_STREAM_PLAYBACK, 0);
+	if (!strncmp(device, "plughw:", 7)) {
+		char hw_device[128];
+		snprintf(hw_device, sizeof(hw_device), "hw:%s", device + 7);
+		if (snd_pcm_open(&pcm, hw_device, SND_PCM_STREAM_PLAYBACK, 0) >= 0) {
+			if (supports_direct_playback(pcm)) {
+				log_msg(LOG_INFO, "Using %s instead of %s", hw_device, device);
+				return pcm;
+			}
+			snd_pcm_close(pcm);
+		}
+	}
+
+	err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
 	if (err < 0) {
-		fprintf(stderr, "Error opening PCM device: %s\n", snd_strerror(err));
+		log_msg(LOG_ERROR, "Error opening PCM device %s: %s", device, snd_strerror(err));
 		return NULL;
 	}
 	
 	return pcm;
 }
 
-struct start_alsa_args {
-	void *sp_state;
-	snd_pcm_t *pcm;
-};
-	
-static void *start_alsa(struct start_alsa_args *args)
+// picks the engine rate from the rates pcm runs at without resampling
+// returns preferred if supported, otherwise the first supported common rate
+static unsigned int negotiate_rate(snd_pcm_t *pcm, unsigned int preferred)
 {
-	void *sp_state = args->sp_state;
-	snd_pcm_t *pcm = args->pcm;
+	static const unsigned int rates[] = {48000, 44100, 96000, 88200, 192000, 176400};
 
-	int err;
-	snd_pcm_uframes_t buffer_size, period_size;
-
-	snd_pcm_hw_params_t* hwparams;
-	snd_pcm_sw_params_t* swparams;
-	snd_pcm_hw_params_alloca(&hwparams);
-	snd_pcm_sw_params_alloca(&swparams);
+	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	if (snd_pcm_hw_params_any(pcm, params) < 0 
+			|| snd_pcm_hw_params_set_rate_resample(pcm, params, 0) < 0)
+		return preferred;
 
-	err = set_hwparams(pcm, &buffer_size, &period_size, hwparams);
-	if (err < 0) {
-		printf("Setting of hwparams failed: %s\n", snd_strerror(err));
-		return NULL;
+	if (!snd_pcm_hw_params_test_rate(pcm, params, preferred, 0)) return preferred;
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		if (!snd_pcm_hw_params_test_rate(pcm, params, rates[i], 0)) return rates[i];
 	}
 
-	err = set_swparams(pcm, buffer_size, period_size, swparams);
-	if (err < 0) {
-		printf("Setting of swparams failed: %s\n", snd_strerror(err));
-		return NULL;
-	}
+	unsigned int rate = preferred;
+	snd_pcm_hw_params_set_rate_near(pcm, params, &rate, 0);
+	return rate;
+}
 
-	err = snd_pcm_prepare(pcm);
-	if (err < 0) {
-		printf("Failed to prepare pcm device\n");
-		return NULL;
-	}
-	err = async_init(pcm, sp_state, period_size);
+/* ALSA backend */
 
-	if (err < 0) {
-		return NULL;
-	}
+// opens cfg->device and sets cfg->rate to a rate it runs at natively
+// returns 0 on success and -1 on failure
+static int open_alsa(struct audio_config *cfg, void **handle)
+{
+	snd_pcm_t *pcm = init_alsa(cfg->device);
+	if (!pcm) return -1;
+	cfg->rate = negotiate_rate(pcm, cfg->rate);
+	*handle = pcm;
+	return 0;
+}
 
-	while(1) {
-		sleep(1);
+static void run_alsa(void *handle, void *sp_state, const struct audio_config *cfg)
+{
+	struct audio_stream st = {
+		.pcm = handle,
+		.sp_state = sp_state,
+		.rate = cfg->rate,
+		.adaptive = cfg->adaptive,
+	};
+
+	// adaptive mode starts from the smallest period the device accepts
+	if (!st.adaptive) {
+		st.period_size = cfg->period_frames;
+		st.buffer_size = cfg->buffer_frames;
 	}
-	return NULL;
+	if (configure_pcm(st.pcm, st.rate, &st.period_size, &st.buffer_size, &st.format) < 0)
+		return;
+	st.adapt.stable_since = platform_get_time_ns();
+
+	audio_loop(&st);
+}
+
+/* Audio info */
+void platform_get_audio_info(struct audio_info *info)
+{
+	info->period_frames = atomic_load_explicit(&stream_period_frames, memory_order_relaxed);
+	info->buffer_frames = atomic_load_explicit(&stream_buffer_frames, memory_order_relaxed);
+	info->sample_rate = atomic_load_explicit(&stream_rate, memory_order_relaxed);
+	info->format = atomic_load_explicit(&stream_format, memory_order_relaxed);
+}
+
+void platform_get_audio_stats(struct audio_stats *s)
+{
+	s->load = atomic_load_explicit(&stats.load, memory_order_relaxed);
+	s->peak_load = atomic_load_explicit(&stats.peak_load, memory_order_relaxed);
+	s->periods = atomic_load_explicit(&stats.periods, memory_order_relaxed);
+	s->xruns = atomic_load_explicit(&stats.xruns, memory_order_relaxed);
+	s->suspends = atomic_load_explicit(&stats.suspends, memory_order_relaxed);
+	for (int i = 0; i < LOAD_HIST_BUCKETS; i++)
+		s->load_hist[i] = atomic_load_explicit(stats.load_hist + i, memory_order_relaxed);
+}
+
+void platform_reset_audio_stats(void)
+{
+	atomic_store_explicit(&stats.reset, 1, memory_order_release);
 }
@@ -1,19 +1,41 @@
+// for cpu affinity
+#define _GNU_SOURCE
+
 #include "../sp_plus.h"
+#include "../sp_trace.h"
+#include "../sp_log.h"
 
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <unistd.h>
 // TODO create thread abstraction for program?
 #include <pthread.h>
+#include <semaphore.h>
 
 #include "linux_audio.c"
+#include "null_audio.c"
+#include "file_audio.c"
+#include "bounce.c"
 
 #define NSEC_PER_SEC 1000000000
 #define NSEC_PER_MS 1000000
 
+#define DEFAULT_RT_PRIORITY 80
+#define CONFIG_PATH ".config/sp-plus/config"	// relative to home directory
+#define DEFAULT_OUT_PATH "sp-plus-out.wav"
+#define DEFAULT_OUT_SECONDS 10
+#define DEFAULT_STREAM_SECONDS 30
+
+// set by --realtime, enables prefaulting of memory used by the audio thread
+static int realtime_mode;
+
 /* X11 implementation */
 
 struct x_window_data {
@@ -30,6 +52,24 @@ struct x_window_data {
 	char *pixel_buf;		// pixels to be rendered to window
 };
 
+// converts X server time of an event to platform_get_time_ns time
+// the offset between the clocks is estimated as the smallest
+// difference seen between receiving an event and its timestamp
+// and resynced if it is off by more than a second (server time wraps)
+static uint64_t x_time_to_ns(Time t)
+{
+	static int64_t offset;
+	static int have_offset;
+
+	const int64_t now = platform_get_time_ns();
+	const int64_t d = now - (int64_t) t * NSEC_PER_MS;
+	if (!have_offset || d < offset || d - offset > NSEC_PER_SEC) {
+		offset = d;
+		have_offset = 1;
+	}
+	return (uint64_t) ((int64_t) t * NSEC_PER_MS + offset);
+}
+
 // converts X keycode to sp_plus Key type
 static int key_x_to_sp(XKeyEvent *ev)
 {
@@ -110,9 +150,16 @@ static int key_x_to_sp(XKeyEvent *ev)
 		case XK_space:
 			return KEY_SPACE;
 		case XK_minus:
+		case XK_underscore:
 			return KEY_MINUS;
 		case XK_equal:
 			return KEY_EQUAL;
+		case XK_period:
+		case XK_greater:
+			return KEY_PERIOD;
+		case XK_slash:
+		case XK_question:
+			return KEY_SLASH;
 		case XK_Shift_L:
 			return KEY_SHIFT_L;
 		case XK_Shift_R:
@@ -220,6 +267,10 @@ static int key_sp_to_x (Display *d, int key)
 			return XKeysymToKeycode(d, XK_minus);
 		case KEY_EQUAL:
 			return XKeysymToKeycode(d, XK_equal);
+		case KEY_PERIOD:
+			return XKeysymToKeycode(d, XK_period);
+		case KEY_SLASH:
+			return XKeysymToKeycode(d, XK_slash);
 		case KEY_SHIFT_L:
 			return XKeysymToKeycode(d, XK_Shift_L);
 		case KEY_SHIFT_R:
@@ -256,7 +307,7 @@ void init_x_window(struct x_window_data *data)
 
 	Display *display = XOpenDisplay(NULL);
 	if (!display) {
-		fprintf(stderr, "Could not open display\n");
+		log_msg(LOG_ERROR, "Could not open display");
 		exit(1);
 	}
 
@@ -272,7 +323,7 @@ void init_x_window(struct x_window_data *data)
 				screen_bit_depth, 
 				TrueColor, 
 				&visinfo)) {
-		fprintf(stderr, "No matching visual info\n");
+		log_msg(LOG_ERROR, "No matching visual info");
 		exit(1);
 	}
 
@@ -281,7 +332,7 @@ void init_x_window(struct x_window_data *data)
 	attributes.background_pixel = 0;
 	attributes.colormap = XCreateColormap(display, root, visinfo.visual, AllocNone);
 	// attributes.event_mask = StructureNotifyMask | KeyPressMask;
-	attributes.event_mask = KeyPressMask;
+	attributes.event_mask = KeyPressMask | KeyReleaseMask;
 	attributes.bit_gravity = StaticGravity;	// prevents flickering on window resize
 	unsigned long attribute_mask = 
 		CWBackPixel | CWColormap | CWEventMask | CWBitGravity;
@@ -293,7 +344,7 @@ void init_x_window(struct x_window_data *data)
 			InputOutput, visinfo.visual, 
 			attribute_mask, &attributes);
 	if (!window) {
-		fprintf(stderr, "Could not create window\n");
+		log_msg(LOG_ERROR, "Could not create window");
 		exit(1);
 	}
 
@@ -344,32 +395,330 @@ void init_x_window(struct x_window_data *data)
 	data->pixel_buf = pixel_buf;
 }
 
+/* audio backends */
+
+// an output the audio thread can drive the engine with
+struct audio_backend {
+	const char *name;
+	// opens the output and sets cfg->rate to the rate it runs at
+	// returns 0 and a handle for run on success and -1 on failure
+	int (*open)(struct audio_config *cfg, void **handle);
+	// audio thread body, returns when the output stops
+	void (*run)(void *handle, void *sp_state, const struct audio_config *cfg);
+};
+
+static const struct audio_backend audio_backends[] = {
+	{ "alsa", open_alsa, run_alsa },
+	{ "null", open_null, run_null },
+	{ "file", open_file, run_file },
+};
 
+// returns backend called name or NULL if there is none
+static const struct audio_backend *find_audio_backend(const char *name)
+{
+	for (size_t i = 0; i < sizeof(audio_backends) / sizeof(audio_backends[0]); i++) {
+		if (!strcmp(audio_backends[i].name, name)) return audio_backends + i;
+	}
+	return NULL;
+}
+
+struct audio_thread_args {
+	const struct audio_backend *backend;
+	void *handle;
+	void *sp_state;
+	struct audio_config cfg;
+};
+
+static void *start_audio(void *p)
+{
+	struct audio_thread_args *args = p;
+	trace_register_thread("audio");
+	set_audio_thread_realtime(&args->cfg.rt);
+	args->backend->run(args->handle, args->sp_state, &args->cfg);
+	return NULL;
+}
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  --config PATH      read options from PATH (default ~/" CONFIG_PATH ")\n"
+			"  --audio NAME       audio backend: alsa, null or file (default alsa)\n"
+			"  --device NAME      alsa playback device (default " DEFAULT_DEVICE ")\n"
+			"  --rate N           preferred sample rate if the device supports it\n"
+			"  --period N         frames per period (default %d)\n"
+			"  --buffer N         frames in device buffer (default %d)\n"
+			"  --adaptive         start at lowest latency and grow buffer on xruns\n"
+			"  --realtime         run audio thread with SCHED_FIFO and lock memory\n"
+			"  --rt-priority N    SCHED_FIFO priority of audio thread (default %d)\n"
+			"  --rt-cpu N         pin audio thread to cpu N\n"
+			"  --out PATH         wav the file backend writes (default " DEFAULT_OUT_PATH ")\n"
+			"  --length N         seconds the file backend renders (default %d)\n"
+			"  --out-format FMT   wav format of file output, float or s24 (default float)\n"
+			"  --bounce SCRIPT    render SCRIPT to --out without audio device or window\n"
+			"  --trace PATH       record a Chrome trace from startup and write it to PATH at exit\n"
+			"  --log PATH         append log to PATH instead of stderr\n"
+			"  --stream-threshold N  stream samples longer than N seconds from disk,\n"
+			"                     0 loads every sample into memory (default %d)\n"
+			"config file lines are options without dashes, e.g. \"period = 256\"\n",
+			name, DEFAULT_PERIOD_FRAMES, DEFAULT_BUFFER_FRAMES, DEFAULT_RT_PRIORITY,
+			DEFAULT_OUT_SECONDS, DEFAULT_STREAM_SECONDS);
+}
+
+// returns 1 if option key takes no value
+static int is_flag(const char *key)
+{
+	return !strcmp(key, "adaptive") || !strcmp(key, "realtime");
+}
+
+// applies one option from the command line or config file
+// value is NULL for flags given without one
+// returns 0 on success and -1 on an unknown option or bad value
+static int set_option(struct audio_config *cfg, const char *key, const char *value)
+{
+	if (is_flag(key)) {
+		const int on = !value || atoi(value) || !strcmp(value, "yes") || !strcmp(value, "true");
+		if (!strcmp(key, "adaptive")) cfg->adaptive = on;
+		else cfg->rt.enabled = on;
+		return 0;
+	}
+	if (!value) {
+		fprintf(stderr, "Option %s needs a value\n", key);
+		return -1;
+	}
+
+	if (!strcmp(key, "audio")) {
+		if (!find_audio_backend(value)) {
+			fprintf(stderr, "Unknown audio backend %s\n", value);
+			return -1;
+		}
+		cfg->backend = strdup(value);
+	} else if (!strcmp(key, "device")) {
+		cfg->device = strdup(value);
+	} else if (!strcmp(key, "out")) {
+		cfg->out_path = strdup(value);
+	} else if (!strcmp(key, "out-format")) {
+		if (!strcmp(value, "float")) {
+			cfg->out_format = AUDIO_FORMAT_FLOAT;
+		} else if (!strcmp(value, "s24")) {
+			cfg->out_format = AUDIO_FORMAT_S24_3;
+		} else {
+			fprintf(stderr, "Invalid out-format %s\n", value);
+			return -1;
+		}
+	} else if (!strcmp(key, "bounce")) {
+		cfg->bounce_path = strdup(value);
+	} else if (!strcmp(key, "trace")) {
+		cfg->trace_path = strdup(value);
+	} else if (!strcmp(key, "log")) {
+		cfg->log_path = strdup(value);
+	} else if (!strcmp(key, "length")) {
+		const int seconds = atoi(value);
+		if (seconds <= 0) {
+			fprintf(stderr, "Invalid length %s\n", value);
+			return -1;
+		}
+		cfg->out_seconds = seconds;
+	} else if (!strcmp(key, "stream-threshold")) {
+		const int seconds = atoi(value);
+		if (seconds < 0 || (!seconds && strcmp(value, "0"))) {
+			fprintf(stderr, "Invalid stream-threshold %s\n", value);
+			return -1;
+		}
+		cfg->stream_seconds = seconds;
+	} else if (!strcmp(key, "rate")) {
+		cfg->rate = atoi(value);
+		if (cfg->rate < 8000 || cfg->rate > 384000) {
+			fprintf(stderr, "Invalid rate %s\n", value);
+			return -1;
+		}
+	} else if (!strcmp(key, "period") || !strcmp(key, "buffer")) {
+		const long frames = atol(value);
+		if (frames <= 0) {
+			fprintf(stderr, "Invalid %s size %s\n", key, value);
+			return -1;
+		}
+		if (key[0] == 'p') cfg->period_frames = frames;
+		else cfg->buffer_frames = frames;
+	} else if (!strcmp(key, "rt-priority")) {
+		cfg->rt.priority = atoi(value);
+		const int min = sched_get_priority_min(SCHED_FIFO);
+		const int max = sched_get_priority_max(SCHED_FIFO);
+		if (cfg->rt.priority < min || cfg->rt.priority > max) {
+			fprintf(stderr, "rt-priority must be between %d and %d\n", min, max);
+			return -1;
+		}
+	} else if (!strcmp(key, "rt-cpu")) {
+		cfg->rt.cpu = atoi(value);
+		if (cfg->rt.cpu < 0 || cfg->rt.cpu >= CPU_SETSIZE) {
+			fprintf(stderr, "Invalid cpu %s\n", value);
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "Unknown option %s\n", key);
+		return -1;
+	}
+	return 0;
+}
+
+// reads "key = value" or "key value" lines, # starts a comment
+// returns 0 on success or if the file does not exist and -1 on a bad option
+static int read_config_file(struct audio_config *cfg, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) return 0;
+
+	char line[512];
+	int line_num = 0;
+	int err = 0;
+	while (!err && fgets(line, sizeof(line), f)) {
+		line_num++;
+		char *c = strchr(line, '#');
+		if (c) *c = '\0';
+
+		char *key = strtok(line, " \t\r\n=");
+		if (!key) continue;
+		char *value = strtok(NULL, " \t\r\n=");
+
+		if (set_option(cfg, key, value)) {
+			fprintf(stderr, "%s:%d: invalid option\n", path, line_num);
+			err = -1;
+		}
+	}
+	fclose(f);
+	return err;
+}
+
+// fills cfg from defaults, then the config file, then the command line
+// returns 0 on success and -1 on an invalid option
+static int parse_args(int argc, char **argv, struct audio_config *cfg)
+{
+	cfg->backend = "alsa";
+	cfg->device = DEFAULT_DEVICE;
+	cfg->rate = DEFAULT_SAMPLE_RATE;
+	cfg->period_frames = DEFAULT_PERIOD_FRAMES;
+	cfg->buffer_frames = DEFAULT_BUFFER_FRAMES;
+	cfg->adaptive = 0;
+	cfg->rt.enabled = 0;
+	cfg->rt.priority = DEFAULT_RT_PRIORITY;
+	cfg->rt.cpu = -1;
+	cfg->out_path = DEFAULT_OUT_PATH;
+	cfg->out_seconds = DEFAULT_OUT_SECONDS;
+	cfg->stream_seconds = DEFAULT_STREAM_SECONDS;
+	cfg->out_format = AUDIO_FORMAT_FLOAT;
+	cfg->bounce_path = NULL;
+	cfg->trace_path = NULL;
+	cfg->log_path = NULL;
+
+	// config file is read first so the command line overrides it
+	const char *config = NULL;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (!strcmp(argv[i], "--config")) config = argv[i + 1];
+	}
+	if (config) {
+		if (access(config, R_OK)) {
+			fprintf(stderr, "Cannot read config file %s\n", config);
+			return -1;
+		}
+		if (read_config_file(cfg, config)) return -1;
+	} else {
+		const char *home = getenv("HOME");
+		if (home) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", home, CONFIG_PATH);
+			if (read_config_file(cfg, path)) return -1;
+		}
+	}
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--", 2)) return -1;
+		const char *key = argv[i] + 2;
+		if (!strcmp(key, "config")) {
+			i++;
+			continue;
+		}
+
+		const char *value = NULL;
+		if (!is_flag(key)) {
+			if (i + 1 >= argc) return -1;
+			value = argv[++i];
+		}
+		if (set_option(cfg, key, value)) return -1;
+	}
+	return 0;
+}
+
+// locks memory in ram so playback never waits on swap, pages mapped later
+// are locked once first touched, see platform_prefault
+// mapped wavs are unlocked again in platform_map_file so streamed files are not pinned
+// allocations fail past RLIMIT_MEMLOCK, realtime setups usually lift it
+// logs and continues without locking if not permitted
+static void lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT)) {
+		log_msg(LOG_WARN, "realtime: mlockall failed (%s), memory may be paged out, "
+				"check RLIMIT_MEMLOCK (ulimit -l)", strerror(errno));
+	}
+}
+
+// writes the trace started by --trace, if any
+static void write_trace(const struct audio_config *cfg)
+{
+	if (cfg->trace_path && !trace_write(cfg->trace_path))
+		log_msg(LOG_INFO, "Wrote trace to %s", cfg->trace_path);
+}
 
 /* update and render loop lives here
  * calls sp_plus services to get audio visual output */
 
 int main (int argc, char **argv)
 {
+	struct audio_config cfg;
+	if (parse_args(argc, argv, &cfg)) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+
+	// messages from every thread are written by the log thread from here on
+	// and flushed at exit
+	if (log_start(cfg.log_path)) exit(1);
+	atexit(log_stop);
+
+	trace_register_thread("main");
+	if (cfg.trace_path) trace_set_enabled(1);
+
+	// offline render needs neither audio device nor window
+	if (cfg.bounce_path) {
+		const int err = bounce(&cfg);
+		write_trace(&cfg);
+		exit(err ? 1 : 0);
+	}
+
+	if (cfg.rt.enabled) realtime_mode = 1;
+
+	// open audio output first, the engine runs at the rate it negotiates
+	// audio thread uses fill_audio_buffer declared in sp_plus.h
+	// without a sound card the null backend keeps the engine clock running
+	const struct audio_backend *backend = find_audio_backend(cfg.backend);
+	void *audio_handle = NULL;
+	if (backend->open(&cfg, &audio_handle)) {
+		log_msg(LOG_WARN, "Error starting %s audio, using null output", backend->name);
+		backend = find_audio_backend("null");
+		backend->open(&cfg, &audio_handle);
+	}
+
 	// TODO Error logging for thes init functions
 	// init program state
 	// state memory allocated, managed, and freed, by sp_plus
-	void *sp_state = sp_plus_allocate_state();
+	void *sp_state = sp_plus_allocate_state(cfg.rate);
 	if (!sp_state) {
-		fprintf(stderr, "Error allocating state memory\n");
+		log_msg(LOG_ERROR, "Error allocating state memory");
 		exit(1);
 	}
+	sp_plus_set_stream_threshold(sp_state, cfg.stream_seconds);
 
-	// start audio callback
-	// audio callback uses fill_audio_buffer declared in sp_plus.h
-	snd_pcm_t *pcm = init_alsa();
-	if (!pcm) {
-		fprintf(stderr, "Error starting audio\n");
-		// TODO: Devide what to did if audio is not started
-		// always exiting is annoying for debuggin
-
-		//exit(1);
-	}
+	// lock the engine state and everything allocated from here on
+	if (realtime_mode) lock_memory();
 
 	// Start audio thread
 	// TODO may want to abstract if using threads for rest of program
@@ -378,9 +727,9 @@ int main (int argc, char **argv)
 
 
 	pthread_t audio_thread;
-	struct start_alsa_args audio_thread_args = {sp_state, pcm};
-	if (pthread_create(&audio_thread, NULL,  (void * (*)(void *)) start_alsa, &audio_thread_args)) {
-		fprintf(stderr, "Error starting audio thread\n");
+	struct audio_thread_args audio_thread_args = {backend, audio_handle, sp_state, cfg};
+	if (pthread_create(&audio_thread, NULL, start_audio, &audio_thread_args)) {
+		log_msg(LOG_ERROR, "Error starting audio thread");
 	}
 
 	/*
@@ -399,7 +748,7 @@ int main (int argc, char **argv)
 	// request delete window message from window manager
 	Atom WM_DELETE_WINDOW = XInternAtom(x_data.display, "WM_DELETE_WINDOW", 0);
 	if (!XSetWMProtocols(x_data.display, x_data.window, &WM_DELETE_WINDOW, 1))
-		fprintf(stderr, "Could not register WM_DELETE_WINDOW property\n");
+		log_msg(LOG_ERROR, "Could not register WM_DELETE_WINDOW property");
 
 	// maximize screen
 	/*
@@ -449,7 +798,7 @@ int main (int argc, char **argv)
 		char curr_keystate[32];
 		XQueryKeymap(x_data.display, curr_keystate);
 
-		for (int sp_key = 0; sp_key <= KEY_ESCAPE; sp_key++) {
+		for (int sp_key = 0; sp_key < NUM_KEYS; sp_key++) {
 
 			const int keycode = key_sp_to_x(x_data.display, sp_key);
 			if (keycode < 0 || keycode >= 256) continue;
@@ -513,7 +862,18 @@ int main (int argc, char **argv)
 					{
 						XKeyPressedEvent *e = (XKeyPressedEvent *) &ev;
 						int key = key_x_to_sp(e);
-						if (key != -1) input.num_key_press[key]++;
+						if (key == -1) break;
+						if (!input.num_key_press[key])
+							input.key_press_time[key] = x_time_to_ns(e->time);
+						input.num_key_press[key]++;
+					} break;
+
+				case KeyRelease:
+					// only timestamps releases, key_released comes from the keymap
+					{
+						XKeyReleasedEvent *e = (XKeyReleasedEvent *) &ev;
+						int key = key_x_to_sp(e);
+						if (key != -1) input.key_release_time[key] = x_time_to_ns(e->time);
 					} break;
 			}
 		}
@@ -542,9 +902,11 @@ int main (int argc, char **argv)
 				x_data.height, x_data.pixel_bytes, &input);
 
 		// blit pixel_buf to screen
+		TRACE_BEGIN("XPutImage");
 		XPutImage(	x_data.display, x_data.window, x_data.default_gc,
 				x_data.x_window_buffer, 0, 0, 0, 0, 
 				x_data.width, x_data.height);
+		TRACE_END("XPutImage");
 
 		/* enforce frame cap */
 		struct timespec req;
@@ -580,6 +942,8 @@ int main (int argc, char **argv)
 
 		clock_gettime(CLOCK_REALTIME, &start_time_rt);
 	}
+	sp_plus_stop_loading(sp_state);
+	write_trace(&cfg);
 	// TODO should close alsa handles, may prevent popping
 	return 0;
 }
@@ -623,6 +987,92 @@ void platform_free_file_buffer(void **buffer)
 	if (*buffer) free(*buffer); 
 }
 
+const void *platform_map_file(const char *path, long *size)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	// the mapping keeps the file open
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+
+	// wavs are only read while loading or streaming, keep them out of locked memory
+	if (realtime_mode) munlock(data, st.st_size);
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return data;
+}
+
+void platform_unmap_file(const void *data, long size)
+{
+	munmap((void *) data, size);
+}
+
+// file handles hold a file descriptor
+static void *alloc_file_handle(int fd)
+{
+	int *f = malloc(sizeof(int));
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+	*f = fd;
+	return (void *) f;
+}
+
+void *platform_create_temp_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/sp-plus-XXXXXX", dir ? dir : "/tmp");
+
+	// unlinked right away so the file goes away with its last descriptor
+	const int fd = mkostemp(path, O_CLOEXEC);
+	if (fd == -1) return NULL;
+	unlink(path);
+	return alloc_file_handle(fd);
+}
+
+long platform_read_file_at(void *file, void *dest, long bytes, long offset)
+{
+	const int fd = *(int *) file;
+	long done = 0;
+	while (done < bytes) {
+		const ssize_t n = pread(fd, (char *) dest + done, bytes - done, offset + done);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) return -1;
+		if (!n) break;
+		done += n;
+	}
+	return done;
+}
+
+long platform_write_file_at(void *file, const void *src, long bytes, long offset)
+{
+	const int fd = *(int *) file;
+	long done = 0;
+	while (done < bytes) {
+		const ssize_t n = pwrite(fd, (const char *) src + done, bytes - done, offset + done);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1) return -1;
+		done += n;
+	}
+	return done;
+}
+
+void platform_close_file(void *file)
+{
+	close(*(int *) file);
+	free(file);
+}
+
 SP_DIR *platform_opendir(const char *path)
 {
 	return (SP_DIR *) opendir(path);
@@ -697,7 +1147,7 @@ char *platform_get_parent_dir(const char *dir)
 {
 	char *par_dir = malloc(sizeof(char) * (strlen(dir) + strlen("/..") + 1));
 	if (!par_dir) {
-		fprintf(stderr, "Error reaching parent directory\n");
+		log_msg(LOG_ERROR, "Error reaching parent directory");
 		return NULL;
 	}
 
@@ -727,3 +1177,74 @@ int platform_mutex_unlock(void *mutex)
 {
 	return pthread_mutex_unlock((pthread_mutex_t *) mutex);
 }
+
+void *platform_init_semaphore(void)
+{
+	sem_t *sem = malloc(sizeof(sem_t));
+	if (sem && sem_init(sem, 0, 0)) {
+		free(sem);
+		return NULL;
+	}
+	return (void *) sem;
+}
+
+void platform_semaphore_post(void *sem)
+{
+	sem_post((sem_t *) sem);
+}
+
+void platform_semaphore_wait(void *sem)
+{
+	while (sem_wait((sem_t *) sem) && errno == EINTR);
+}
+
+int platform_get_cpu_count(void)
+{
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+void *platform_create_thread(void *(*func)(void *), void *arg)
+{
+	pthread_t *t = malloc(sizeof(pthread_t));
+	if (!t) return NULL;
+	if (pthread_create(t, NULL, func, arg)) {
+		free(t);
+		return NULL;
+	}
+	return (void *) t;
+}
+
+int platform_join_thread(void *thread)
+{
+	const int err = pthread_join(*(pthread_t *) thread, NULL);
+	free(thread);
+	return err;
+}
+
+void platform_sleep_ns(uint64_t ns)
+{
+	struct timespec t = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC };
+	while (nanosleep(&t, &t) && errno == EINTR);
+}
+
+/* Time */
+uint64_t platform_get_time_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * NSEC_PER_SEC + t.tv_nsec;
+}
+
+/* Memory */
+void platform_prefault(void *buffer, long size)
+{
+	if (!realtime_mode || !buffer || size <= 0) return;
+
+	// write back what is read so untouched pages get their own frame
+	volatile char *p = buffer;
+	const long page = sysconf(_SC_PAGESIZE);
+	for (long i = 0; i < size; i += page)
+		p[i] = p[i];
+	p[size - 1] = p[size - 1];
+}
@@ -0,0 +1,54 @@
+#include <time.h>
+#include <errno.h>
+
+/* Null backend */
+
+// fills periods at the cadence a device running at cfg->rate would ask for them
+// and discards the output, so the engine runs normally without a sound card
+// a period that finishes after the next one was due counts as an xrun
+
+static int open_null(struct audio_config *cfg, void **handle)
+{
+	(void) cfg;
+	*handle = NULL;
+	return 0;
+}
+
+static void run_null(void *handle, void *sp_state, const struct audio_config *cfg)
+{
+	(void) handle;
+	const unsigned long period = cfg->period_frames;
+	float *buf = malloc(sizeof(float) * NUM_CHANNELS * period);
+	if (!buf) {
+		log_msg(LOG_ERROR, "null audio: could not allocate period buffer");
+		return;
+	}
+	platform_prefault(buf, sizeof(float) * NUM_CHANNELS * period);
+	publish_stream_info(cfg->rate, period, period, AUDIO_FORMAT_FLOAT);
+	log_msg(LOG_INFO, "Audio %uHz null output, period %lu frames", cfg->rate, period);
+
+	// deadlines are counted in frames from start so sleep overshoot does not drift
+	uint64_t start = platform_get_time_ns();
+	uint64_t frames = 0;
+	while (1) {
+		const uint64_t fill_start = platform_get_time_ns();
+		sp_plus_fill_audio_buffer(sp_state, buf, period, AUDIO_FORMAT_FLOAT);
+		const uint64_t now = platform_get_time_ns();
+		record_period(cfg->rate, period, now - fill_start);
+
+		frames += period;
+		uint64_t next = start + frames * 1000000000ULL / cfg->rate;
+		if (now > next) {
+			// missed the deadline, restart cadence from now like a recovered device
+			stat_add(&stats.xruns, 1);
+			start = next = now;
+			frames = 0;
+		}
+
+		const struct timespec t = {
+			.tv_sec = next / 1000000000ULL,
+			.tv_nsec = next % 1000000000ULL,
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+	}
+}
@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Mixer Command Queue
+///
+/// The ui thread never touches playback state directly. Changes are sent as
+/// commands through a single-producer single-consumer lock-free queue and
+/// applied by the audio thread at the start of each mix block.
+
+// returns 0 on success and -1 if queue is full
+// must only be called by the producing thread
+static int push_command(struct command_queue *q, const struct command *cmd)
+{
+	const uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head - tail >= CMD_QUEUE_SIZE) return -1;
+
+	q->cmds[head & (CMD_QUEUE_SIZE - 1)] = *cmd;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return 0;
+}
+
+// returns 0 on success and -1 if queue is empty
+// must only be called by the consuming thread
+static int pop_command(struct command_queue *q, struct command *cmd)
+{
+	const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	const uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (head == tail) return -1;
+
+	*cmd = q->cmds[tail & (CMD_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return 0;
+}
+
+// returns next command without removing it or NULL if queue is empty
+// must only be called by the consuming thread
+static const struct command *peek_command(struct command_queue *q)
+{
+	const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	const uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (head == tail) return NULL;
+
+	return q->cmds + (tail & (CMD_QUEUE_SIZE - 1));
+}
+
+// allocates an empty command queue or returns NULL on failure
+static struct command_queue *init_command_queue(void)
+{
+	struct command_queue *q = calloc(1, sizeof(*q));
+	if (!q) return NULL;
+
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return q;
+}
+
+// sends cmd from ui thread to audio thread
+// command is dropped if the audio thread has stopped consuming commands
+static void send_command(struct sp_state *sp_state, const struct command *cmd)
+{
+	if (push_command(sp_state->mixer.cmd_queue, cmd))
+		log_msg(LOG_WARN, "Mixer command queue full, dropping command %d", cmd->type);
+}
+
+static void send_sample_command(struct sp_state *sp_state, enum command_type type, struct sample *s)
+{
+	if (!s) return;
+	struct command cmd = { .type = type, .sample = s };
+	send_command(sp_state, &cmd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Event Timing
+///
+/// Input events carry the time they happened. The audio thread publishes its
+/// frame clock so the ui thread can turn that time into the frame the event
+/// should be heard on. Commands for a future frame wait in the queue and the
+/// audio thread splits its blocks so they apply on exactly that frame.
+
+// called by audio thread at the start of every fill_audio_buffer call
+static void publish_audio_clock(struct audio_clock *c, uint64_t frame, int period)
+{
+	const uint32_t seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+	atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&c->frame, frame, memory_order_relaxed);
+	atomic_store_explicit(&c->time_ns, platform_get_time_ns(), memory_order_relaxed);
+	atomic_store_explicit(&c->period, period, memory_order_relaxed);
+
+	atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+// frame on which an event at time_ns should be heard
+// returns 0 (next block) if the audio thread has not started yet
+static uint64_t get_event_frame(struct audio_clock *c, int rate, uint64_t time_ns)
+{
+	uint32_t seq;
+	uint64_t frame, clock_ns;
+	int period;
+	do {
+		seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+		frame = atomic_load_explicit(&c->frame, memory_order_relaxed);
+		clock_ns = atomic_load_explicit(&c->time_ns, memory_order_relaxed);
+		period = atomic_load_explicit(&c->period, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+	} while (seq & 1 || seq != atomic_load_explicit(&c->seq, memory_order_relaxed));
+
+	if (!clock_ns) return 0;
+	if (!time_ns) time_ns = platform_get_time_ns();
+
+	const int64_t dt = (int64_t) (time_ns - clock_ns);
+	const int64_t f = (int64_t) frame + (dt + INPUT_LATENCY_NS) * rate / 1000000000
+		+ period;
+	return f > 0 ? f : 0;
+}
+
+// sends a sample command to be applied on the frame matching time_ns
+static void send_timed_sample_command(struct sp_state *sp_state,
+		enum command_type type, struct sample *s, uint64_t time_ns)
+{
+	if (!s) return;
+	struct command cmd = { .type = type, .sample = s };
+	cmd.frame = get_event_frame(&sp_state->mixer.clock, sp_state->mixer.sample_rate, time_ns);
+	send_command(sp_state, &cmd);
+}
@@ -0,0 +1,284 @@
+#include "sp_convert.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define CONVERT_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+#define RANDOM_SCALE (1.0f / 16777216.0f)	// 24 random bits to [0, 1)
+
+// full scale and clip range of each format
+static const struct {
+	float scale;
+	float lo;
+	float hi;
+	int bytes;
+	const char *name;
+} format_info[] = {
+	[AUDIO_FORMAT_S16] = { 32768.0f, -32768.0f, 32767.0f, 2, "s16" },
+	[AUDIO_FORMAT_S24_3] = { 8388608.0f, -8388608.0f, 8388607.0f, 3, "s24_3" },
+	[AUDIO_FORMAT_S24] = { 8388608.0f, -8388608.0f, 8388607.0f, 4, "s24" },
+	// largest float below 2^31
+	[AUDIO_FORMAT_S32] = { 2147483648.0f, -2147483648.0f, 2147483520.0f, 4, "s32" },
+	[AUDIO_FORMAT_FLOAT] = { 1.0f, -1.0f, 1.0f, 4, "float" },
+};
+
+void init_dither(struct dither_state *d, uint32_t seed)
+{
+	for (int i = 0; i < DITHER_LANES; i++) {
+		// spread seed with a multiplicative hash, lanes must not be 0
+		d->lanes[i] = (seed + i) * 2654435761u;
+		if (!d->lanes[i]) d->lanes[i] = 1;
+	}
+}
+
+int get_format_bytes(enum audio_format format)
+{
+	return format_info[format].bytes;
+}
+
+const char *get_format_name(enum audio_format format)
+{
+	return format_info[format].name;
+}
+
+static inline void store_s24_3(uint8_t *dest, int32_t x)
+{
+	dest[0] = x;
+	dest[1] = x >> 8;
+	dest[2] = x >> 16;
+}
+
+/* Scalar */
+
+static inline uint32_t next_random(uint32_t *s)
+{
+	uint32_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *s = x;
+}
+
+// triangular noise in (-1, 1)
+static inline float tpdf_dither(uint32_t *s)
+{
+	const float a = (float) (next_random(s) >> 8) * RANDOM_SCALE;
+	const float b = (float) (next_random(s) >> 8) * RANDOM_SCALE;
+	return a - b;
+}
+
+// converts samples [start, end) of src, used by every kernel for its tail
+static void convert_samples_scalar(void *dest, const float *src, float gain_l, float gain_r,
+		int start, int end, enum audio_format format, struct dither_state *d)
+{
+	const float scale = format_info[format].scale;
+	const float lo = format_info[format].lo;
+	const float hi = format_info[format].hi;
+
+	for (int i = start; i < end; i++) {
+		float v = src[i] * (i & 1 ? gain_r : gain_l) * scale;
+		if (format == AUDIO_FORMAT_S16) v += tpdf_dither(d->lanes + (i & (DITHER_LANES - 1)));
+		if (v < lo) v = lo;
+		if (v > hi) v = hi;
+
+		switch (format) {
+			case AUDIO_FORMAT_S16:
+				((int16_t *) dest)[i] = lrintf(v);
+				break;
+			case AUDIO_FORMAT_S24_3:
+				store_s24_3((uint8_t *) dest + i * 3, lrintf(v));
+				break;
+			case AUDIO_FORMAT_S24:
+			case AUDIO_FORMAT_S32:
+				((int32_t *) dest)[i] = lrintf(v);
+				break;
+			case AUDIO_FORMAT_FLOAT:
+				((float *) dest)[i] = v;
+				break;
+		}
+	}
+}
+
+void convert_block_scalar(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d)
+{
+	convert_samples_scalar(dest, src, gain_l, gain_r, 0, frames * 2, format, d);
+}
+
+#ifdef CONVERT_KERNEL_X86
+
+/* SSE2, 8 samples per iteration */
+
+static inline __m128i next_random_sse2(__m128i *s)
+{
+	__m128i x = *s;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	return *s = x;
+}
+
+static inline __m128 tpdf_dither_sse2(__m128i *s)
+{
+	const __m128 scale = _mm_set1_ps(RANDOM_SCALE);
+	const __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(next_random_sse2(s), 8)), scale);
+	const __m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(next_random_sse2(s), 8)), scale);
+	return _mm_sub_ps(a, b);
+}
+
+static void convert_block_sse2(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d)
+{
+	const __m128 gain = _mm_set_ps(gain_r, gain_l, gain_r, gain_l);
+	const __m128 scale = _mm_set1_ps(format_info[format].scale);
+	const __m128 lo = _mm_set1_ps(format_info[format].lo);
+	const __m128 hi = _mm_set1_ps(format_info[format].hi);
+	const bool dither = format == AUDIO_FORMAT_S16;
+	const int n = frames * 2;
+
+	__m128i s0 = _mm_loadu_si128((const __m128i *) d->lanes);
+	__m128i s1 = _mm_loadu_si128((const __m128i *) (d->lanes + 4));
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m128 v0 = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(src + i), gain), scale);
+		__m128 v1 = _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), gain), scale);
+		if (dither) {
+			v0 = _mm_add_ps(v0, tpdf_dither_sse2(&s0));
+			v1 = _mm_add_ps(v1, tpdf_dither_sse2(&s1));
+		}
+		v0 = _mm_min_ps(_mm_max_ps(v0, lo), hi);
+		v1 = _mm_min_ps(_mm_max_ps(v1, lo), hi);
+
+		switch (format) {
+			case AUDIO_FORMAT_S16:
+				_mm_storeu_si128((__m128i *) ((int16_t *) dest + i),
+						_mm_packs_epi32(_mm_cvtps_epi32(v0), _mm_cvtps_epi32(v1)));
+				break;
+			case AUDIO_FORMAT_S24_3: {
+				int32_t tmp[8];
+				_mm_storeu_si128((__m128i *) tmp, _mm_cvtps_epi32(v0));
+				_mm_storeu_si128((__m128i *) (tmp + 4), _mm_cvtps_epi32(v1));
+				for (int j = 0; j < 8; j++)
+					store_s24_3((uint8_t *) dest + (i + j) * 3, tmp[j]);
+			} break;
+			case AUDIO_FORMAT_S24:
+			case AUDIO_FORMAT_S32:
+				_mm_storeu_si128((__m128i *) ((int32_t *) dest + i), _mm_cvtps_epi32(v0));
+				_mm_storeu_si128((__m128i *) ((int32_t *) dest + i + 4), _mm_cvtps_epi32(v1));
+				break;
+			case AUDIO_FORMAT_FLOAT:
+				_mm_storeu_ps((float *) dest + i, v0);
+				_mm_storeu_ps((float *) dest + i + 4, v1);
+				break;
+		}
+	}
+
+	_mm_storeu_si128((__m128i *) d->lanes, s0);
+	_mm_storeu_si128((__m128i *) (d->lanes + 4), s1);
+	convert_samples_scalar(dest, src, gain_l, gain_r, i, n, format, d);
+}
+
+/* AVX2, 8 samples per iteration */
+
+__attribute__((target("avx2")))
+static inline __m256i next_random_avx2(__m256i *s)
+{
+	__m256i x = *s;
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	return *s = x;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 tpdf_dither_avx2(__m256i *s)
+{
+	const __m256 scale = _mm256_set1_ps(RANDOM_SCALE);
+	const __m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(next_random_avx2(s), 8)), scale);
+	const __m256 b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(next_random_avx2(s), 8)), scale);
+	return _mm256_sub_ps(a, b);
+}
+
+__attribute__((target("avx2")))
+static void convert_block_avx2(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d)
+{
+	const __m256 gain = _mm256_set_ps(gain_r, gain_l, gain_r, gain_l, gain_r, gain_l, gain_r, gain_l);
+	const __m256 scale = _mm256_set1_ps(format_info[format].scale);
+	const __m256 lo = _mm256_set1_ps(format_info[format].lo);
+	const __m256 hi = _mm256_set1_ps(format_info[format].hi);
+	const bool dither = format == AUDIO_FORMAT_S16;
+	const int n = frames * 2;
+
+	__m256i s = _mm256_loadu_si256((const __m256i *) d->lanes);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 v = _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i), gain), scale);
+		if (dither) v = _mm256_add_ps(v, tpdf_dither_avx2(&s));
+		v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+
+		switch (format) {
+			case AUDIO_FORMAT_S16: {
+				const __m256i x = _mm256_cvtps_epi32(v);
+				_mm_storeu_si128((__m128i *) ((int16_t *) dest + i),
+						_mm_packs_epi32(_mm256_castsi256_si128(x),
+							_mm256_extracti128_si256(x, 1)));
+			} break;
+			case AUDIO_FORMAT_S24_3: {
+				int32_t tmp[8];
+				_mm256_storeu_si256((__m256i *) tmp, _mm256_cvtps_epi32(v));
+				for (int j = 0; j < 8; j++)
+					store_s24_3((uint8_t *) dest + (i + j) * 3, tmp[j]);
+			} break;
+			case AUDIO_FORMAT_S24:
+			case AUDIO_FORMAT_S32:
+				_mm256_storeu_si256((__m256i *) ((int32_t *) dest + i), _mm256_cvtps_epi32(v));
+				break;
+			case AUDIO_FORMAT_FLOAT:
+				_mm256_storeu_ps((float *) dest + i, v);
+				break;
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *) d->lanes, s);
+	convert_samples_scalar(dest, src, gain_l, gain_r, i, n, format, d);
+}
+
+#endif
+
+/* Dispatch */
+
+static void (*convert_kernel)(void *, const float *, float, float, int,
+		enum audio_format, struct dither_state *) = convert_block_scalar;
+static const char *convert_kernel_name = "scalar";
+
+void init_convert_kernel(void)
+{
+#ifdef CONVERT_KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		convert_kernel = convert_block_avx2;
+		convert_kernel_name = "avx2";
+	} else {
+		convert_kernel = convert_block_sse2;
+		convert_kernel_name = "sse2";
+	}
+#endif
+}
+
+void convert_block(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d)
+{
+	convert_kernel(dest, src, gain_l, gain_r, frames, format, d);
+}
+
+const char *get_convert_kernel_name(void)
+{
+	return convert_kernel_name;
+}
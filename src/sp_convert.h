@@ -0,0 +1,47 @@
+#ifndef SP_CONVERT_H
+#define SP_CONVERT_H
+
+#include "sp_plus.h"
+
+//////////////////////////////////////////////////////////////////
+/// Output Conversion
+///
+/// Converts the float master block to the device sample format,
+/// applying master gain and clipping in the same pass. 16 bit output
+/// gets TPDF dither, wider formats are rounded to nearest.
+
+#define DITHER_LANES 8
+
+// dither noise generator, one xorshift32 state per lane
+// sample i of a block uses lane i % DITHER_LANES so every kernel
+// produces the same noise as the scalar reference
+struct dither_state {
+	uint32_t lanes[DITHER_LANES];
+};
+
+void init_dither(struct dither_state *d, uint32_t seed);
+// seeds every lane from seed, seed must not be 0
+
+int get_format_bytes(enum audio_format format);
+// bytes per sample of format
+
+const char *get_format_name(enum audio_format format);
+// short name of format for display
+
+void init_convert_kernel(void);
+// selects fastest kernel supported by the cpu
+// must be called before convert_block
+
+void convert_block(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d);
+// converts frames of interleaved stereo src to format in dest
+// src left and right channels are scaled by gain_l and gain_r
+
+void convert_block_scalar(void *dest, const float *src, float gain_l, float gain_r,
+		int frames, enum audio_format format, struct dither_state *d);
+// reference implementation of convert_block
+
+const char *get_convert_kernel_name(void);
+// name of kernel selected by init_convert_kernel
+
+#endif
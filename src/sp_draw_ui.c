@@ -68,18 +68,16 @@ static void draw_waveform(
 	// draw wave lines
 	{
 		int32_t frame = first_frame_to_draw; 
-		double sum = 
-			(s->data[frame * NUM_CHANNELS] + 
-			 s->data[frame * NUM_CHANNELS + 1]) / 2.0;
-		int y = roundf((float) sum * (max_height / 2.0f) + wave_origin.y);
+		float sum = get_wave_value(s, frame);
+		int y = roundf(sum * (max_height / 2.0f) + wave_origin.y);
 		int x = wave_origin.x;
 		vec2i last_vertex = {x, y};
 
 		for (int i = 1; i < num_vertices; i++) {
 			frame = first_frame_to_draw + i * (int) frame_freq;
-			sum = (s->data[frame * NUM_CHANNELS] + s->data[frame * NUM_CHANNELS + 1]) / 2.0;
+			sum = get_wave_value(s, frame);
 
-			y = roundf((float) sum * (max_height / 2.0f) + wave_origin.y);
+			y = roundf(sum * (max_height / 2.0f) + wave_origin.y);
 			x = roundf((float) i * vertex_spacing + wave_origin.x);
 
 			const vec2i curr_vertex = {x, y};
@@ -126,6 +124,18 @@ static void draw_waveform(
 // Used when active sample is a null sample to prevent garbage ui output
 static const struct sample DUMMY_SAMPLE = {0};
 
+// permille loaded of the background load to pad of bank
+// returns -1 if no load to the pad is in progress
+static int get_pad_load_progress(const struct loader *l, int bank, int pad)
+{
+	for (int i = 0; l->num_jobs && i < MAX_LOAD_JOBS; i++) {
+		const struct load_job *job = l->jobs + i;
+		if (job->path && !job->superseded && job->bank == bank && job->pad == pad)
+			return atomic_load_explicit(&job->progress, memory_order_relaxed);
+	}
+	return -1;
+}
+
 static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buffer *buffer)
 {
 	ASSERT(sp_state);
@@ -158,7 +168,9 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 		draw_rec_outline(buffer, origin, BORDER_W, BORDER_H, WHITE);
 
 	// draw waveform
+	TRACE_BEGIN("draw_waveform");
 	draw_waveform(sp_state, buffer, WAVE_ORIGIN, VIEWER_W - 20, VIEWER_H - 20);
+	TRACE_END("draw_waveform");
 
 	/////////////////////////////////////////////////////////
 	/// info
@@ -201,15 +213,16 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	if (active_sample->num_frames) {
 		// total
 		const float speed = fabs(active_sample->speed);
-		int sec = active_sample->num_frames / SAMPLE_RATE / speed;
+		const int rate = sp_state->mixer.sample_rate;
+		int sec = active_sample->num_frames / rate / speed;
 		times[0] = sec / 60;
 		times[1] = sec % 60;
 		// active
-		sec = (active_sample->end_frame - active_sample->start_frame) / SAMPLE_RATE / speed;
+		sec = (active_sample->end_frame - active_sample->start_frame) / rate / speed;
 		times[2] = sec / 60;
 		times[3] = sec % 60;
 		// playback
-		sec = active_sample->next_frame / SAMPLE_RATE / speed;
+		sec = active_sample->next_frame / rate / speed;
 		times[4] = sec / 60;
 		times[5] = sec % 60;
 	} 
@@ -272,11 +285,11 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 
 	// attack / release
 	txt_pos.y += font_h;
-	snprintf(txt, 64, "attack: %.0fms", frames_to_ms(active_sample->attack));
+	snprintf(txt, 64, "attack: %.0fms", frames_to_ms(active_sample->attack, sp_state->mixer.sample_rate));
 	draw_text(buffer, txt, curr_font, txt_pos, WHITE);
 
 	txt_pos.y += font_h;
-	snprintf(txt, 64, "release: %.0fms", frames_to_ms(active_sample->release));
+	snprintf(txt, 64, "release: %.0fms", frames_to_ms(active_sample->release, sp_state->mixer.sample_rate));
 	draw_text(buffer, txt, curr_font, txt_pos, WHITE);
 
 	// pitch / speed
@@ -288,6 +301,12 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	snprintf(txt, 64, "speed: %.2fx", fabs(active_sample->speed));
 	draw_text(buffer, txt, curr_font, txt_pos, WHITE);
 
+	// voices
+	txt_pos.y += font_h;
+	snprintf(txt, 64, "voices: %d (steal %s)", active_sample->polyphony,
+			active_sample->steal_mode == STEAL_QUIETEST ? "quietest" : "oldest");
+	draw_text(buffer, txt, curr_font, txt_pos, WHITE);
+
 
 	///////////////////////////////////////////////////////////////////////////////
 	/// Move dialog box
@@ -332,7 +351,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	int PAD_HEIGHT = 40;
 
 	// Q
-	if (banks[curr_bank][PAD_Q] && banks[curr_bank][PAD_Q]->playing)
+	if (banks[curr_bank][PAD_Q] && banks[curr_bank][PAD_Q]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -341,7 +360,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// W
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_W] && banks[curr_bank][PAD_W]->playing)
+	if (banks[curr_bank][PAD_W] && banks[curr_bank][PAD_W]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -350,7 +369,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// E
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_E] && banks[curr_bank][PAD_E]->playing)
+	if (banks[curr_bank][PAD_E] && banks[curr_bank][PAD_E]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -359,7 +378,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// R
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_R] && banks[curr_bank][PAD_R]->playing)
+	if (banks[curr_bank][PAD_R] && banks[curr_bank][PAD_R]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -368,7 +387,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// A
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_A] && banks[curr_bank][PAD_A]->playing)
+	if (banks[curr_bank][PAD_A] && banks[curr_bank][PAD_A]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -377,7 +396,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// S
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_S] && banks[curr_bank][PAD_S]->playing)
+	if (banks[curr_bank][PAD_S] && banks[curr_bank][PAD_S]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -386,7 +405,7 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// D
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_D] && banks[curr_bank][PAD_D]->playing)
+	if (banks[curr_bank][PAD_D] && banks[curr_bank][PAD_D]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
@@ -395,11 +414,22 @@ static void draw_sampler(const struct sp_state *sp_state, const struct pixel_buf
 	// F
 	pad_pos.x += PAD_WIDTH + 10;
 	label_pos.x += PAD_WIDTH + 10; 
-	if (banks[curr_bank][PAD_F] && banks[curr_bank][PAD_F]->playing)
+	if (banks[curr_bank][PAD_F] && banks[curr_bank][PAD_F]->num_voices)
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, RED);
 	else
 		draw_rec(buffer, pad_pos, PAD_WIDTH, PAD_HEIGHT, WHITE);
 	draw_text(buffer, "F", curr_font, label_pos, BLACK);
+
+	// progress bar along the bottom of pads that are loading
+	for (int pad = PAD_Q; pad <= PAD_F; pad++) {
+		const int progress = get_pad_load_progress(&sp_state->loader, curr_bank, pad);
+		if (progress < 0) continue;
+
+		const vec2i bar_pos = {origin.x + 10 + pad * (PAD_WIDTH + 10),
+			origin.y + VIEWER_H + (int) (2.5f * font_h) + PAD_HEIGHT - 6};
+		draw_rec(buffer, bar_pos, PAD_WIDTH, 6, BLACK);
+		if (progress) draw_rec(buffer, bar_pos, PAD_WIDTH * progress / 1000, 6, GREEN);
+	}
 }
 
 
@@ -643,3 +673,30 @@ static void draw_shell(struct sp_state *sp_state, struct pixel_buffer *pix_buff)
 	else
 		draw_rec_outline(pix_buff, origin, BORDER_W, BORDER_H, WHITE);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+/// STATUS
+
+static void draw_status(struct sp_state *sp_state, struct pixel_buffer *pix_buff)
+{
+	struct font *curr_font = sp_state->fonts + MED;
+	vec2i txt_pos = {5, 900 + 2 * curr_font->height};
+
+	struct audio_info info;
+	platform_get_audio_info(&info);
+	struct audio_stats stats;
+	platform_get_audio_stats(&stats);
+
+	char txt[192];
+	if (info.period_frames) {
+		snprintf(txt, sizeof(txt), "audio: %dHz %s, period %d, buffer %d, latency %.1fms, "
+				"dsp %.0f%% (peak %.0f%%), xruns %lu",
+				info.sample_rate, get_format_name(info.format),
+				info.period_frames, info.buffer_frames,
+				1000.0f * info.buffer_frames / info.sample_rate,
+				100.0f * stats.load, 100.0f * stats.peak_load, stats.xruns);
+	} else {
+		snprintf(txt, sizeof(txt), "audio: not running");
+	}
+	draw_text(pix_buff, txt, curr_font, txt_pos, WHITE);
+}
@@ -0,0 +1,355 @@
+#include "sp_log.h"
+#include "sp_plus.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_LINE_BYTES 512
+#define LOG_SHELL_BYTES 256
+#define LOG_SPEC_BYTES 32
+
+static const char *level_names[] = {
+	[LOG_DEBUG] = "debug",
+	[LOG_INFO] = "info",
+	[LOG_WARN] = "warn",
+	[LOG_ERROR] = "error",
+};
+
+union log_arg {
+	long long i;
+	unsigned long long u;
+	double f;
+	const void *p;
+	int str;		// offset of %s argument in strings
+};
+
+// slot of ring position pos is free when seq is 2 * (pos / LOG_RING_RECORDS)
+// and holds a record when seq is one more, so a zeroed ring is empty
+struct log_record {
+	atomic_uint_fast64_t seq;
+	uint64_t time_ns;
+	const char *fmt;
+	int level;
+	int num_args;
+	union log_arg args[LOG_MAX_ARGS];
+	char strings[LOG_STRING_BYTES];
+};
+
+static struct log_record ring[LOG_RING_RECORDS];
+static atomic_uint_fast64_t enqueue_pos;
+static uint64_t dequeue_pos;			// writer thread only
+static atomic_uint_fast64_t dropped;		// records lost to a full ring
+
+#ifdef DEBUG
+static atomic_int min_level = LOG_DEBUG;
+#else
+static atomic_int min_level = LOG_INFO;
+#endif
+
+static FILE *log_file;
+static void *log_thread;
+static atomic_int log_running;
+static uint64_t log_start_ns;
+
+// latest warning or error for the shell
+static void *shell_mutex;
+static char shell_line[LOG_SHELL_BYTES];
+static atomic_uint shell_seq;
+
+/* Conversions */
+
+enum arg_class { ARG_LITERAL, ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_STRING, ARG_POINTER, ARG_BAD };
+enum arg_length { LEN_INT, LEN_LONG, LEN_LLONG, LEN_SIZE, LEN_MAX, LEN_PTRDIFF };
+
+struct conversion {
+	enum arg_class cls;
+	enum arg_length length;
+	char conv;
+	int prefix;		// characters of flags, width and precision
+	int len;		// characters after '%' including the conversion
+};
+
+// parses the conversion after a '%' at f
+static void parse_conversion(const char *f, struct conversion *c)
+{
+	int i = 0;
+	while (f[i] && strchr("-+ #0", f[i])) i++;
+	while (f[i] >= '0' && f[i] <= '9') i++;
+	if (f[i] == '.') {
+		i++;
+		while (f[i] >= '0' && f[i] <= '9') i++;
+	}
+	c->prefix = i;
+
+	c->length = LEN_INT;
+	if (f[i] == 'h') {
+		i += f[i + 1] == 'h' ? 2 : 1;
+	} else if (f[i] == 'l') {
+		c->length = f[i + 1] == 'l' ? LEN_LLONG : LEN_LONG;
+		i += c->length == LEN_LLONG ? 2 : 1;
+	} else if (f[i] == 'z') {
+		c->length = LEN_SIZE;
+		i++;
+	} else if (f[i] == 'j') {
+		c->length = LEN_MAX;
+		i++;
+	} else if (f[i] == 't') {
+		c->length = LEN_PTRDIFF;
+		i++;
+	}
+
+	c->conv = f[i];
+	c->len = f[i] ? i + 1 : i;
+	if (c->conv == '%' && i == 0) c->cls = ARG_LITERAL;
+	else if (c->conv && strchr("di", c->conv)) c->cls = ARG_INT;
+	else if (c->conv && strchr("uoxXc", c->conv)) c->cls = ARG_UINT;
+	else if (c->conv && strchr("fFeEgGaA", c->conv)) c->cls = ARG_DOUBLE;
+	else if (c->conv == 's') c->cls = ARG_STRING;
+	else if (c->conv == 'p') c->cls = ARG_POINTER;
+	else c->cls = ARG_BAD;
+}
+
+// copies s to the end of used bytes of r->strings, truncated to fit
+// returns offset of the copy
+static int copy_string(struct log_record *r, int *used, const char *s)
+{
+	if (!s) s = "(null)";
+	const int start = *used;
+	int n = 0;
+	while (s[n] && start + n < LOG_STRING_BYTES - 1) {
+		r->strings[start + n] = s[n];
+		n++;
+	}
+	r->strings[start + n] = '\0';
+	if (start + n < LOG_STRING_BYTES - 1) *used = start + n + 1;
+	return start;
+}
+
+/* Producers */
+
+void log_msg(enum log_level level, const char *fmt, ...)
+{
+	if ((int) level < atomic_load_explicit(&min_level, memory_order_relaxed)) return;
+
+	// claim a free slot, drop the record if the ring is full
+	uint64_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+	struct log_record *r;
+	for (;;) {
+		r = ring + pos % LOG_RING_RECORDS;
+		const uint64_t free_seq = 2 * (pos / LOG_RING_RECORDS);
+		const uint64_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+		if (seq == free_seq) {
+			if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (seq < free_seq) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	r->time_ns = platform_get_time_ns();
+	r->fmt = fmt;
+	r->level = level;
+	r->num_args = 0;
+
+	// store arguments by the type their conversion reads
+	va_list ap;
+	va_start(ap, fmt);
+	int used = 0;
+	for (const char *f = fmt; *f && r->num_args < LOG_MAX_ARGS; f++) {
+		if (*f != '%') continue;
+		struct conversion c;
+		parse_conversion(f + 1, &c);
+		f += c.len;
+		if (c.cls == ARG_BAD) break;
+		if (c.cls == ARG_LITERAL) continue;
+
+		union log_arg *a = r->args + r->num_args++;
+		switch (c.cls) {
+			case ARG_INT:
+				if (c.length == LEN_LONG) a->i = va_arg(ap, long);
+				else if (c.length == LEN_LLONG) a->i = va_arg(ap, long long);
+				else if (c.length == LEN_SIZE) a->i = va_arg(ap, size_t);
+				else if (c.length == LEN_MAX) a->i = va_arg(ap, intmax_t);
+				else if (c.length == LEN_PTRDIFF) a->i = va_arg(ap, ptrdiff_t);
+				else a->i = va_arg(ap, int);
+				break;
+			case ARG_UINT:
+				if (c.length == LEN_LONG) a->u = va_arg(ap, unsigned long);
+				else if (c.length == LEN_LLONG) a->u = va_arg(ap, unsigned long long);
+				else if (c.length == LEN_SIZE) a->u = va_arg(ap, size_t);
+				else if (c.length == LEN_MAX) a->u = va_arg(ap, uintmax_t);
+				else if (c.length == LEN_PTRDIFF) a->u = va_arg(ap, ptrdiff_t);
+				else a->u = va_arg(ap, unsigned int);
+				break;
+			case ARG_DOUBLE:
+				a->f = va_arg(ap, double);
+				break;
+			case ARG_STRING:
+				a->str = copy_string(r, &used, va_arg(ap, const char *));
+				break;
+			default:
+				a->p = va_arg(ap, const void *);
+		}
+	}
+	va_end(ap);
+
+	atomic_store_explicit(&r->seq, 2 * (pos / LOG_RING_RECORDS) + 1, memory_order_release);
+}
+
+void log_set_level(enum log_level level)
+{
+	atomic_store_explicit(&min_level, level, memory_order_relaxed);
+}
+
+/* Writer */
+
+// formats r into line, conversions past the stored arguments are copied as is
+static void format_record(const struct log_record *r, char *line, int size)
+{
+	// records logged before log_start show as 0
+	const double t = r->time_ns > log_start_ns ? (r->time_ns - log_start_ns) * 1e-9 : 0.0;
+	int n = snprintf(line, size, "%.3f %s: ", t, level_names[r->level]);
+
+	int arg = 0;
+	const char *f = r->fmt;
+	while (*f && n < size - 1) {
+		if (*f != '%' || arg == r->num_args) {
+			if (*f == '%' && f[1] == '%') f++;
+			line[n++] = *f++;
+			continue;
+		}
+
+		struct conversion c;
+		parse_conversion(f + 1, &c);
+		if (c.cls == ARG_LITERAL) {
+			line[n++] = '%';
+			f += 2;
+			continue;
+		}
+
+		// integers are stored widened, read them back as long long
+		char spec[LOG_SPEC_BYTES];
+		const int prefix = c.prefix < LOG_SPEC_BYTES - 5 ? c.prefix : LOG_SPEC_BYTES - 5;
+		spec[0] = '%';
+		memcpy(spec + 1, f + 1, prefix);
+		int s = prefix + 1;
+		if ((c.cls == ARG_INT || c.cls == ARG_UINT) && c.conv != 'c') {
+			spec[s++] = 'l';
+			spec[s++] = 'l';
+		}
+		spec[s++] = c.conv;
+		spec[s] = '\0';
+
+		const union log_arg *a = r->args + arg++;
+		int w;
+		switch (c.cls) {
+			case ARG_INT: w = snprintf(line + n, size - n, spec, a->i); break;
+			case ARG_UINT:
+				if (c.conv == 'c') w = snprintf(line + n, size - n, spec, (int) a->u);
+				else w = snprintf(line + n, size - n, spec, a->u);
+				break;
+			case ARG_DOUBLE: w = snprintf(line + n, size - n, spec, a->f); break;
+			case ARG_STRING: w = snprintf(line + n, size - n, spec, r->strings + a->str); break;
+			default: w = snprintf(line + n, size - n, spec, a->p);
+		}
+		n += w < size - n ? w : size - 1 - n;
+		f += c.len + 1;
+	}
+	line[n] = '\0';
+}
+
+// hands line to the shell view
+static void set_shell_line(const char *line)
+{
+	if (!shell_mutex || platform_mutex_lock(shell_mutex)) return;
+	snprintf(shell_line, sizeof(shell_line), "%s", line);
+	atomic_fetch_add_explicit(&shell_seq, 1, memory_order_release);
+	platform_mutex_unlock(shell_mutex);
+}
+
+// writes every queued record, writer thread only
+static void flush_log(void)
+{
+	struct log_record r;
+	char line[LOG_LINE_BYTES];
+	for (;;) {
+		struct log_record *slot = ring + dequeue_pos % LOG_RING_RECORDS;
+		const uint64_t turn = 2 * (dequeue_pos / LOG_RING_RECORDS);
+		if (atomic_load_explicit(&slot->seq, memory_order_acquire) != turn + 1) break;
+
+		// copy out so the slot is free again before formatting
+		memcpy(&r.time_ns, &slot->time_ns, sizeof(r) - offsetof(struct log_record, time_ns));
+		atomic_store_explicit(&slot->seq, turn + 2, memory_order_release);
+		dequeue_pos++;
+
+		format_record(&r, line, sizeof(line));
+		fprintf(log_file, "%s\n", line);
+		if (r.level >= LOG_WARN) {
+			// the shell has its own clock, skip the time
+			set_shell_line(strchr(line, ' ') + 1);
+		}
+	}
+
+	const uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+	if (lost) fprintf(log_file, "log: %lu messages dropped, ring full\n", (unsigned long) lost);
+	fflush(log_file);
+}
+
+static void *run_log_thread(void *arg)
+{
+	(void) arg;
+	while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+		flush_log();
+		platform_sleep_ns(LOG_FLUSH_NS);
+	}
+	flush_log();
+	return NULL;
+}
+
+int log_start(const char *path)
+{
+	log_file = stderr;
+	if (path && !(log_file = fopen(path, "a"))) {
+		fprintf(stderr, "Could not open log file %s\n", path);
+		log_file = stderr;
+		return -1;
+	}
+	log_start_ns = platform_get_time_ns();
+	shell_mutex = platform_init_mutex();
+
+	atomic_store_explicit(&log_running, 1, memory_order_release);
+	log_thread = platform_create_thread(run_log_thread, NULL);
+	if (!log_thread) {
+		fprintf(stderr, "Could not start log thread\n");
+		atomic_store(&log_running, 0);
+		return -1;
+	}
+	return 0;
+}
+
+void log_stop(void)
+{
+	if (!log_thread) return;
+	atomic_store_explicit(&log_running, 0, memory_order_release);
+	platform_join_thread(log_thread);
+	log_thread = NULL;
+	if (log_file != stderr) fclose(log_file);
+	log_file = stderr;
+}
+
+int log_get_shell_line(char *dest, int size, uint32_t *seen)
+{
+	const unsigned seq = atomic_load_explicit(&shell_seq, memory_order_acquire);
+	if (seq == *seen || !shell_mutex || platform_mutex_lock(shell_mutex)) return 0;
+	snprintf(dest, size, "%s", shell_line);
+	*seen = atomic_load_explicit(&shell_seq, memory_order_relaxed);
+	platform_mutex_unlock(shell_mutex);
+	return 1;
+}
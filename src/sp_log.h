@@ -0,0 +1,53 @@
+#ifndef SP_LOG_H
+#define SP_LOG_H
+
+#include <stdint.h>
+
+//////////////////////////////////////////////////////////////////
+/// Logging
+///
+/// Any thread, the audio thread included, pushes fixed size records
+/// into a lock-free ring. A record keeps the format string and the raw
+/// arguments, a writer thread formats them and writes them to the log
+/// file. Warnings and errors are also handed to the shell view.
+/// log_msg never formats, allocates, locks or makes a syscall, when
+/// the ring is full the record is dropped and counted.
+
+#define LOG_RING_RECORDS 1024		// power of 2
+#define LOG_MAX_ARGS 8
+#define LOG_STRING_BYTES 128		// %s arguments of one record, truncated to fit
+#define LOG_FLUSH_NS (20 * 1000000ULL)	// writer thread wake up interval
+
+enum log_level {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR,
+};
+
+void log_msg(enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+// queues a printf style message, a newline is added when it is written
+// fmt must outlive the log, use a string literal
+// supports flags, width and precision but not '*', and conversions
+// d i u o x X c with hh h l ll z j t, f F e E g G a A, s, p and %%
+// %s strings are copied so they may be freed after the call
+
+int log_start(const char *path);
+// starts the writer thread, records logged before are written then
+// path is the log file, NULL for stderr
+// returns 0 on success and -1 on failure
+
+void log_stop(void);
+// writes remaining records, stops the writer thread and closes the log file
+
+void log_set_level(enum log_level level);
+// messages below level are dropped when logged, default LOG_INFO
+// and LOG_DEBUG in debug builds
+
+int log_get_shell_line(char *dest, int size, uint32_t *seen);
+// copies the latest warning or error to dest if it is newer than *seen
+// *seen is 0 before the first call
+// returns 1 if dest was written and 0 otherwise
+
+#endif
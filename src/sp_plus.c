@@ -1,6 +1,10 @@
 // internal
 #include "sp_plus.h"
 #include "sp_types.h"
+#include "sp_voice.h"
+#include "sp_convert.h"
+#include "sp_trace.h"
+#include "sp_log.h"
 #include "sp_plus_assert.h"
 
 // external
@@ -17,17 +21,30 @@
 #define FONT1 "../fonts/DejaVuSans-Bold.ttf"
 #define WORKING_DIR "../wavs/"
 
-// TODO: may want to move these eventually
-// currently used in sp_plus_allocate_state and proccess_input_and_update
-static const int NUM_PADS = 8;
-
 // utility stuff used by draw_ui.c and update
 static float st_to_speed(const float st) { return powf(2.0f, st / 12.0f); }
 static float speed_to_st(float speed) { return -12 * log2f(1.0f / speed); }
-static int32_t ms_to_frames(const float m) { return m * SAMPLE_RATE / 1000.0f; }
-static float frames_to_ms(const int32_t f) { return 1000.0f * f / SAMPLE_RATE; }
+static int32_t ms_to_frames(const float m, const int rate) { return m * rate / 1000.0f; }
+static float frames_to_ms(const int32_t f, const int rate) { return 1000.0f * f / rate; }
+
+// progress of the sample load running on this thread, NULL if nobody watches
+static _Thread_local atomic_int *load_progress;
+
+// raises progress of this thread's load to done out of total
+// a later stage that restarts its count never moves progress back
+static void report_load_progress(int64_t done, int64_t total)
+{
+	if (!load_progress || total <= 0) return;
+	if (done > total) done = total;
+	const int permille = done * 1000 / total;
+	if (permille > atomic_load_explicit(load_progress, memory_order_relaxed))
+		atomic_store_explicit(load_progress, permille, memory_order_relaxed);
+}
 
 // .c includes
+#include "sp_command.c"
+#include "sp_stream.c"
+#include "sp_voice_pool.c"
 #include "sp_draw_ui.c"
 #include "sp_update.c"
 
@@ -36,156 +53,361 @@ static float frames_to_ms(const int32_t f) { return 1000.0f * f / SAMPLE_RATE; }
 ///
 /// Platform calls these functions through fill_audio_buffer every audio frame
 
-static int increment_frame(struct sample* s)
+// handles playback reaching a bound or the end of a gate release
+// loop and ping-pong carry the fractional overshoot past the bound
+// so playback stays sample exact
+// clears v->playing when playback ends
+static void handle_voice_event(struct voice *v)
 {
-	if (!s) return 1;
-	// round up or down if fractional difference is very small
-	double next_frame = s->next_frame + s->speed; 
-	const double frac = next_frame - (int) next_frame;
-	if (fabs(frac) < 0.001)
-		next_frame = (int) next_frame;
-	else if (fabs(frac) > 0.999)
-		next_frame = (int) next_frame + 1;
-
+	const struct sample *s = v->sample;
+	const double first = s->play.start_frame;
+	const double last = s->play.end_frame - 1;
+
+	// logic for release of gate in gate trigger mode
+	if (v->gate_closed && v->gate_release_cnt > v->gate_release) {
+		v->playing = false;
+		return;
+	}
 
 	// control playback behavior when next_frame goes out of bounds
-	// or when sample is in gate trigger mode and the gate is closed
 	// Sample will either be killed or loop in LOOP or PONG_PONG mode
+	if (s->play.loop_mode == LOOP) {
+		// frame after last is first
+		const double len = s->play.end_frame - s->play.start_frame;
+		v->next_frame = first + fmod(v->next_frame - first, len);
+		if (v->next_frame < first) v->next_frame += len;
+		if (v->ring) restart_stream_ring(v->ring, v->next_frame, v->speed);
+	} else if (s->play.loop_mode == PING_PONG) {
+		// reflect off the bound and change direction
+		if (v->next_frame > last) v->next_frame = 2.0 * last - v->next_frame;
+		else v->next_frame = 2.0 * first - v->next_frame;
+		v->speed *= -1;
+
+		// overshoot can be longer than very short regions
+		if (v->next_frame < first) v->next_frame = first;
+		else if (v->next_frame > last) v->next_frame = last;
+	} else {
+		v->playing = false;
+	}
+}
 
-	// if sample playing forward goes out of bounds
-	if (next_frame > s->end_frame - 1 ) {
-		if (s->loop_mode == PING_PONG) { 
-			s->next_frame = s->end_frame - 1;
-			s->speed *= -1;
-		} else if (s->loop_mode == LOOP) {
-			s->next_frame = s->start_frame;
-		} else {
-			kill_sample(s);
+// sets up a voice kernel run starting at v->next_frame
+// data holds the sample's frames from frame first on
+static void get_voice_run(const struct voice *v, const float *data, int32_t first, struct voice_run *r)
+{
+	const struct sample *s = v->sample;
+	const double pos = v->next_frame;
+	r->data = data;
+	r->channels = s->channels;
+	r->base = floor(pos);
+	r->frac = pos - r->base;
+	r->base -= first;
+	r->step = v->speed;
+
+	// envelope ramps, see get_envelope_gain
+	if (s->play.attack) {
+		r->attack = (pos - s->play.start_frame) / s->play.attack;
+		r->attack_inc = v->speed / s->play.attack;
+	} else {
+		r->attack = 1.0f;
+		r->attack_inc = 0.0f;
+	}
+	if (s->play.release) {
+		r->release = (s->play.end_frame - pos) / s->play.release;
+		r->release_inc = -v->speed / s->play.release;
+	} else {
+		r->release = 1.0f;
+		r->release_inc = 0.0f;
+	}
+
+	// gate release ramp
+	r->gate_closed = v->gate_closed;
+	r->gate = 0.0f;
+	r->gate_inc = 0.0f;
+	if (v->gate_closed && v->gate_release) {
+		const double g = v->gate_close_gain / v->gate_release;
+		r->gate = (v->gate_release - v->gate_release_cnt) * g;
+		r->gate_inc = -fabs(v->speed) * g;
+	}
+}
+
+// number of frames from v->next_frame, at most max, that can be rendered
+// before playback reaches a bound or the end of a gate release
+// 0 if an event is due at v->next_frame
+static int frames_until_event(const struct voice *v, int max)
+{
+	const struct sample *s = v->sample;
+	double frames;
+	if (v->speed > 0 && s->play.loop_mode == LOOP)
+		// loop wraps from end_frame to start_frame so positions up to end_frame play
+		frames = ceil((s->play.end_frame - v->next_frame) / v->speed) - 1.0;
+	else if (v->speed > 0) 
+		frames = (s->play.end_frame - 1 - v->next_frame) / v->speed;
+	else 
+		frames = (v->next_frame - s->play.start_frame) / -v->speed;
+
+	if (v->gate_closed)
+		frames = fmin(frames, (v->gate_release - v->gate_release_cnt) / fabs(v->speed));
+
+	// frames holds the last frame offset still inside the bounds
+	if (frames < 0.0) return 0;
+	return frames + 1.0 < max ? (int) frames + 1 : max;
+}
+
+// limits a run of max frames of a streamed voice to frames in memory
+// sets *data to frame *first of the cached or prefetched frames it reads
+// returns 0 if the frames at v->next_frame have not been read from disk yet
+static int frames_in_stream(const struct voice *v, int max, const float **data, int32_t *first)
+{
+	const int32_t f = floor(v->next_frame);
+	const int32_t n = get_stream_segment(v->sample->stream, v->ring, f,
+			v->speed > 0 ? 1 : -1, data, first);
+	if (!n) return 0;
+
+	// the kernel reads one frame past each position
+	double frames;
+	if (v->speed > 0)
+		frames = ceil((*first + n - 1 - v->next_frame) / v->speed) - 1.0;
+	else
+		frames = (v->next_frame - *first) / -v->speed;
+
+	if (frames < 0.0) return 0;
+	return frames + 1.0 < max ? (int) frames + 1 : max;
+}
+
+// render frames that are free of playback events and advance playback
+// data holds the sample's frames from frame first on
+static void render_voice_frames(struct voice *v, const float *data, int32_t first, float *out, int frames)
+{
+	struct voice_run r;
+	get_voice_run(v, data, first, &r);
+	render_voice_run(&r, out, frames);
+
+	v->next_frame += frames * v->speed;
+	if (v->gate_closed) 
+		v->gate_release_cnt += frames * fabs(v->speed);
+}
+
+// render frames of voice playback into block
+// runs between playback events are rendered by the voice kernel
+// frames after the voice stops playing are silent
+// a streamed voice whose next frames are not in memory yet holds its
+// position for the rest of the block
+// returns false if the voice had to wait for its frames
+static bool process_voice_block(struct voice *v, float *block, int frames)
+{
+	const struct sample *s = v->sample;
+	bool ready = true;
+	int i = 0;
+	while (i < frames && v->playing) {
+		int run = frames_until_event(v, frames - i);
+		const float *data = s->data;
+		int32_t first = 0;
+		if (run > 0 && s->stream) {
+			run = frames_in_stream(v, run, &data, &first);
+			if (!run) {
+				// without a ring the frames never arrive
+				if (v->ring) ready = false;
+				else v->playing = false;
+				break;
+			}
 		}
-		// if sample playing backwards goes out of bounds
-	} else if (next_frame < s->start_frame) {
-		if (s->loop_mode == PING_PONG) {
-			s->next_frame = s->start_frame;
-			s->speed *= -1;
-		} else if (s->loop_mode == LOOP) {
-			s->next_frame = s->end_frame - 1;
+
+		if (run > 0) {
+			render_voice_frames(v, data, first, block + i * NUM_CHANNELS, run);
+			i += run;
 		} else {
-			kill_sample(s);
+			handle_voice_event(v);
 		}
-		// logic for release of gate in gate trigger mode
-	} else if (	s->gate_closed && 
-			s->gate_release_cnt + fabs(next_frame - s->next_frame) > 
-			s->gate_release) {
-		kill_sample(s);
-	} else {
-		if (s->gate_closed) {
-			s->gate_release_cnt += fabs(next_frame - s->next_frame);
-		}
-		s->next_frame = next_frame;
 	}
-	return 0;
-}
 
-// TODO could use this instead of double out[] in other process functions
-struct frame_data {
-	double l;
-	double r;
-};
+	memset(block + i * NUM_CHANNELS, 0, sizeof(float) * NUM_CHANNELS * (frames - i));
+	return ready;
+}
 
-// get next frame and apply envelope gain
-static struct frame_data process_next_frame(/*double out[], */struct sample* s)
+// peak of a block of stereo frames
+static float get_block_peak(const float *src, int frames)
 {
-	struct frame_data out = {0};
-	if (!s) return out;
-	// need to interpolate fractional next_frame
-	const int32_t base_frame  = s->next_frame;
-	const double ratio = s->next_frame - base_frame;
-	
-	// left
-	out.l = s->data[base_frame * NUM_CHANNELS] * (1 - ratio);
-	out.l += s->data[(base_frame + 1) * NUM_CHANNELS] * ratio;
-	if (s->gate_closed) {
-		out.l *= (s->gate_release - s->gate_release_cnt) /
-			s->gate_release;
-		out.l *= s->gate_close_gain;
+	float peak = 0.0f;
+	for (int i = 0; i < frames * NUM_CHANNELS; i++) {
+		const float x = fabsf(src[i]);
+		peak = x > peak ? x : peak;
 	}
-	out.l *= get_envelope_gain(s);
-
-	// right
-	out.r = s->data[base_frame * NUM_CHANNELS + 1] * (1 - ratio);
-	out.r += s->data[(base_frame + 1) * NUM_CHANNELS + 1] * ratio;
-	if (s->gate_closed) {
-		out.r *= (s->gate_release - s->gate_release_cnt) /
-			s->gate_release;
-		out.r *= s->gate_close_gain;
+	return peak;
+}
+
+// dest += src * gain over a block of stereo frames
+static void mix_block(float *dest, const float *src, float gain_l, float gain_r, int frames)
+{
+	for (int i = 0; i < frames * NUM_CHANNELS; i += NUM_CHANNELS) {
+		dest[i] += src[i] * gain_l;
+		dest[i + 1] += src[i + 1] * gain_r;
 	}
-	out.r *= get_envelope_gain(s);
+}
 
-	increment_frame(s);
-	return out;
+// dest = src * gain over a block of stereo frames
+static void copy_block(float *dest, const float *src, float gain_l, float gain_r, int frames)
+{
+	for (int i = 0; i < frames * NUM_CHANNELS; i += NUM_CHANNELS) {
+		dest[i] = src[i] * gain_l;
+		dest[i + 1] = src[i + 1] * gain_r;
+	}
 }
 
-// TODO: can probably make this stuff wayyyyy move efficient
-// Recurse from master bus down to samples. Get next frame data from samples
-// apply bus dsp to output. Each bus will have an array of bus inputs or
-// a single sample input.
-static struct frame_data process_leaf_nodes(struct bus* b)
+// render one block of a compiled mixer plan into the master node's block
+// active voices are summed into their sample's node, then inputs are summed
+// into their output node with the input bus gain applied
+// so each node's block holds the pre-gain output of its bus
+// only nodes with a playing voice somewhere below them are touched
+// returns false if the master block is silent and was not written
+static bool process_mix_plan(struct voice_pool *pool, const struct mix_plan *p, int frames)
 {
-	struct frame_data out = {0};
-	// process sample
-	if (b->sample_in) {
-		if (b->sample_in->playing) {
-			out = process_next_frame(b->sample_in);
-		}
-	// process bus inputs
-	} else {
-		for (int i = 0; i < b->num_bus_ins; i++) {
-			struct frame_data tmp = process_leaf_nodes(b->bus_ins[i]);
-			out.l += tmp.l;
-			out.r += tmp.r;
+	ASSERT(frames <= MIX_BLOCK_FRAMES);
+
+	if (!pool->num_active) return false;
+	memset(p->live, 0, sizeof(bool) * p->num_nodes);
+
+	// iterate backwards as finished voices are swapped with the last voice
+	for (int i = pool->num_active - 1; i >= 0; i--) {
+		struct voice *v = pool->active[i];
+		struct sample *s = v->sample;
+		float *block = p->nodes[s->mix_node].block;
+
+		// first voice of a sample renders straight into the node
+		bool ready;
+		if (p->live[s->mix_node]) {
+			ready = process_voice_block(v, p->scratch, frames);
+			v->level = get_block_peak(p->scratch, frames);
+			mix_block(block, p->scratch, 1.0f, 1.0f, frames);
+		} else {
+			ready = process_voice_block(v, block, frames);
+			v->level = get_block_peak(block, frames);
+			p->live[s->mix_node] = true;
 		}
+		if (s->newest_voice == v) s->next_frame = v->next_frame;
+
+		if (v->ring) publish_stream_pos(v->ring, v->next_frame, v->speed);
+		if (!ready) atomic_fetch_add_explicit(&pool->streams->underruns, 1, memory_order_relaxed);
+
+		if (!v->playing) release_voice(pool, v);
 	}
 
-	// apply bus dsp
-	out.l *= (1.0 - b->atten);
-	out.r *= (1.0 - b->atten);
-	out.l *= fmin(1.0 - b->pan, 1.0);
-	out.r *= fmin(1.0 + b->pan, 1.0);
+	// master is the last node and has no output
+	// silent nodes are skipped, the first live input of a node overwrites
+	// its block so blocks never need clearing
+	for (int i = 0; i < p->num_nodes - 1; i++) {
+		const struct mix_node *n = p->nodes + i;
+		if (!p->live[i]) continue;
 
-	return out;
+		float *dest = p->nodes[n->output].block;
+		if (p->live[n->output]) {
+			mix_block(dest, n->block, n->bus->gain_l, n->bus->gain_r, frames);
+		} else {
+			copy_block(dest, n->block, n->bus->gain_l, n->bus->gain_r, frames);
+			p->live[n->output] = true;
+		}
+	}
+	return p->live[p->num_nodes - 1];
+}
+
+// apply commands sent by ui thread that are due by mixer->frame
+// called by audio thread at the start of each block
+// returns frame of the next pending command or 0 if there is none
+static uint64_t apply_commands(struct mixer *mixer)
+{
+	const struct command *next;
+	while ((next = peek_command(mixer->cmd_queue))) {
+		// later commands wait for this one
+		if (next->frame > mixer->frame) return next->frame;
+
+		struct command cmd;
+		if (pop_command(mixer->cmd_queue, &cmd)) break;
+		struct sample *s = cmd.sample;
+		struct bus *b = cmd.bus;
+
+		switch (cmd.type) {
+			case CMD_TRIGGER_SAMPLE:
+				// sample may not be in the mixer yet or anymore
+				if (s->mix_seq == mixer->bound_plan->seq) 
+					trigger_sample(&mixer->voices, s);
+				break;
+			case CMD_KILL_SAMPLE:
+				kill_sample(&mixer->voices, s);
+				break;
+			case CMD_RESET_SAMPLE:
+				if (!s->num_voices) kill_sample(&mixer->voices, s);
+				break;
+			case CMD_CLOSE_GATE:
+				close_gate(&mixer->voices, s);
+				break;
+			case CMD_SET_SPEED:
+				set_sample_speed(&mixer->voices, s, cmd.speed);
+				break;
+			case CMD_REVERSE:
+				reverse_sample(&mixer->voices, s);
+				break;
+			case CMD_SET_BUS_GAIN:
+				b->gain_l = cmd.gain.l;
+				b->gain_r = cmd.gain.r;
+				break;
+			case CMD_SET_STREAM_CACHE:
+				// ui thread frees the old cache once this command is applied
+				s->stream->audio_cache = cmd.cache;
+				break;
+			case CMD_SET_PLAYBACK:
+				s->play = cmd.playback;
+				break;
+			default:
+				break;
+		}
+	}
+	return 0;
 }
 
 // called by platform in async callback
 // relies on other audio playback functions
-int sp_plus_fill_audio_buffer(void *sp_state, void* buffer, int frames)
+// renders in blocks of at most MIX_BLOCK_FRAMES
+// blocks are split so timed commands apply on their exact frame
+// takes no locks, ui changes arrive through the mixer command queue
+// and the atomically swapped mixer plan
+int sp_plus_fill_audio_buffer(void *sp_state, void* buffer, int frames, enum audio_format format)
 {
-	int err;
-	err = platform_mutex_lock(((struct sp_state *) sp_state)->mixer.master_mutex);
-	ASSERT(!err);
-
-	// TODO use reference instead of copy maybe?
-	struct bus *master = &((struct sp_state *) sp_state)->mixer.master;
-	// process i frames
-	for (int i = 0; i < frames; i++){
-		struct frame_data out = process_leaf_nodes(master);
-		// alsa expects 16 bit int
-		int16_t int_out[NUM_CHANNELS];
-		// convert left
-		double f = out.l * 32768.0; 
-		if (f > 32767.0) f = 32767.0;
-		if (f < -32768.0) f = -32768.0;
-		int_out[0] = (int16_t) f;
-		// convert right
-		f = out.r * 32768.0; 
-		if (f > 32767.0) f = 32767.0;
-		if (f < -32768.0) f = -32768.0;
-		int_out[1] = (int16_t) f;
-
-		memcpy((char *)buffer + i * sizeof(int_out), int_out, sizeof(int_out));
+	struct mixer *mixer = &((struct sp_state *) sp_state)->mixer;
+	TRACE_BEGIN("fill_audio_buffer");
+
+	publish_audio_clock(&mixer->clock, mixer->frame, frames);
+
+	char *out = buffer;
+	const int frame_bytes = get_format_bytes(format) * NUM_CHANNELS;
+	while (frames > 0) {
+		int block_frames = frames < MIX_BLOCK_FRAMES ? frames : MIX_BLOCK_FRAMES;
+
+		// commands must be applied after loading the plan so any command
+		// sent before a plan swap is applied before the old plan is released
+		const struct mix_plan *plan = atomic_load_explicit(&mixer->plan, memory_order_acquire);
+		if (plan != mixer->bound_plan) bind_voices(mixer, plan);
+
+		// end block on the frame the next command is due
+		const uint64_t next = apply_commands(mixer);
+		if (next && next - mixer->frame < (uint64_t) block_frames)
+			block_frames = next - mixer->frame;
+		const struct mix_node *master = plan->nodes + plan->num_nodes - 1;
+		if (process_mix_plan(&mixer->voices, plan, block_frames))
+			convert_block(out, master->block, master->bus->gain_l, master->bus->gain_r,
+					block_frames, format, &mixer->dither);
+		else
+			memset(out, 0, frame_bytes * block_frames);
+
+		// ui thread may now free plans older than this one
+		atomic_store_explicit(&mixer->plan_done, plan->seq, memory_order_release);
+
+		out += block_frames * frame_bytes;
+		frames -= block_frames;
+		mixer->frame += block_frames;
 	}
 
-	err = platform_mutex_unlock(((struct sp_state *) sp_state)->mixer.master_mutex);
-	ASSERT(!err);
+	TRACE_END("fill_audio_buffer");
+	return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -196,26 +418,40 @@ int sp_plus_fill_audio_buffer(void *sp_state, void* buffer, int frames)
 // state allocation service called by platform
 // use this function for initializing debugging data
 // TODO consider moving initialization code
-void *sp_plus_allocate_state(void)
+void *sp_plus_allocate_state(int sample_rate)
 {
 	struct sp_state *s = calloc(1, sizeof(struct sp_state));
 	if (!s) return NULL;
+	s->mixer.sample_rate = sample_rate;
+
+	init_voice_kernel();
+	init_convert_kernel();
+	init_dither(&s->mixer.dither, 1);
 
 	// init mixer
 	s->mixer.master.label = malloc(strlen("master") + 1);
 	strcpy(s->mixer.master.label, "master");
 	s->mixer.master.type = MASTER;
+	s->mixer.master.gain_l = 1.0f;
+	s->mixer.master.gain_r = 1.0f;
 
-	s->mixer.master_mutex = platform_init_mutex();
-	if (!s->mixer.master_mutex) {
-		fprintf(stderr, "Error allocating state memory\n");
+	s->mixer.cmd_queue = init_command_queue();
+	if (!s->mixer.cmd_queue) {
+		log_msg(LOG_ERROR, "Error allocating state memory");
 		exit(1);
 	}
+	init_voice_pool(&s->mixer.voices);
 
 	s->mixer.bus_list = malloc(sizeof(struct bus *));
 	*s->mixer.bus_list = &s->mixer.master;
 	s->mixer.num_bus = 1;
 
+	publish_mix_plan(s);
+	if (!atomic_load(&s->mixer.plan)) {
+		log_msg(LOG_ERROR, "Error allocating state memory");
+		exit(1);
+	}
+
 	s->mixer.next_label = 1;
 
 	// initialize a sample bank with 8 samples
@@ -223,13 +459,13 @@ void *sp_plus_allocate_state(void)
 	s->sampler.num_banks = 1;
 	s->sampler.banks = calloc(1, sizeof(struct sample **));
 	if (!s->sampler.banks) {
-		fprintf(stderr, "Error allocating state memory\n");
+		log_msg(LOG_ERROR, "Error allocating state memory");
 		exit(1);
 	}
 
-	s->sampler.banks[0] = calloc(8, sizeof(struct sample *));
+	s->sampler.banks[0] = calloc(NUM_PADS, sizeof(struct sample *));
 	if (!s->sampler.banks[0]) {
-		fprintf(stderr, "Error allocating state memory\n");
+		log_msg(LOG_ERROR, "Error allocating state memory");
 		exit(1);
 	}
 	s->sampler.max_vert = 2000;
@@ -259,7 +495,7 @@ void *sp_plus_allocate_state(void)
 
 	struct bus *b1 = calloc(sizeof(struct bus), 0);
 	if (!b1) {
-	fprintf(stderr, "Error allocating state memory\n");
+	log_msg(LOG_ERROR, "Error allocating state memory");
 	exit(1);
 	}
 
@@ -268,7 +504,7 @@ void *sp_plus_allocate_state(void)
 	s->master.num_bus_ins = 1;
 	s->master.bus_ins = malloc(sizeof(struct bus *) * 1);
 	if (!s->master.bus_ins) {
-	fprintf(stderr, "Error initializing master bus\n");
+	log_msg(LOG_ERROR, "Error initializing master bus");
 	exit(1);
 	}
 	s->master.bus_ins[0] = b1;
@@ -282,11 +518,26 @@ void *sp_plus_allocate_state(void)
 	return (void *) s;
 }
 
+void sp_plus_set_stream_threshold(void *sp_state, int seconds)
+{
+	struct mixer *m = &((struct sp_state *) sp_state)->mixer;
+	const int64_t frames = (int64_t) seconds * m->sample_rate;
+	if (frames <= 0) m->stream_threshold = 0;
+	else m->stream_threshold = frames < INT32_MAX ? frames : INT32_MAX;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 /// Service Entry Point
 ///
 /// Platform calls this function every frame
 
+void sp_plus_stop_loading(void *sp_state)
+{
+	struct sp_state *sp = sp_state;
+	stop_loader(&sp->loader);
+	stop_stream_pool(sp->mixer.streams);
+}
+
 void sp_plus_update_and_render(
 		void *sp_state, 
 		char *pixel_buf, 
@@ -299,9 +550,18 @@ void sp_plus_update_and_render(
 	ASSERT(pixel_buf);
 
 	struct sp_state *sp = (struct sp_state *) sp_state;
+	TRACE_BEGIN("update_and_render");
 
 	/// Update State
 
+	// free mixer plans audio thread is done with
+	reclaim_mix_plans(sp);
+
+	// latest warning or error from any thread
+	char log_line[256];
+	if (log_get_shell_line(log_line, sizeof(log_line), &sp->shell.log_seen))
+		shell_print(log_line, sp);
+
 	// change control mode
 	if (is_key_pressed(input, KEY_TAB)) {
 		if (++(sp->control_mode) > FILE_BROWSER)
@@ -326,6 +586,13 @@ void sp_plus_update_and_render(
 			update_sampler(sp, input);
 	}
 
+	// place samples loaded in the background
+	finish_sample_loads(sp);
+
+	// hand graph edits made this frame to the audio thread
+	if (sp->mixer.graph_changed)
+		publish_mix_plan(sp);
+
 	/// Draw UI
 	struct pixel_buffer buffer = { 
 		pixel_buf, 
@@ -335,8 +602,81 @@ void sp_plus_update_and_render(
 
 	clear_pixel_buffer(&buffer);
 
+	TRACE_BEGIN("draw_sampler");
 	draw_sampler(sp, &buffer);
+	TRACE_END("draw_sampler");
+	TRACE_BEGIN("draw_file_browser");
 	draw_file_browser(sp, &buffer);
+	TRACE_END("draw_file_browser");
+	TRACE_BEGIN("draw_mixer");
 	draw_mixer(sp, &buffer);
+	TRACE_END("draw_mixer");
+	TRACE_BEGIN("draw_shell");
 	draw_shell(sp, &buffer);
+	TRACE_END("draw_shell");
+	TRACE_BEGIN("draw_status");
+	draw_status(sp, &buffer);
+	TRACE_END("draw_status");
+
+	TRACE_END("update_and_render");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+/// Scripted Control
+///
+/// Pad control for the platform without key input, used for offline rendering.
+
+// returns sample on pad of the current bank or NULL if pad is empty or invalid
+static struct sample *get_pad_sample(struct sp_state *sp, int pad)
+{
+	if (pad < 0 || pad >= NUM_PADS) return NULL;
+	return sp->sampler.banks[sp->sampler.curr_bank][pad];
+}
+
+int sp_plus_load_pad(void *sp_state, int pad, const char *path)
+{
+	struct sp_state *sp = (struct sp_state *) sp_state;
+	if (pad < 0 || pad >= NUM_PADS) return -1;
+
+	reclaim_mix_plans(sp);
+	if (load_sample_to_pad(sp, path, pad)) return -1;
+	if (sp->mixer.graph_changed)
+		publish_mix_plan(sp);
+	return 0;
+}
+
+int sp_plus_set_pad_polyphony(void *sp_state, int pad, int polyphony)
+{
+	struct sample *s = get_pad_sample(sp_state, pad);
+	if (!s || polyphony < 1 || polyphony > MAX_POLYPHONY) return -1;
+	s->polyphony = polyphony;
+	send_playback(s, sp_state);
+	return 0;
+}
+
+int sp_plus_set_pad_gate(void *sp_state, int pad, int gate)
+{
+	struct sample *s = get_pad_sample(sp_state, pad);
+	if (!s) return -1;
+	s->gate = gate != 0;
+	send_playback(s, sp_state);
+	return 0;
+}
+
+int sp_plus_trigger_pad(void *sp_state, int pad, uint64_t frame)
+{
+	struct sample *s = get_pad_sample(sp_state, pad);
+	if (!s) return -1;
+	struct command cmd = { .type = CMD_TRIGGER_SAMPLE, .sample = s, .frame = frame };
+	send_command(sp_state, &cmd);
+	return 0;
+}
+
+int sp_plus_release_pad(void *sp_state, int pad, uint64_t frame)
+{
+	struct sample *s = get_pad_sample(sp_state, pad);
+	if (!s) return -1;
+	struct command cmd = { .type = CMD_CLOSE_GATE, .sample = s, .frame = frame };
+	send_command(sp_state, &cmd);
+	return 0;
 }
@@ -6,18 +6,21 @@
 
 // audio constants
 #define NUM_CHANNELS 2
-#define SAMPLE_RATE 48000
+#define DEFAULT_SAMPLE_RATE 48000	// engine rate if the device has no preference
+
+#define NUM_PADS 8			// pads per bank, keys Q W E R A S D F
 
 //////////////////////////////////////////////////////////////////////
 /// Input Handling Types
 
-#define NUM_KEYS 49
+#define NUM_KEYS 51
 enum Key {
 	KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, 
 	KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V,
 	KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6,
 	KEY_7, KEY_8, KEY_9, KEY_SPACE, KEY_EQUAL, KEY_MINUS, KEY_SHIFT_L, KEY_SHIFT_R, 
-	KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_TAB, KEY_ENTER, KEY_BACKSPACE, KEY_ESCAPE
+	KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_TAB, KEY_ENTER, KEY_BACKSPACE, KEY_ESCAPE,
+	KEY_PERIOD, KEY_SLASH
 };
 struct key_input {
 	// for bitmaps rightmost bit is 0 bit
@@ -26,16 +29,43 @@ struct key_input {
 	uint64_t key_down;			// bitmap, is key currently held down
 
 	int num_key_press[NUM_KEYS];		// how many times did keypress event occur
-};						// during frame
+						// during frame
+
+	// time of first key press and last key release event during frame
+	// in platform_get_time_ns time, 0 if unknown
+	uint64_t key_press_time[NUM_KEYS];
+	uint64_t key_release_time[NUM_KEYS];
+};
 
 //////////////////////////////////////////////////////////////////////////
 /// Platform to service calls
 
-void *sp_plus_allocate_state(void);
+void *sp_plus_allocate_state(int sample_rate);
 // allocates and initializes program state
+// sample_rate is the rate the engine renders at and samples are converted to
+
+void sp_plus_set_stream_threshold(void *sp_state, int seconds);
+// samples longer than seconds at the engine rate are loaded after this call
+// with only the frames around their start and end in memory, the rest is
+// streamed from disk while they play
+// 0, the default, loads every sample into memory
+
+void sp_plus_stop_loading(void *sp_state);
+// stops the background load and prefetch threads, waiting for loads in progress
+// call before exit, later loads run on the calling thread and streamed
+// samples no longer play
 
-int sp_plus_fill_audio_buffer(void *sp_state, void* dest, int frames);
-// service to fill audio buffer with requested number of frames
+// sample formats the engine can output, all little endian interleaved
+enum audio_format {
+	AUDIO_FORMAT_S16,	// signed 16 bit, TPDF dithered
+	AUDIO_FORMAT_S24_3,	// signed 24 bit packed in 3 bytes
+	AUDIO_FORMAT_S24,	// signed 24 bit in the low 3 bytes of 4
+	AUDIO_FORMAT_S32,	// signed 32 bit
+	AUDIO_FORMAT_FLOAT,	// 32 bit float, full scale is [-1, 1]
+};
+
+int sp_plus_fill_audio_buffer(void *sp_state, void* dest, int frames, enum audio_format format);
+// service to fill audio buffer with requested number of frames in format
 // called asynchronously
 
 void sp_plus_update_and_render(
@@ -47,6 +77,33 @@ void sp_plus_update_and_render(
 		struct key_input* input);
 // service to update program state and then fill pixel_buf with image
 
+/* scripted control */
+// drive pads without key input, used for offline rendering
+// must be called from the thread that calls sp_plus_update_and_render
+// pad is 0 to NUM_PADS - 1 in the current bank
+
+int sp_plus_load_pad(void *sp_state, int pad, const char *path);
+// loads wav at path onto pad, replacing any sample there
+// returns 0 on success and -1 on failure
+
+int sp_plus_set_pad_polyphony(void *sp_state, int pad, int polyphony);
+// sets max voices of the sample on pad
+// returns 0 on success and -1 if pad is empty or polyphony is out of range
+
+int sp_plus_set_pad_gate(void *sp_state, int pad, int gate);
+// turns gate mode of the sample on pad on if gate is nonzero and off otherwise
+// only samples in gate mode respond to sp_plus_release_pad
+// returns 0 on success and -1 if pad is empty
+
+int sp_plus_trigger_pad(void *sp_state, int pad, uint64_t frame);
+// triggers sample on pad on engine frame, the first frame rendered is 0
+// must be sent in frame order before the fill that renders frame
+// returns 0 on success and -1 if pad is empty
+
+int sp_plus_release_pad(void *sp_state, int pad, uint64_t frame);
+// closes gate of sample on pad on engine frame, same rules as sp_plus_trigger_pad
+// voices fade out over the sample's release if the pad is in gate mode
+
 
 //////////////////////////////////////////////////////////////////////////
 /// Service to platform calls
@@ -62,6 +119,30 @@ long platform_load_entire_file(void **buffer, const char *path);
 void platform_free_file_buffer(void **buffer);
 // frees buffer passed to load file
 
+const void *platform_map_file(const char *path, long *size);
+// maps file at path read only and sets *size to its size in bytes
+// pages are read ahead of sequential reads and may be read from several threads
+// returns start of the mapping or NULL on failure
+
+void platform_unmap_file(const void *data, long size);
+// unmaps data returned by platform_map_file
+
+void *platform_create_temp_file(void);
+// creates an empty file for reading and writing that is deleted when closed
+// returns file handle or NULL on failure
+
+long platform_read_file_at(void *file, void *dest, long bytes, long offset);
+// reads up to bytes from byte offset of file into dest
+// may be called from several threads at once
+// returns bytes read, fewer at the end of the file, or -1 on failure
+
+long platform_write_file_at(void *file, const void *src, long bytes, long offset);
+// writes bytes from src at byte offset of file
+// returns bytes written or -1 on failure
+
+void platform_close_file(void *file);
+// closes file returned by platform_create_temp_file
+
 /* directory reading */
 
 typedef void SP_DIR;
@@ -110,4 +191,71 @@ int platform_mutex_unlock(void *mutex);
 // unlock mutex locked by calling thread
 // returns 0 on success and non 0 on failure
 
+void *platform_init_semaphore(void);
+// allocates a semaphore with a count of 0 or returns NULL on failure
+
+void platform_semaphore_post(void *sem);
+// increments count of sem, waking a thread waiting on it
+
+void platform_semaphore_wait(void *sem);
+// suspends thread until count of sem is above 0 then decrements it
+
+int platform_get_cpu_count(void);
+// returns number of online cpus, at least 1
+
+void *platform_create_thread(void *(*func)(void *), void *arg);
+// starts a normal priority thread running func(arg)
+// returns thread handle or NULL on failure
+
+int platform_join_thread(void *thread);
+// waits for thread returned by platform_create_thread to exit and frees it
+// returns 0 on success and non 0 on failure
+
+void platform_sleep_ns(uint64_t ns);
+// suspends calling thread for at least ns nanoseconds
+
+/* memory */
+void platform_prefault(void *buffer, long size);
+// touches every page of buffer so the audio thread does not fault on it,
+// which also locks them in ram as memory is locked on first touch
+// only does anything in realtime mode
+
+/* audio */
+struct audio_info {
+	int period_frames;	// frames per device period, 0 if audio is not running
+	int buffer_frames;	// frames in device buffer
+	int sample_rate;
+	enum audio_format format;
+};
+
+void platform_get_audio_info(struct audio_info *info);
+// fills info with the settings the audio device is running with
+// safe to call from any thread
+
+#define LOAD_HIST_BUCKETS 16	// bucket i counts periods with load in [i, i + 1) tenths
+				// the last bucket also counts every slower period
+
+// audio thread timing, load is time spent filling a period over the period length
+struct audio_stats {
+	float load;		// load of the last period
+	float peak_load;	// highest load since reset
+	uint64_t periods;	// periods written since reset
+	uint64_t xruns;
+	uint64_t suspends;
+	uint64_t load_hist[LOAD_HIST_BUCKETS];
+};
+
+void platform_get_audio_stats(struct audio_stats *stats);
+// fills stats with audio thread timing since the last reset
+// safe to call from any thread
+
+void platform_reset_audio_stats(void);
+// clears peak load, counters and histogram before the next period is written
+// safe to call from any thread
+
+/* time */
+uint64_t platform_get_time_ns(void);
+// monotonic time in nanoseconds
+// safe to call from any thread
+
 #endif
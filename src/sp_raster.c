@@ -1,5 +1,6 @@
 #include "sp_raster.h"
 #include "sp_plus_assert.h"
+#include "sp_log.h"
 
 #include "stb_truetype.h"
 
@@ -200,7 +201,7 @@ void draw_rec(const struct pixel_buffer *buffer, vec2i start, int width, int hei
 // font_bitmap array extracts ASCII chars from SPACE to '~'
 #define FIRST_ASCII_VAL 32
 #define LAST_ASCII_VAL 126
-#define NUM_GLYPHS 94
+#define NUM_GLYPHS (LAST_ASCII_VAL - FIRST_ASCII_VAL + 1)
 #define FONT_SIZE 100
 void load_font(struct font *font, void *ttf_buffer, int pix_height)
 {
@@ -214,7 +215,7 @@ void load_font(struct font *font, void *ttf_buffer, int pix_height)
 	font->height = pix_height;
 	font->glyphs = calloc(NUM_GLYPHS, sizeof(struct glyph));
 	if (!font->glyphs) {
-		fprintf(stderr, "Error allocating font\n");
+		log_msg(LOG_ERROR, "Error allocating font");
 		exit(1);
 	}
 
@@ -0,0 +1,574 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Disk Streaming
+///
+/// Samples longer than the stream threshold keep only a region of frames
+/// around their start and end frame in memory, plus a coarse overview for the
+/// wave viewer. Triggers play from the cached regions right away while a
+/// prefetch thread fills a ring of frames ahead of each streamed voice.
+/// The audio thread never waits on disk, a voice whose frames have not been
+/// read yet holds its position and renders silence until they arrive.
+
+// window of valid ring frames [lo, hi) packed into one atomic word
+static inline uint64_t pack_window(int32_t lo, int32_t hi)
+{
+	return (uint64_t) (uint32_t) hi << 32 | (uint32_t) lo;
+}
+static inline int32_t window_lo(uint64_t w) { return (int32_t) (uint32_t) w; }
+static inline int32_t window_hi(uint64_t w) { return (int32_t) (uint32_t) (w >> 32); }
+
+// reads frames [first, first + frames) of src into dest as float
+// frames outside the source or missing from the file are silent
+// safe to call from the ui and prefetch thread at once
+// returns 0 on success and -1 on a read error
+static int read_stream_frames(struct stream_source *src, float *dest, int32_t first, int frames)
+{
+	const int ch = src->channels;
+	const int32_t lo = first > 0 ? first : 0;
+	const int32_t hi = first + frames < src->num_frames ? first + frames : src->num_frames;
+	if (lo >= hi) {
+		memset(dest, 0, sizeof(float) * frames * ch);
+		return 0;
+	}
+	memset(dest, 0, sizeof(float) * (lo - first) * ch);
+
+	float *out = dest + (lo - first) * ch;
+	const long n = (long) (hi - lo) * ch;
+	const int sample_bytes = src->is_float ? sizeof(float) : sizeof(int16_t);
+	const long at = src->offset + (long) lo * ch * sample_bytes;
+
+	// a mapped wav is widened straight from the page cache
+	if (src->map) {
+		const int16_t *in = (const int16_t *) (src->map + at);
+		for (long i = 0; i < n; i++)
+			out[i] = (float) in[i] / 32768.0f;
+		memset(out + n, 0, sizeof(float) * (first + frames - hi) * ch);
+		return 0;
+	}
+
+	const long got = platform_read_file_at(src->file, out, n * sample_bytes, at);
+	const long samples = got > 0 ? got / sample_bytes : 0;
+
+	// widen in place from the back so every sample is read before it is overwritten
+	if (!src->is_float) {
+		const int16_t *in = (const int16_t *) out;
+		for (long i = samples - 1; i >= 0; i--)
+			out[i] = (float) in[i] / 32768.0f;
+	}
+	memset(out + samples, 0, sizeof(float) * (frames * ch - (lo - first) * ch - samples));
+
+	if (samples == n) return 0;
+	if (!atomic_exchange(&src->read_failed, true))
+		log_msg(LOG_ERROR, "stream: could not read frames %d to %d, playing silence", lo, hi);
+	return -1;
+}
+
+// closes the file or mapping of src and frees it
+static void close_stream_source(struct stream_source *src)
+{
+	if (src->map) platform_unmap_file(src->map, src->map_bytes);
+	if (src->file) platform_close_file(src->file);
+	free(src);
+}
+
+/* cached regions */
+
+// span of the region for playback from frame in direction dir
+// a little is kept behind frame so small moves keep the region
+static void place_region(int32_t frame, int dir, int32_t num_frames, int32_t *first, int32_t *frames)
+{
+	const int32_t behind = STREAM_CACHE_FRAMES / 8;
+	int32_t lo = dir > 0 ? frame - behind : frame + behind + 1 - STREAM_CACHE_FRAMES;
+	if (lo > num_frames - STREAM_CACHE_FRAMES) lo = num_frames - STREAM_CACHE_FRAMES;
+	if (lo < 0) lo = 0;
+
+	*first = lo;
+	*frames = num_frames - lo < STREAM_CACHE_FRAMES ? num_frames - lo : STREAM_CACHE_FRAMES;
+}
+
+// true if r holds frame and at least half a region past it in direction dir
+static bool region_fits(const struct stream_region *r, int32_t frame, int dir, int32_t num_frames)
+{
+	const int32_t end = r->first + r->frames;
+	if (frame < r->first || frame >= end) return false;
+	if (dir > 0) return end == num_frames || end - frame >= STREAM_CACHE_FRAMES / 2;
+	return r->first == 0 || frame - r->first >= STREAM_CACHE_FRAMES / 2;
+}
+
+// fills r for playback from frame in direction dir
+// copies old instead of reading the file if it still fits
+// returns 0 on success and -1 on failure
+static int load_stream_region(struct stream_source *src, struct stream_region *r,
+		int32_t frame, int dir, const struct stream_region *old)
+{
+	const int ch = src->channels;
+	if (old && region_fits(old, frame, dir, src->num_frames)) {
+		*r = *old;
+		r->data = malloc(sizeof(float) * (r->frames + 2) * ch);
+		if (!r->data) return -1;
+		memcpy(r->data, old->data, sizeof(float) * (r->frames + 2) * ch);
+	} else {
+		place_region(frame, dir, src->num_frames, &r->first, &r->frames);
+		// guard frame for interpolation and a spare for kernel rounding
+		r->data = malloc(sizeof(float) * (r->frames + 2) * ch);
+		if (!r->data) return -1;
+		read_stream_frames(src, r->data, r->first, r->frames + 2);
+	}
+
+	// audio thread reads cached frames from the first trigger on
+	platform_prefault(r->data, sizeof(float) * (r->frames + 2) * ch);
+	return 0;
+}
+
+static void free_stream_cache(struct stream_cache *c)
+{
+	if (c->head.data) free(c->head.data);
+	if (c->tail.data) free(c->tail.data);
+	free(c);
+}
+
+// caches the frames of src around start_frame and end_frame
+// regions of old that still fit are reused
+// returns NULL on failure
+static struct stream_cache *load_stream_cache(struct stream_source *src,
+		int32_t start_frame, int32_t end_frame, const struct stream_cache *old)
+{
+	struct stream_cache *c = calloc(1, sizeof(*c));
+	if (!c) return NULL;
+
+	if (load_stream_region(src, &c->head, start_frame, 1, old ? &old->head : NULL)
+			|| load_stream_region(src, &c->tail, end_frame - 1, -1, old ? &old->tail : NULL)) {
+		free_stream_cache(c);
+		return NULL;
+	}
+	return c;
+}
+
+// moves the cached regions of s along with its start and end frame
+// the audio thread swaps the new cache in, the old one is freed by
+// reclaim_stream_caches once the swap has been applied
+static void update_stream_cache(struct sp_state *sp_state, struct sample *s)
+{
+	struct sample_stream *st = s->stream;
+	if (!st) return;
+
+	struct stream_cache *old = st->cache;
+	if (region_fits(&old->head, s->start_frame, 1, s->num_frames)
+			&& region_fits(&old->tail, s->end_frame - 1, -1, s->num_frames))
+		return;
+
+	TRACE_BEGIN("load_stream_cache");
+	struct stream_cache *c = load_stream_cache(st->source, s->start_frame, s->end_frame, old);
+	TRACE_END("load_stream_cache");
+	if (!c) {
+		log_msg(LOG_ERROR, "stream: could not cache frames of %s", s->name);
+		return;
+	}
+
+	// the old cache must stay until the audio thread has dropped it
+	struct command_queue *q = sp_state->mixer.cmd_queue;
+	struct command cmd = { .type = CMD_SET_STREAM_CACHE, .sample = s, .cache = c };
+	if (push_command(q, &cmd)) {
+		log_msg(LOG_WARN, "Mixer command queue full, %s keeps its cached frames", s->name);
+		free_stream_cache(c);
+		return;
+	}
+	old->cmd_head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	old->next_retired = sp_state->mixer.retired_caches;
+	sp_state->mixer.retired_caches = old;
+	st->cache = c;
+}
+
+// frees replaced caches the audio thread has stopped reading
+// tail is the command queue tail
+static void reclaim_stream_caches(struct mixer *m, uint32_t tail)
+{
+	struct stream_cache **c = &m->retired_caches;
+	while (*c) {
+		if ((int32_t) (tail - (*c)->cmd_head) >= 0) {
+			struct stream_cache *tmp = *c;
+			*c = tmp->next_retired;
+			free_stream_cache(tmp);
+		} else {
+			c = &(*c)->next_retired;
+		}
+	}
+}
+
+/* streamed samples */
+
+// drops a sample's reference to src, the last one hands src to the
+// prefetch thread which closes it once no ring can be reading it
+static void release_stream_source(struct stream_source *src)
+{
+	if (--src->refs) return;
+
+	struct stream_pool *p = src->pool;
+	platform_mutex_lock(p->dead_lock);
+	src->next_dead = p->dead_sources;
+	p->dead_sources = src;
+	platform_mutex_unlock(p->dead_lock);
+}
+
+// builds the in memory part of a sample streamed from src
+// reads src once for the overview
+// returns NULL on failure
+static struct sample_stream *init_sample_stream(struct stream_source *src,
+		int32_t start_frame, int32_t end_frame)
+{
+	struct sample_stream *st = calloc(1, sizeof(*st));
+	if (!st) return NULL;
+
+	const int ch = src->channels;
+	st->num_overview = (src->num_frames + STREAM_OVERVIEW_FRAMES - 1) / STREAM_OVERVIEW_FRAMES;
+	st->overview = malloc(sizeof(float) * st->num_overview);
+	float *buf = malloc(sizeof(float) * STREAM_CACHE_FRAMES * ch);
+	st->cache = load_stream_cache(src, start_frame, end_frame, NULL);
+	if (!st->overview || !buf || !st->cache) {
+		if (st->overview) free(st->overview);
+		if (st->cache) free_stream_cache(st->cache);
+		if (buf) free(buf);
+		free(st);
+		return NULL;
+	}
+
+	// one point per STREAM_OVERVIEW_FRAMES frames, sampled like the wave viewer
+	TRACE_BEGIN("stream_overview");
+	for (int32_t f = 0; f < src->num_frames; f += STREAM_CACHE_FRAMES) {
+		read_stream_frames(src, buf, f, STREAM_CACHE_FRAMES);
+		for (int i = 0; i < STREAM_CACHE_FRAMES && f + i < src->num_frames; i += STREAM_OVERVIEW_FRAMES)
+			st->overview[(f + i) / STREAM_OVERVIEW_FRAMES] = (buf[i * ch] + buf[i * ch + ch - 1]) / 2.0f;
+		report_load_progress(f + STREAM_CACHE_FRAMES, src->num_frames);
+	}
+	TRACE_END("stream_overview");
+	free(buf);
+
+	st->audio_cache = st->cache;
+	st->source = src;
+	src->refs++;
+	return st;
+}
+
+// copy of st for a copied sample, the source is shared
+// returns NULL on failure
+static struct sample_stream *copy_sample_stream(const struct sample_stream *st,
+		int32_t start_frame, int32_t end_frame)
+{
+	struct sample_stream *copy = calloc(1, sizeof(*copy));
+	if (!copy) return NULL;
+
+	copy->num_overview = st->num_overview;
+	copy->overview = malloc(sizeof(float) * st->num_overview);
+	copy->cache = load_stream_cache(st->source, start_frame, end_frame, st->cache);
+	if (!copy->overview || !copy->cache) {
+		if (copy->overview) free(copy->overview);
+		if (copy->cache) free_stream_cache(copy->cache);
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->overview, st->overview, sizeof(float) * st->num_overview);
+
+	copy->audio_cache = copy->cache;
+	copy->source = st->source;
+	copy->source->refs++;
+	return copy;
+}
+
+// called once the audio thread is done with the sample
+static void free_sample_stream(struct sample_stream *st)
+{
+	free_stream_cache(st->cache);
+	free(st->overview);
+	release_stream_source(st->source);
+	free(st);
+}
+
+// mono value of frame f of s as drawn by the wave viewer
+// streamed samples draw cached frames or else the closest overview point
+static float get_wave_value(const struct sample *s, int32_t f)
+{
+	const int ch = s->channels;
+	if (s->data) return (s->data[f * ch] + s->data[f * ch + ch - 1]) / 2.0f;
+
+	const struct stream_cache *c = s->stream->cache;
+	const struct stream_region *r = NULL;
+	if (f >= c->head.first && f < c->head.first + c->head.frames) r = &c->head;
+	else if (f >= c->tail.first && f < c->tail.first + c->tail.frames) r = &c->tail;
+	if (!r) return s->stream->overview[f / STREAM_OVERVIEW_FRAMES];
+
+	const float *x = r->data + (f - r->first) * ch;
+	return (x[0] + x[ch - 1]) / 2.0f;
+}
+
+/* prefetch thread */
+
+// copies frames [first, first + n) to their slots of r
+static void store_ring_frames(struct stream_ring *r, int ch, const float *src, int32_t first, int n)
+{
+	const int32_t R = STREAM_RING_FRAMES;
+	while (n > 0) {
+		const int32_t slot = first & (R - 1);
+		const int run = n < R - slot ? n : R - slot;
+		memcpy(r->frames + slot * ch, src, sizeof(float) * run * ch);
+		// slot 0 is repeated after the last slot
+		if (!slot) memcpy(r->frames + R * ch, src, sizeof(float) * ch);
+
+		src += run * ch;
+		first += run;
+		n -= run;
+	}
+}
+
+// reads the next chunk of r's source ahead of its voice
+// the ring holds up to 3/4 of its frames ahead of the voice and
+// keeps the rest behind it for small direction changes
+// returns 1 if a chunk was read and 0 if r is free or full
+static int fill_stream_ring(struct stream_ring *r, float *chunk)
+{
+	struct stream_source *src = atomic_load_explicit(&r->source, memory_order_acquire);
+	if (!src) return 0;
+
+	const uint32_t gen = atomic_load_explicit(&r->gen, memory_order_acquire);
+	const int32_t pos = atomic_load_explicit(&r->pos, memory_order_relaxed);
+	const int dir = atomic_load_explicit(&r->dir, memory_order_relaxed);
+	const int32_t R = STREAM_RING_FRAMES;
+	const int32_t ahead = R - R / 4;
+	const int32_t end = src->num_frames + 1;	// up to the silent guard frame
+
+	// voice jumped, start over at its position
+	uint64_t w = atomic_load_explicit(&r->window, memory_order_relaxed);
+	if (atomic_load_explicit(&r->window_gen, memory_order_relaxed) != gen) {
+		int32_t start = dir > 0 ? pos : pos + 2;
+		if (start < 0) start = 0;
+		else if (start > end) start = end;
+		w = pack_window(start, start);
+		atomic_store_explicit(&r->window, w, memory_order_relaxed);
+		atomic_store_explicit(&r->window_gen, gen, memory_order_release);
+	}
+	int32_t lo = window_lo(w);
+	int32_t hi = window_hi(w);
+
+	// frames about to be overwritten leave the window first, they are
+	// at least a quarter ring away from the voice
+	int32_t first;
+	int n = STREAM_CHUNK_FRAMES;
+	if (dir > 0) {
+		if (n > end - hi) n = end - hi;
+		if (n > pos + ahead - hi) n = pos + ahead - hi;
+		if (n <= 0) return 0;
+		first = hi;
+		if (first + n - R > lo) lo = first + n - R;
+	} else {
+		if (n > lo) n = lo;
+		if (n > lo - (pos - ahead)) n = lo - (pos - ahead);
+		if (n <= 0) return 0;
+		first = lo - n;
+		if (first + R < hi) hi = first + R;
+	}
+	atomic_store_explicit(&r->window, pack_window(lo, hi), memory_order_relaxed);
+
+	TRACE_BEGIN("stream_read");
+	read_stream_frames(src, chunk, first, n);
+	TRACE_END("stream_read");
+
+	// voice jumped or stopped while reading, the chunk is stale
+	if (atomic_load_explicit(&r->gen, memory_order_acquire) != gen) return 1;
+
+	store_ring_frames(r, src->channels, chunk, first, n);
+	if (dir > 0) hi = first + n;
+	else lo = first;
+	atomic_store_explicit(&r->window, pack_window(lo, hi), memory_order_release);
+	return 1;
+}
+
+// closes sources released by the ui thread
+// called between passes so no ring is being read from them
+static void close_dead_sources(struct stream_pool *p)
+{
+	platform_mutex_lock(p->dead_lock);
+	struct stream_source *src = p->dead_sources;
+	p->dead_sources = NULL;
+	platform_mutex_unlock(p->dead_lock);
+
+	while (src) {
+		struct stream_source *next = src->next_dead;
+		close_stream_source(src);
+		src = next;
+	}
+}
+
+// prefetch thread, reads one chunk per ring and pass and sleeps
+// STREAM_POLL_NS whenever every ring is full
+static void *prefetch_streams(void *arg)
+{
+	struct stream_pool *p = arg;
+	trace_register_thread("prefetch");
+
+	float *chunk = malloc(sizeof(float) * STREAM_CHUNK_FRAMES * NUM_CHANNELS);
+	if (!chunk) {
+		log_msg(LOG_ERROR, "stream: prefetch thread out of memory");
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&p->stop, memory_order_acquire)) {
+		close_dead_sources(p);
+
+		int busy = 0;
+		for (int i = 0; i < STREAM_MAX_VOICES; i++)
+			busy |= fill_stream_ring(p->rings + i, chunk);
+		if (!busy) platform_sleep_ns(STREAM_POLL_NS);
+	}
+	close_dead_sources(p);
+	free(chunk);
+	return NULL;
+}
+
+// allocates the rings and starts the prefetch thread
+// returns NULL on failure
+static struct stream_pool *start_stream_pool(void)
+{
+	struct stream_pool *p = calloc(1, sizeof(*p));
+	if (!p) return NULL;
+
+	p->dead_lock = platform_init_mutex();
+	for (int i = 0; p->dead_lock && i < STREAM_MAX_VOICES; i++) {
+		struct stream_ring *r = p->rings + i;
+		r->frames = calloc((STREAM_RING_FRAMES + 2) * NUM_CHANNELS, sizeof(float));
+		if (!r->frames) break;
+
+		// written by the prefetch thread, read by the audio thread
+		platform_prefault(r->frames, sizeof(float) * (STREAM_RING_FRAMES + 2) * NUM_CHANNELS);
+		atomic_init(&r->source, NULL);
+		atomic_init(&r->gen, 0);
+		atomic_init(&r->window_gen, 0);
+		atomic_init(&r->window, 0);
+		p->free[p->num_free++] = r;
+	}
+
+	atomic_init(&p->stop, 0);
+	if (p->num_free == STREAM_MAX_VOICES)
+		p->thread = platform_create_thread(prefetch_streams, p);
+	if (!p->thread) {
+		for (int i = 0; i < STREAM_MAX_VOICES; i++) {
+			if (p->rings[i].frames) free(p->rings[i].frames);
+		}
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+// makes the prefetch thread exit after its current pass and waits for it
+// rings are no longer filled, streamed voices play silence from then on
+static void stop_stream_pool(struct stream_pool *p)
+{
+	if (!p || !p->thread) return;
+	atomic_store_explicit(&p->stop, 1, memory_order_release);
+	platform_join_thread(p->thread);
+	p->thread = NULL;
+}
+
+/* audio thread */
+
+// takes a free ring for a voice playing src from pos at speed
+// returns NULL if every ring is taken
+static struct stream_ring *claim_stream_ring(struct stream_pool *p,
+		struct stream_source *src, double pos, float speed)
+{
+	if (!p->num_free) return NULL;
+	struct stream_ring *r = p->free[--p->num_free];
+
+	atomic_store_explicit(&r->pos, (int32_t) floor(pos), memory_order_relaxed);
+	atomic_store_explicit(&r->dir, speed < 0 ? -1 : 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&r->gen, 1, memory_order_release);
+	atomic_store_explicit(&r->source, src, memory_order_release);
+	return r;
+}
+
+static void release_stream_ring(struct stream_pool *p, struct stream_ring *r)
+{
+	atomic_store_explicit(&r->source, NULL, memory_order_release);
+	atomic_fetch_add_explicit(&r->gen, 1, memory_order_release);
+	p->free[p->num_free++] = r;
+}
+
+// tells the prefetch thread where the voice reading r plays next
+static inline void publish_stream_pos(struct stream_ring *r, double pos, float speed)
+{
+	atomic_store_explicit(&r->pos, (int32_t) floor(pos), memory_order_relaxed);
+	atomic_store_explicit(&r->dir, speed < 0 ? -1 : 1, memory_order_relaxed);
+}
+
+// drops the frames in r after the voice reading it jumped to pos
+static void restart_stream_ring(struct stream_ring *r, double pos, float speed)
+{
+	publish_stream_pos(r, pos, speed);
+	atomic_fetch_add_explicit(&r->gen, 1, memory_order_release);
+}
+
+// contiguous frames of a cached region holding frames f and f + 1
+// returns frames from *first, 0 if the region does not hold them
+static int32_t get_region_segment(const struct stream_region *reg, int32_t f,
+		const float **data, int32_t *first)
+{
+	// the guard frame after the region counts
+	if (f < reg->first || f + 1 > reg->first + reg->frames) return 0;
+	*data = reg->data;
+	*first = reg->first;
+	return reg->frames + 1;
+}
+
+// contiguous frames of ring r holding frames f and f + 1
+// returns frames from *first, 0 if they have not been read yet
+static int32_t get_ring_segment(const struct stream_ring *r, int32_t f,
+		const float **data, int32_t *first, int ch)
+{
+	const uint32_t gen = atomic_load_explicit(&r->gen, memory_order_relaxed);
+	if (atomic_load_explicit(&r->window_gen, memory_order_acquire) != gen) return 0;
+
+	const uint64_t w = atomic_load_explicit(&r->window, memory_order_acquire);
+	const int32_t lo = window_lo(w);
+	const int32_t hi = window_hi(w);
+	if (f < lo || f + 1 >= hi) return 0;
+
+	// frames from slot 0 up to the repeat of slot 0 are contiguous
+	const int32_t base = f - (f & (STREAM_RING_FRAMES - 1));
+	const int32_t seg_lo = lo > base ? lo : base;
+	const int32_t seg_hi = hi < base + STREAM_RING_FRAMES + 1 ? hi : base + STREAM_RING_FRAMES + 1;
+	*data = r->frames + (seg_lo - base) * ch;
+	*first = seg_lo;
+	return seg_hi - seg_lo;
+}
+
+// finds frames f and f + 1 of a voice of st reading ring r, NULL if it has none
+// of the cached and prefetched runs holding them the one reaching furthest in
+// direction dir is picked
+// sets *data to frame *first of the run
+// returns frames in the run, 0 if f or f + 1 are not in memory yet
+static int32_t get_stream_segment(const struct sample_stream *st, const struct stream_ring *r,
+		int32_t f, int dir, const float **data, int32_t *first)
+{
+	const struct stream_cache *c = st->audio_cache;
+	const int ch = st->source->channels;
+
+	const float *seg[3];
+	int32_t seg_first[3];
+	int32_t seg_frames[3] = {
+		get_region_segment(&c->head, f, seg + 0, seg_first + 0),
+		get_region_segment(&c->tail, f, seg + 1, seg_first + 1),
+		r ? get_ring_segment(r, f, seg + 2, seg_first + 2, ch) : 0,
+	};
+
+	int best = -1;
+	for (int i = 0; i < 3; i++) {
+		if (!seg_frames[i]) continue;
+		if (best < 0
+				|| (dir > 0 && seg_first[i] + seg_frames[i] > seg_first[best] + seg_frames[best])
+				|| (dir < 0 && seg_first[i] < seg_first[best]))
+			best = i;
+	}
+	if (best < 0) return 0;
+
+	*data = seg[best];
+	*first = seg_first[best];
+	return seg_frames[best];
+}
@@ -0,0 +1,204 @@
+#include "sp_trace.h"
+#include "sp_plus.h"
+#include "sp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_THREAD_NAME_LEN 32
+
+struct trace_event {
+	const char *name;
+	uint64_t ns;		// platform_get_time_ns time
+	char phase;		// 'B' or 'E'
+};
+
+// written only by its thread, events are read back by trace_write
+struct trace_ring {
+	_Atomic(struct trace_event *) events;	// TRACE_RING_EVENTS, NULL until tracing is on
+	atomic_uint_fast64_t head;		// events ever written, next slot is head % TRACE_RING_EVENTS
+	char thread_name[TRACE_THREAD_NAME_LEN];
+	int tid;
+};
+
+atomic_int trace_enabled;
+
+static _Atomic(struct trace_ring *) rings[TRACE_MAX_THREADS];
+static atomic_int num_rings;			// rings claimed, may exceed TRACE_MAX_THREADS
+static atomic_uint_fast64_t trace_start_ns;	// time of first enable, 0 before
+
+static _Thread_local struct trace_ring *thread_ring;
+static _Thread_local int thread_ring_failed;	// so a thread without a ring only complains once
+
+// allocates the events of r unless another thread already did
+// returns NULL on failure
+static struct trace_event *alloc_ring_events(struct trace_ring *r)
+{
+	struct trace_event *events = atomic_load_explicit(&r->events, memory_order_acquire);
+	if (events) return events;
+
+	struct trace_event *e = malloc(sizeof(*e) * TRACE_RING_EVENTS);
+	if (!e) {
+		log_msg(LOG_WARN, "trace: out of memory for thread %s, its events are not recorded",
+				r->thread_name);
+		return NULL;
+	}
+	if (atomic_compare_exchange_strong_explicit(&r->events, &events, e,
+				memory_order_acq_rel, memory_order_acquire))
+		return e;
+	free(e);
+	return events;
+}
+
+// claims and publishes a ring for the calling thread, with its events
+// if tracing is on
+// returns NULL if every ring is taken or allocation fails
+static struct trace_ring *alloc_thread_ring(const char *name)
+{
+	if (thread_ring_failed) return NULL;
+
+	const int i = atomic_fetch_add_explicit(&num_rings, 1, memory_order_relaxed);
+	struct trace_ring *r = i < TRACE_MAX_THREADS ? calloc(1, sizeof(*r)) : NULL;
+	if (!r) {
+		log_msg(LOG_WARN, "trace: no ring for thread %s, its events are not recorded",
+				name ? name : "");
+		thread_ring_failed = 1;
+		return NULL;
+	}
+
+	r->tid = i + 1;
+	if (name) snprintf(r->thread_name, sizeof(r->thread_name), "%s", name);
+	else snprintf(r->thread_name, sizeof(r->thread_name), "thread %d", r->tid);
+	atomic_init(&r->events, NULL);
+	atomic_init(&r->head, 0);
+
+	atomic_store_explicit(&rings[i], r, memory_order_release);
+	thread_ring = r;
+
+	// trace_set_enabled may have looked at the rings before this one was published
+	if (atomic_load(&trace_enabled)) alloc_ring_events(r);
+	return r;
+}
+
+int trace_register_thread(const char *name)
+{
+	if (thread_ring) {
+		snprintf(thread_ring->thread_name, sizeof(thread_ring->thread_name), "%s", name);
+		return 0;
+	}
+	return alloc_thread_ring(name) ? 0 : -1;
+}
+
+void trace_event(const char *name, char phase)
+{
+	struct trace_ring *r = thread_ring;
+	if (!r && !(r = alloc_thread_ring(NULL))) return;
+
+	// events are allocated by trace_set_enabled, this thread only
+	// allocates them if it registered while tracing was being turned on
+	struct trace_event *events = atomic_load_explicit(&r->events, memory_order_acquire);
+	if (!events && !(events = alloc_ring_events(r))) return;
+
+	const uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct trace_event *e = events + head % TRACE_RING_EVENTS;
+	e->name = name;
+	e->ns = platform_get_time_ns();
+	e->phase = phase;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_set_enabled(int on)
+{
+	uint64_t unset = 0;
+	if (on) {
+		atomic_compare_exchange_strong(&trace_start_ns, &unset, platform_get_time_ns());
+
+		// allocate here so registered threads never allocate when recording starts
+		int n = atomic_load(&num_rings);
+		if (n > TRACE_MAX_THREADS) n = TRACE_MAX_THREADS;
+		for (int i = 0; i < n; i++) {
+			struct trace_ring *r = atomic_load_explicit(&rings[i], memory_order_acquire);
+			if (r) alloc_ring_events(r);
+		}
+	}
+	atomic_store_explicit(&trace_enabled, on, memory_order_relaxed);
+}
+
+// copies the events of r still in the ring to out in order
+// returns number of events copied
+static int copy_ring(struct trace_ring *r, struct trace_event *out)
+{
+	const struct trace_event *events = atomic_load_explicit(&r->events, memory_order_acquire);
+	if (!events) return 0;
+
+	const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	const uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+	for (uint64_t i = first; i < head; i++)
+		out[i - first] = events[i % TRACE_RING_EVENTS];
+
+	// drop events the writer overwrote while they were copied
+	const uint64_t after = atomic_load_explicit(&r->head, memory_order_acquire);
+	const uint64_t valid = after > TRACE_RING_EVENTS ? after - TRACE_RING_EVENTS : 0;
+	if (valid <= first) return head - first;
+	if (valid >= head) return 0;
+	memmove(out, out + (valid - first), (head - valid) * sizeof(*out));
+	return head - valid;
+}
+
+int trace_write(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		log_msg(LOG_ERROR, "trace: could not open %s", path);
+		return -1;
+	}
+
+	struct trace_event *events = malloc(sizeof(*events) * TRACE_RING_EVENTS);
+	if (!events) {
+		fclose(f);
+		return -1;
+	}
+
+	const uint64_t start = atomic_load(&trace_start_ns);
+	int n = atomic_load(&num_rings);
+	if (n > TRACE_MAX_THREADS) n = TRACE_MAX_THREADS;
+
+	fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	int need_comma = 0;
+	for (int i = 0; i < n; i++) {
+		struct trace_ring *r = atomic_load_explicit(&rings[i], memory_order_acquire);
+		if (!r) continue;
+
+		fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+				"\"args\": {\"name\": \"%s\"}}",
+				need_comma ? ",\n" : "", r->tid, r->thread_name);
+		need_comma = 1;
+
+		// the ring may start inside a slice, skip ends without a begin
+		const int num_events = copy_ring(r, events);
+		int depth = 0;
+		for (int j = 0; j < num_events; j++) {
+			const struct trace_event *e = events + j;
+			if (e->phase == 'E') {
+				if (!depth) continue;
+				depth--;
+			} else {
+				depth++;
+			}
+
+			// chrome trace time is in microseconds
+			const double ts = (double) (int64_t) (e->ns - start) / 1000.0;
+			fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+					e->name, e->phase, ts, r->tid);
+		}
+	}
+	fprintf(f, "\n]}\n");
+	free(events);
+
+	if (fclose(f)) {
+		log_msg(LOG_ERROR, "trace: could not write %s", path);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef SP_TRACE_H
+#define SP_TRACE_H
+
+#include <stdatomic.h>
+
+//////////////////////////////////////////////////////////////////
+/// Tracing
+///
+/// Records begin and end events into a ring per thread and writes
+/// them as Chrome trace JSON, open it in ui.perfetto.dev or
+/// chrome://tracing. Each thread only writes its own ring so
+/// recording never locks. While tracing is off an event costs one
+/// relaxed load and a branch and the rings hold no events buffer,
+/// they are allocated when tracing is first turned on.
+
+#define TRACE_MAX_THREADS 256
+#define TRACE_RING_EVENTS 32768		// per thread, oldest events are overwritten
+#define TRACE_DEFAULT_PATH "sp-plus-trace.json"
+
+extern atomic_int trace_enabled;
+
+// name must be a string literal or otherwise outlive the trace
+#define TRACE_BEGIN(name) \
+	do { \
+		if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+			trace_event(name, 'B'); \
+	} while (0)
+
+#define TRACE_END(name) \
+	do { \
+		if (atomic_load_explicit(&trace_enabled, memory_order_relaxed)) \
+			trace_event(name, 'E'); \
+	} while (0)
+
+void trace_event(const char *name, char phase);
+// records an event on the calling thread's ring, use TRACE_BEGIN and TRACE_END
+// a thread that did not call trace_register_thread allocates its ring here
+
+int trace_register_thread(const char *name);
+// claims the calling thread's ring and names the thread in the trace
+// call before a realtime loop so tracing never allocates on that thread
+// returns 0 on success and -1 if every ring is taken or allocation fails
+
+void trace_set_enabled(int on);
+// starts or stops recording on every thread
+// turning it on allocates the events of every registered ring that has none
+
+int trace_write(const char *path);
+// writes events held in every ring to path as Chrome trace JSON
+// safe to call while other threads record, events overwritten during
+// the copy are dropped
+// returns 0 on success and -1 on failure
+
+#endif
@@ -2,9 +2,11 @@
 #define SP_TYPES_H
 
 #include "stb_truetype.h"
+#include "sp_convert.h"
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 // TODO might want to make a pad struct that holds reference to a sample 
 // and contains information about its bank and pad
@@ -41,6 +43,8 @@ struct sampler {
 	int max_vert;			// max vertices to render in wave viewer
 };
 
+#define MIX_BLOCK_FRAMES 256		// max frames rendered by the mixer at a time
+
 // Used to route and mix audio data
 // busses will have one output allowing mixer to be represented as a tree
 //
@@ -63,16 +67,282 @@ struct bus {
 	float atten;			// attenuation gain, [0.0, 1.0]
 	float pan;			// -1.0 = L, 1.0 = R
 
+	// gain derived from atten and pan
+	// owned by the audio thread, only changed through the mixer command queue
+	float gain_l;
+	float gain_r;
+
 	// bool active;			// should data be grabbed from bus
 	// bool solo;			// is this bus soloed
 };
 
 
+enum loop_mode {
+	LOOP_OFF = 0,
+	LOOP,
+	PING_PONG
+};
+
+// voice to replace when polyphony is reached
+enum steal_mode {
+	STEAL_OLDEST = 0,
+	STEAL_QUIETEST
+};
+
+// settings a sample plays with, the audio thread keeps its own copy
+// the ui edits the fields of the sample and sends them with CMD_SET_PLAYBACK
+struct playback {
+	int32_t start_frame;
+	int32_t end_frame;
+	int32_t attack;
+	int32_t release;
+	int polyphony;
+	enum steal_mode steal_mode;
+	enum loop_mode loop_mode;
+	bool gate;
+};
+
+// commands sent from the ui thread to the audio thread
+enum command_type {
+	CMD_TRIGGER_SAMPLE = 0,
+	CMD_KILL_SAMPLE,
+	CMD_RESET_SAMPLE,		// rewind sample if it is not playing
+	CMD_CLOSE_GATE,
+	CMD_SET_SPEED,
+	CMD_REVERSE,			// flip playback direction
+	CMD_SET_BUS_GAIN,
+	CMD_SET_STREAM_CACHE,		// swap in the cached frames of a streamed sample
+	CMD_SET_PLAYBACK		// update the audio thread's copy of sample settings
+};
+
+struct command {
+	enum command_type type;
+	struct sample *sample;
+	struct bus *bus;
+	uint64_t frame;			// audio frame to apply command on, 0 for next block
+
+	union {
+		float speed;		// CMD_SET_SPEED, magnitude of speed
+		struct {
+			float l;
+			float r;
+		} gain;			// CMD_SET_BUS_GAIN
+		struct stream_cache *cache;	// CMD_SET_STREAM_CACHE
+		struct playback playback;	// CMD_SET_PLAYBACK
+	};
+};
+
+// single-producer single-consumer lock-free queue
+#define CMD_QUEUE_SIZE 1024		// must be a power of 2
+struct command_queue {
+	struct command cmds[CMD_QUEUE_SIZE];
+	_Alignas(64) _Atomic uint32_t head;	// next slot to write, written by producer
+	_Alignas(64) _Atomic uint32_t tail;	// next slot to read, written by consumer
+};
+
+// one bus of a compiled mixer plan
+struct mix_node {
+	struct bus *bus;		// bus gain is read from here
+	struct sample *sample;		// sample input, NULL for busses with bus inputs
+	int output;			// index of output node, -1 for master
+	float *block;			// preassigned mix buffer
+					// sample nodes sum their voices here
+};
+
+// Immutable render order of the mixer tree built by the ui thread
+// Nodes are topologically sorted so every input comes before its output
+// and master is last. The audio thread renders the whole tree in one pass.
+struct mix_plan {
+	struct mix_node *nodes;
+	int num_nodes;
+
+	float *blocks;			// MIX_BLOCK_FRAMES stereo frames per node
+	float *scratch;			// render buffer shared by voices
+	bool *live;			// node block holds audio this block
+
+	uint64_t seq;			// increases with every published plan
+
+	// ui thread bookkeeping for reclaiming plans
+	struct mix_plan *next_retired;
+	uint32_t cmd_head;		// command queue head when plan was retired
+	struct bus **dead_busses;	// freed with this plan
+	int num_dead_busses;
+	struct sample **dead_samples;	// freed with this plan
+	int num_dead_samples;
+};
+
+// audio thread's frame clock, published with a sequence lock
+// seq is odd while the audio thread is writing
+struct audio_clock {
+	_Atomic uint32_t seq;
+	_Atomic uint64_t frame;		// first frame of the last fill_audio_buffer call
+	_Atomic uint64_t time_ns;	// platform_get_time_ns at the start of that call
+	_Atomic int period;		// frames requested by that call
+};
+
+#define STREAM_RING_FRAMES 65536	// frames read ahead per voice, power of 2
+#define STREAM_MAX_VOICES 16		// streamed voices with a ring at once
+#define STREAM_CACHE_FRAMES 65536	// frames kept around start and end frame
+#define STREAM_CHUNK_FRAMES 4096	// frames read from disk at a time
+#define STREAM_OVERVIEW_FRAMES 64	// frames per point of the waveform overview
+#define STREAM_POLL_NS (2 * 1000000ULL)	// prefetch thread wake up interval
+
+// frames of a streamed sample on disk, either the 16 bit data of its mapped wav
+// or a temp file of float frames resampled to the engine rate
+struct stream_source {
+	void *file;			// NULL if frames are read from map
+	const char *map;		// mapping of the wav file, NULL if read from file
+	long map_bytes;
+	long offset;			// byte offset of the first frame
+	bool is_float;
+	int channels;
+	int32_t num_frames;
+	atomic_bool read_failed;	// a read error was logged
+
+	int refs;			// samples reading the source, ui thread only
+	struct stream_pool *pool;	// pool that closes the source
+	struct stream_source *next_dead;
+};
+
+// frames [first, first + frames) of a source held in memory followed by
+// a guard frame and a spare frame, frames past the source are silent
+struct stream_region {
+	float *data;
+	int32_t first;
+	int32_t frames;
+};
+
+// frames of a streamed sample kept in memory so triggers never wait on disk
+// replaced as a whole when start_frame or end_frame leave their region
+struct stream_cache {
+	struct stream_region head;	// from just before start_frame on
+	struct stream_region tail;	// up to end_frame, for reverse playback
+
+	// ui thread bookkeeping for reclaiming caches
+	struct stream_cache *next_retired;
+	uint32_t cmd_head;		// command queue head when cache was replaced
+};
+
+// in memory part of a streamed sample
+struct sample_stream {
+	struct stream_source *source;
+	float *overview;		// mono frame every STREAM_OVERVIEW_FRAMES frames
+	int num_overview;
+	struct stream_cache *cache;	// newest cache, ui thread
+	struct stream_cache *audio_cache;	// cache read by the audio thread
+					// set with CMD_SET_STREAM_CACHE
+};
+
+// frames the prefetch thread reads ahead of one streamed voice
+// frame f is held in slot f % STREAM_RING_FRAMES, slot 0 is repeated after
+// the last slot so the frame after every slot is contiguous with it
+struct stream_ring {
+	float *frames;			// STREAM_RING_FRAMES + 2 frames
+
+	// written by the audio thread
+	_Atomic(struct stream_source *) source;	// NULL while the ring is free
+	_Atomic uint32_t gen;		// bumped when the voice jumps
+	_Atomic int32_t pos;		// frame the voice plays next
+	_Atomic int dir;		// 1 forward, -1 backward
+
+	// written by the prefetch thread
+	_Atomic uint32_t window_gen;	// gen the window was filled for
+	_Atomic uint64_t window;	// valid frames, see pack_window
+};
+
+// rings shared by streamed voices and the prefetch thread filling them
+struct stream_pool {
+	struct stream_ring rings[STREAM_MAX_VOICES];
+	struct stream_ring *free[STREAM_MAX_VOICES];	// audio thread
+	int num_free;
+
+	_Atomic uint64_t underruns;	// blocks a voice waited on disk
+
+	void *thread;			// prefetch thread
+	atomic_int stop;		// set to make the prefetch thread exit
+	void *dead_lock;		// guards dead_sources
+	struct stream_source *dead_sources;	// closed by the prefetch thread
+};
+
+// input events are heard this long after they happen
+// covers one ui frame at 60fps plus one audio period so that
+// every event lands in a future block at its exact offset
+#define INPUT_LATENCY_NS (1000000000 / 60)
+
+#define MAX_VOICES 256			// voices in the voice pool
+#define VOICE_HEADROOM 8		// voices kept free for fading out stolen voices
+#define MAX_POLYPHONY 32		// max voices per sample
+#define DEFAULT_POLYPHONY 4
+#define STEAL_FADE_FRAMES 64		// fade out length of a stolen voice
+
+// one playback of a sample
+// owned by the audio thread
+struct voice {
+	struct sample *sample;
+	bool playing;			// cleared when playback ends
+	double next_frame;		// next frame to be played
+					// next frame is fractional to allow stretching
+	float speed;			// playback speed, negative when playing backward
+
+	bool gate_closed;		// need to know when gate closes to apply release
+	int32_t gate_release;		// used to calculate release after gate is closed
+					// how many frames have passed since gate was closed
+	double gate_release_cnt;
+	double gate_close_gain;		// gain at time of gate close
+
+	bool stolen;			// fading out to make room for another voice
+	uint64_t age;			// trigger count at start, lower is older
+	float level;			// peak of last rendered block
+	int index;			// position in voice_pool active list
+	struct stream_ring *ring;	// frames read ahead from disk, NULL if the
+					// sample is in memory or no ring was free
+};
+
+// preallocated voices
+// free voices are kept on a stack and active voices in a dense list
+struct voice_pool {
+	struct voice voices[MAX_VOICES];
+	struct voice *free[MAX_VOICES];
+	int num_free;
+	struct voice *active[MAX_VOICES];
+	int num_active;
+	uint64_t num_triggers;
+	struct stream_pool *streams;	// set by the ui thread before the first
+					// streamed sample reaches a plan
+};
+
 #define R_BUFF_MAX 64			// bytes to allocate when allocating rename buff
 struct mixer {
+	int sample_rate;		// engine rate, fixed at startup
 	struct bus master;		// bus tree root
 					// gets passed to playback code
-	void *master_mutex;		// mutex for bus tree
+	struct command_queue *cmd_queue;	// ui thread -> audio thread
+
+	_Atomic(struct mix_plan *) plan;	// current plan, swapped in by ui thread
+	_Atomic uint64_t plan_done;	// seq of last plan audio thread finished a block with
+	uint64_t plan_seq;		// seq of last compiled plan
+	struct mix_plan *retired_plans;	// replaced plans waiting to be freed
+	bool graph_changed;		// plan must be recompiled
+
+	// audio thread state
+	struct voice_pool voices;
+	const struct mix_plan *bound_plan;	// plan samples are bound to, see bind_voices
+	uint64_t frame;			// frames rendered so far
+	struct dither_state dither;	// output dither noise
+
+	struct audio_clock clock;	// written by audio thread
+
+	// disk streaming, see sp_stream.c
+	struct stream_pool *streams;	// NULL until the first streamed sample loads
+	int32_t stream_threshold;	// samples longer than this many frames are
+					// streamed, 0 loads every sample into memory
+	struct stream_cache *retired_caches;	// replaced caches waiting to be freed
+
+	// busses and samples removed since the last plan was published
+	struct bus **dead_busses;
+	int num_dead_busses;
+	struct sample **dead_samples;
+	int num_dead_samples;
 
 	struct bus **bus_list;		// pointers to busses to be used by ui
 					// need a lock for this if update
@@ -98,34 +368,40 @@ struct mixer {
 struct sample {
 	char* name;
 
-	double* data;		// 16_bit float data
+	float* data;		// 32-bit float data, interleaved if stereo
+				// followed by one silent guard frame
+				// NULL if the sample is streamed
+	struct sample_stream *stream;	// NULL unless streamed from disk
+	int channels;		// channels in data, 1 (mono) or 2 (stereo)
 	int32_t start_frame;	// start playback on this frame
 	int32_t end_frame;	// end when this frame is reached 
-	double next_frame;	// next frame to be played during playback
-				// next frame is fractional to allow stretching
 
 	int frame_size;		// size in bytes
 	int32_t num_frames;
-	float speed;		// playback speed
+	float speed;		// playback speed of new voices
+				// set by audio thread, negative when reversed
 	int rate;		// sample_rate in Hz
 
 	bool gate;		// trigger sample in gate mode
-	bool playing;		// is sample currently playing
-	enum {
-		LOOP_OFF = 0, 
-		LOOP, 
-		PING_PONG
-	} loop_mode;
+	enum loop_mode loop_mode;
 	bool reverse;		// is sample playing from start to end
 
 	int32_t attack;		// attack in frames
 	int32_t release;	// release in frames
 
-	bool gate_closed;	// need to know when gate closes to apply release
-	int32_t gate_release;	// used to calculate release after gate is closed
-				// how many frames have passed since gate was closed
-	double gate_release_cnt;
-	double gate_close_gain; // gain at time of gate close
+	int polyphony;		// max voices playing this sample at once
+	enum steal_mode steal_mode;	// voice to replace when polyphony is reached
+
+	// settings above as the audio thread plays them
+	// set when the sample is placed, then only written by the audio thread
+	struct playback play;
+
+	// written by audio thread
+	int num_voices;		// voices playing, not counting stolen voices
+	double next_frame;	// playback position of newest voice, for display
+	struct voice *newest_voice;
+	int mix_node;		// index of sample node in bound plan
+	uint64_t mix_seq;	// seq of plan mix_node belongs to
 
 	struct bus *output_bus;	// used for manipulating mixer structure
 };
@@ -162,6 +438,48 @@ struct file_browser {
 	int loading_to_pad;	// true iff waiting for pad destination to load file
 };
 
+#define MAX_LOAD_JOBS 256		// loads queued or running at once
+
+enum load_state {
+	LOAD_FREE = 0,			// slot is unused
+	LOAD_QUEUED,			// waiting for a worker
+	LOAD_RUNNING,			// a worker is loading the file
+	LOAD_DONE			// sample is ready for the ui thread
+};
+
+// wav loaded onto a pad by a worker thread
+// ui thread fills a free job and queues it, a worker claims and loads it,
+// then the ui thread places the sample on its pad and frees the job
+struct load_job {
+	atomic_int state;		// enum load_state
+	atomic_int progress;		// permille of the load done, set by the worker
+
+	char *path;
+	int bank;			// destination pad
+	int pad;
+	int batch;			// folder load the job is part of, 0 if none
+	bool superseded;		// a later load targets the same pad, ui thread only
+
+	// load settings, copied when queued so workers never read the mixer
+	int engine_rate;
+	int32_t stream_threshold;
+	struct stream_pool *streams;
+
+	struct sample *sample;		// loaded sample or NULL on failure, valid once done
+};
+
+// pool of worker threads loading samples off the ui thread
+struct loader {
+	struct load_job jobs[MAX_LOAD_JOBS];
+	int num_jobs;			// jobs that are not free, ui thread only
+	int num_batches;		// folder loads queued so far, ui thread only
+
+	void *pending;			// semaphore counting queued jobs
+	void **workers;			// one per cpu
+	int num_workers;		// started with the first queued load
+	atomic_int stop;		// set to make workers exit
+};
+
 // interactive shell data
 struct shell {
 	char *input_buff;	// stores user input
@@ -170,6 +488,8 @@ struct shell {
 
 	char *print_buff;	// stores text to printed to shell
 	int print_size;		// size of print buff
+
+	uint32_t log_seen;	// last log line printed, see log_get_shell_line
 };
 
 // program state held by platform code
@@ -178,6 +498,7 @@ struct sp_state {
 	struct sampler sampler;
 	struct shell shell;
 	struct file_browser file_browser;
+	struct loader loader;
 
 	struct font fonts[NUM_FONTS]; // array of fonts
 
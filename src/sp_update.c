@@ -83,11 +83,17 @@ static void poll_shell_input(struct sp_state *sp_state, struct key_input *input)
 		}
 	}
 
-	for (int c = input->num_key_press[KEY_SPACE]; c > 0; c--) {
-		if (shell->input_pos >= shell->input_size) 
-			shell->input_buff = realloc(shell->input_buff, shell->input_size *= 2);
+	// space and the punctuation of file paths, shift + minus is '_'
+	const struct { int key; char c; } punct[] = {
+		{KEY_SPACE, ' '}, {KEY_PERIOD, '.'}, {KEY_SLASH, '/'}, {KEY_MINUS, alt ? '_' : '-'},
+	};
+	for (size_t i = 0; i < sizeof(punct) / sizeof(punct[0]); i++) {
+		for (int c = input->num_key_press[punct[i].key]; c > 0; c--) {
+			if (shell->input_pos >= shell->input_size) 
+				shell->input_buff = realloc(shell->input_buff, shell->input_size *= 2);
 
-		shell->input_buff[shell->input_pos++] = ' ';
+			shell->input_buff[shell->input_pos++] = punct[i].c;
+		}
 	}
 
 	for (int c = input->num_key_press[KEY_BACKSPACE]; c > 0; c--) {
@@ -105,7 +111,7 @@ static char *get_shell_input(struct sp_state *sp_state)
 
 	char *out_buff = malloc(shell->input_pos + 1);
 	if (!out_buff) {
-		fprintf(stderr, "Could not shell input return buffer");
+		log_msg(LOG_ERROR, "Could not shell input return buffer");
 		return NULL;
 	}
 	
@@ -122,19 +128,75 @@ static void clear_shell_input(struct sp_state *sp_state)
 	sp_state->shell.input_pos = 0;
 }
 
+// prints audio thread counters and the load histogram to the shell
+// histogram buckets are labelled by their lower bound in percent
+static void print_audio_stats(struct sp_state *sp_state)
+{
+	struct audio_stats stats;
+	platform_get_audio_stats(&stats);
+
+	char txt[512];
+	int len = snprintf(txt, sizeof(txt), "periods %lu, xruns %lu, suspends %lu, peak %.0f%%, load:",
+			stats.periods, stats.xruns, stats.suspends, 100.0f * stats.peak_load);
+	for (int i = 0; i < LOAD_HIST_BUCKETS && len < (int) sizeof(txt); i++) {
+		if (!stats.load_hist[i]) continue;
+		len += snprintf(txt + len, sizeof(txt) - len, " %d%s:%lu",
+				i * 10, i == LOAD_HIST_BUCKETS - 1 ? "+" : "", stats.load_hist[i]);
+	}
+
+	// blocks a streamed voice waited for the prefetch thread
+	const struct stream_pool *streams = sp_state->mixer.streams;
+	if (streams && len < (int) sizeof(txt)) {
+		snprintf(txt + len, sizeof(txt) - len, ", stream underruns %lu",
+				atomic_load_explicit(&streams->underruns, memory_order_relaxed));
+	}
+	shell_print(txt, sp_state);
+}
+
+// runs a command entered in the shell
+static void run_shell_command(const char *cmd, struct sp_state *sp_state)
+{
+	if (!strcmp(cmd, "stats")) {
+		print_audio_stats(sp_state);
+	} else if (!strcmp(cmd, "stats reset")) {
+		platform_reset_audio_stats();
+		shell_print("Audio stats reset", sp_state);
+	} else if (!strcmp(cmd, "trace on")) {
+		trace_set_enabled(1);
+		shell_print("Tracing", sp_state);
+	} else if (!strcmp(cmd, "trace off")) {
+		trace_set_enabled(0);
+		shell_print("Tracing stopped", sp_state);
+	} else if (!strncmp(cmd, "trace write", 11) && (!cmd[11] || cmd[11] == ' ')) {
+		// optional path after the command
+		const char *path = cmd[11] ? cmd + 12 : TRACE_DEFAULT_PATH;
+		char txt[256];
+		if (trace_write(path)) snprintf(txt, sizeof(txt), "Could not write %s", path);
+		else snprintf(txt, sizeof(txt), "Wrote trace to %s", path);
+		shell_print(txt, sp_state);
+	} else if (*cmd) {
+		shell_print("Unknown command", sp_state);
+	}
+}
+
 static void update_shell(struct sp_state *sp_state, struct key_input *input)
 {
+#ifdef DEBUG
 	struct shell *shell = &sp_state->shell;
 	ASSERT(shell);
 	ASSERT(shell->input_buff);
+#endif
 
 	// poll input
 	poll_shell_input(sp_state, input);
 
-	// on enter decide what to do with switch statement
+	// on enter run command and clear input
 	if (is_key_pressed(input, KEY_ENTER)) {
-		// clear input
-		shell->input_pos = 0;
+		char *cmd = get_shell_input(sp_state);
+		if (cmd) {
+			run_shell_command(cmd, sp_state);
+			free(cmd);
+		}
 	}
 }
 
@@ -150,64 +212,43 @@ static inline void squeeze_envelope(struct sample *s )
 	s->release = s->end_frame - s->start_frame - s->attack;
 }
 
-static inline double get_envelope_gain(struct sample* s)
+// left and right gain of a bus from its attenuation and pan
+static inline void get_bus_gain(const struct bus *b, float *l, float *r)
 {
-	double g = 1.0;
-	if (s->attack && s->next_frame - s->start_frame < s->attack) {
-		g = (s->next_frame - s->start_frame) / s->attack;
-	} else if (s->release && s->end_frame - s->next_frame <= s->release) {
-		g = (s->end_frame - s->next_frame) / s->release;
-	}
-	return g;
+	*l = (1.0f - b->atten) * fminf(1.0f - b->pan, 1.0f);
+	*r = (1.0f - b->atten) * fminf(1.0f + b->pan, 1.0f);
 }
 
-static void close_gate(struct sample* s)
+// sends b's gain to the audio thread
+// must be called after every change to b->atten or b->pan
+static void send_bus_gain(struct bus *b, struct sp_state *sp_state)
 {
-	if (!s) return;
-	// check if gate should release
-	// probably need this playing check in case of a sample switch with no trigger (SHIFT)
-	if (!(s->gate && s->playing && !s->gate_closed)) return;
-
-	s->gate_release_cnt = 0.0;
-	s->gate_closed = true;
-	s->gate_close_gain = get_envelope_gain(s);
-	// if sample is playing forward compare to release
-	if (s->speed > 0) {
-		s->gate_release = s->release;
-		if (s->end_frame - s->next_frame < s->release)
-			s->gate_release_cnt = s->release - (s->end_frame - s->next_frame);
-		// if sample is playing backward compare to attack
-	} else {
-		s->gate_release = s->attack;
-		if (s->next_frame - s->start_frame < s->attack)
-			s->gate_release_cnt = s->release - (s->next_frame - s->start_frame);
-	}
+	struct command cmd = { .type = CMD_SET_BUS_GAIN, .bus = b };
+	get_bus_gain(b, &cmd.gain.l, &cmd.gain.r);
+	send_command(sp_state, &cmd);
 }
 
-static inline void trigger_sample(struct sample* s)
+// playback settings of s as edited by the ui
+static inline struct playback get_playback(const struct sample *s)
 {
-	if (!s->reverse) s->next_frame = s->start_frame;
-	else s->next_frame = s->end_frame - 1.0;
-
-	if (s->loop_mode && s->playing) s->playing = false;
-	else s->playing = true;
-
-	s->gate_closed = false;
+	return (struct playback) {
+		.start_frame = s->start_frame,
+		.end_frame = s->end_frame,
+		.attack = s->attack,
+		.release = s->release,
+		.polyphony = s->polyphony,
+		.steal_mode = s->steal_mode,
+		.loop_mode = s->loop_mode,
+		.gate = s->gate,
+	};
 }
 
-static inline int kill_sample(struct sample* s)
+// sends s's playback settings to the audio thread
+// must be called after every change to them once s is placed on a pad
+static void send_playback(struct sample *s, struct sp_state *sp_state)
 {
-	if (!s) return 1;
-	s->playing = false;
-	s->gate_closed = false;
-	if (s->reverse)	{
-		s->next_frame = s->end_frame - 1;
-		if (s->speed > 0) s->speed *= -1;
-	} else {
-		s->next_frame = s->start_frame;
-		if (s->speed < 0) s->speed *= -1;
-	}
-	return 0;
+	struct command cmd = { .type = CMD_SET_PLAYBACK, .sample = s, .playback = get_playback(s) };
+	send_command(sp_state, &cmd);
 }
 
 // find bus with sample s and replace with null
@@ -215,19 +256,13 @@ static inline void detach_sample_from_mixer(struct sample *s, struct sp_state *s
 {
 	ASSERT(s && sp_state);
 
-	int err;
-	err = platform_mutex_lock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
-
 	struct bus *b = s->output_bus;
 	if (b) {
 		if (b->sample_in == s) {
 			b->sample_in = NULL;
+			sp_state->mixer.graph_changed = true;
 		}
 	}
-
-	err = platform_mutex_unlock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
 }
 
 // replace sample_in of bus b with s
@@ -235,45 +270,25 @@ static inline void attach_sample_to_bus(struct sample *s, struct bus *b, struct
 {
 	ASSERT(s && b && sp_state);
 
-	struct mixer *mixer = &(sp_state->mixer);
-	int err;
-	err = platform_mutex_lock(mixer->master_mutex);
-	ASSERT(!err);
-
 	// attach bus to tree
 	s->output_bus = b;
 	b->sample_in = s;
-
-	// TODO multi sample_in code can be deleted eventually
-	/*
-	   b->sample_ins = realloc(b->sample_ins, sizeof(struct sample *) * ++(b->num_sample_ins));
-	   b->sample_ins[b->num_sample_ins - 1] = s;
-	   */
-
-	err = platform_mutex_unlock(mixer->master_mutex);
-	ASSERT(!err);
+	sp_state->mixer.graph_changed = true;
 }
 
 // attachs child bus to parent bus in mixing tree
-static void attach_bus(struct bus *child, struct bus *parent, const struct sp_state *sp_state)
+static void attach_bus(struct bus *child, struct bus *parent, struct sp_state *sp_state)
 {
-	int err = platform_mutex_lock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
-
 	parent->bus_ins = realloc(parent->bus_ins, sizeof(struct bus *) * ++(parent->num_bus_ins));
 	parent->bus_ins[parent->num_bus_ins - 1] = child;
 	child->output_bus = parent;
 
-	err = platform_mutex_unlock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
+	sp_state->mixer.graph_changed = true;
 }
 
 // detach bus from mixing tree and remove from bus list
 static void detach_bus_from_mixer(struct bus *b, struct sp_state *sp_state)
 {
-	int err = platform_mutex_lock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
-
 	struct bus *parent = b->output_bus;
 
 	// reroute child's bus inputs to parent
@@ -285,6 +300,10 @@ static void detach_bus_from_mixer(struct bus *b, struct sp_state *sp_state)
 			parent->bus_ins[parent->num_bus_ins - 1 - i] = b->bus_ins[i];
 			b->bus_ins[i]->output_bus = parent;
 		}
+
+		free(b->bus_ins);
+		b->bus_ins = NULL;
+		b->num_bus_ins = 0;
 	}
 
 	// remove child bus from parent bus ins
@@ -297,9 +316,7 @@ static void detach_bus_from_mixer(struct bus *b, struct sp_state *sp_state)
 	parent->bus_ins = realloc(parent->bus_ins, sizeof(struct bus *) * --(parent->num_bus_ins));
 	b->output_bus = NULL;
 
-
-	err = platform_mutex_unlock(sp_state->mixer.master_mutex);
-	ASSERT(!err);
+	sp_state->mixer.graph_changed = true;
 }
 
 // allocates and inits a new bus structure
@@ -308,6 +325,9 @@ static struct bus *init_bus(struct sp_state *sp_state)
 	struct bus *new_bus = calloc(1, sizeof(*new_bus));
 	if (!new_bus) return NULL;
 
+	new_bus->gain_l = 1.0f;
+	new_bus->gain_r = 1.0f;
+
 	// setup bus label
 	int MAX_LABEL_LEN = 10;
 	new_bus->label = malloc(MAX_LABEL_LEN);
@@ -321,7 +341,8 @@ static struct bus *init_bus(struct sp_state *sp_state)
 	return new_bus;
 }
 
-// frees a bus and removes it from bus list
+// removes a bus from bus list
+// bus memory is freed once the audio thread stops using the current plan
 static void free_bus(struct bus *b, struct sp_state *sp_state)
 {
 	ASSERT(b && sp_state);
@@ -337,15 +358,31 @@ static void free_bus(struct bus *b, struct sp_state *sp_state)
 	}
 	m->bus_list = realloc(m->bus_list, sizeof(struct bus *) * --(m->num_bus));
 
+	m->dead_busses = realloc(m->dead_busses, sizeof(struct bus *) * ++(m->num_dead_busses));
+	m->dead_busses[m->num_dead_busses - 1] = b;
+	m->graph_changed = true;
+}
+
+static void destroy_bus(struct bus *b)
+{
 	if (b->label) free(b->label);
 	if (b->bus_ins) free(b->bus_ins);
 	free(b);
 }
 
+static void destroy_sample(struct sample *s)
+{
+	if (s->name) free(s->name);
+	if (s->data) free(s->data);
+	if (s->stream) free_sample_stream(s->stream);
+	free(s);
+}
+
 // unloads sample from sampler and removes sample bus
 static inline void unload_sample(struct sample *s, struct sp_state *sp_state)
 {
 	ASSERT(s);
+	struct mixer *m = &sp_state->mixer;
 	detach_sample_from_mixer(s, sp_state);
 
 	// detach output_bus
@@ -355,10 +392,9 @@ static inline void unload_sample(struct sample *s, struct sp_state *sp_state)
 	// free output bus
 	free_bus(out_bus, sp_state);
 
-	// free sample
-	if (s->name) free(s->name);
-	if (s->data) free(s->data);
-	free(s);
+	// free sample once audio thread is done with it
+	m->dead_samples = realloc(m->dead_samples, sizeof(struct sample *) * ++(m->num_dead_samples));
+	m->dead_samples[m->num_dead_samples - 1] = s;
 }
 
 static void process_pad_press(struct sp_state *sp_state, struct key_input *input, int key, int pad)
@@ -409,13 +445,32 @@ static void process_pad_press(struct sp_state *sp_state, struct key_input *input
 						new_samp->name = malloc(strlen((*sampler->pad_src)->name) + 1);
 						strcpy(new_samp->name, (*sampler->pad_src)->name);
 
-						// copy data
-						int64_t data_size = sizeof(double) * new_samp->num_frames * NUM_CHANNELS;
-						new_samp->data = malloc(data_size);
-						memcpy(new_samp->data, (*sampler->pad_src)->data, data_size);
+						// copy data, streamed samples share their source
+						if (new_samp->stream) {
+							new_samp->stream = copy_sample_stream(new_samp->stream,
+									new_samp->start_frame, new_samp->end_frame);
+						} else {
+							int64_t data_size = sizeof(float) * (new_samp->num_frames + 1) * new_samp->channels;
+							new_samp->data = malloc(data_size);
+							memcpy(new_samp->data, (*sampler->pad_src)->data, data_size);
+							platform_prefault(new_samp->data, data_size);
+						}
+						if (!new_samp->data && !new_samp->stream) {
+							log_msg(LOG_ERROR, "Error copying sample");
+							free(new_samp->name);
+							free(new_samp);
+							sampler->move_mode = NONE;
+							sampler->pad_src = NULL;
+							break;
+						}
 
 						// copied should start not playing
-						if(new_samp->playing) kill_sample(new_samp);
+						new_samp->play = get_playback(new_samp);
+						new_samp->num_voices = 0;
+						new_samp->newest_voice = NULL;
+						new_samp->mix_seq = 0;
+						new_samp->next_frame = new_samp->speed < 0 ? 
+							new_samp->end_frame - 1 : new_samp->start_frame;
 
 						// create bus for new sample and copy some data from src_bus
 						struct bus *src_bus = (*sampler->pad_src)->output_bus;
@@ -423,6 +478,7 @@ static void process_pad_press(struct sp_state *sp_state, struct key_input *input
 						new_bus->pan = src_bus->pan;
 						new_bus->atten = src_bus->atten;
 						new_bus->type = SAMPLE;
+						send_bus_gain(new_bus, sp_state);
 
 						// attach new_bus and new_samp
 						attach_bus(new_bus, src_bus->output_bus, sp_state);
@@ -443,13 +499,15 @@ static void process_pad_press(struct sp_state *sp_state, struct key_input *input
 			case NONE:
 			default:
 				if (!alt && banks[curr_bank][pad]) 
-					trigger_sample(banks[curr_bank][pad]);
+					send_timed_sample_command(sp_state, CMD_TRIGGER_SAMPLE,
+							banks[curr_bank][pad], input->key_press_time[key]);
 		}
 
 		sampler->active_sample = banks[curr_bank][pad];
 		sampler->curr_pad = pad;
 	} else if (is_key_released(input, key)){
-		close_gate(banks[curr_bank][pad]);
+		send_timed_sample_command(sp_state, CMD_CLOSE_GATE,
+				banks[curr_bank][pad], input->key_release_time[key]);
 	}
 }
 
@@ -508,7 +566,7 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 	if (is_key_pressed(input, KEY_X)) {
 		for (int b = 0; b < sampler->num_banks; b++) {
 			for (int p = PAD_Q; p <= PAD_F; p++) {
-				if (sampler->banks[b][p]) kill_sample(sampler->banks[b][p]);
+				send_sample_command(sp_state, CMD_KILL_SAMPLE, sampler->banks[b][p]);
 			}
 		}
 	}
@@ -536,7 +594,7 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 
 	// kill active sample
 	if (is_key_pressed(input, KEY_Z)) {
-		kill_sample(s);
+		send_sample_command(sp_state, CMD_KILL_SAMPLE, s);
 	}
 
 	// playback speed / pitch
@@ -548,8 +606,9 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 
 		static const float MAX_SPEED = 4.1f;
 		if (speed > 0.01f && speed < MAX_SPEED) { 
-			const char sign = s->speed > 0.0f ? 1 : -1;
-			s->speed = sign * speed;
+			// audio thread keeps the current playback direction
+			struct command cmd = { .type = CMD_SET_SPEED, .sample = s, .speed = speed };
+			send_command(sp_state, &cmd);
 		}
 	}
 
@@ -566,7 +625,9 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 		else s->start_frame = f;
 
 		squeeze_envelope(s);
-		if (!s->playing) kill_sample(s);
+		update_stream_cache(sp_state, s);
+		send_playback(s, sp_state);
+		send_sample_command(sp_state, CMD_RESET_SAMPLE, s);
 		sampler->zoom_focus = START;
 	}
 
@@ -583,32 +644,36 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 		else s->end_frame = f;
 
 		squeeze_envelope(s);
-		if (!s->playing) kill_sample(s);
+		update_stream_cache(sp_state, s);
+		send_playback(s, sp_state);
+		send_sample_command(sp_state, CMD_RESET_SAMPLE, s);
 		sampler->zoom_focus = END;
 	}
 
 	// set envelope
 	if (is_key_down(input, KEY_J)) {
-		float ms = frames_to_ms(s->attack);
+		float ms = frames_to_ms(s->attack, sp_state->mixer.sample_rate);
 		if (alt) ms -= 2;
 		else ms += 2;
 
 		if (ms >= 0) { 
-			const int32_t frames = ms_to_frames(ms);
+			const int32_t frames = ms_to_frames(ms, sp_state->mixer.sample_rate);
 			if (s->end_frame - s->start_frame - s->release >= frames) {
 				s->attack = frames;
+				send_playback(s, sp_state);
 			}
 		}
 	}
 	if (is_key_down(input, KEY_K)) {
-		float ms = frames_to_ms(s->release);
+		float ms = frames_to_ms(s->release, sp_state->mixer.sample_rate);
 		if (alt) ms -= 2; 
 		else ms += 2;
 
 		if (ms >= 0) {
-			const int32_t frames = ms_to_frames(ms);
+			const int32_t frames = ms_to_frames(ms, sp_state->mixer.sample_rate);
 			if (s->end_frame - s->start_frame - s->attack >= frames) {
 				s->release = frames;
+				send_playback(s, sp_state);
 			}
 		}
 	}
@@ -616,93 +681,167 @@ static void update_sampler(struct sp_state *sp_state, struct key_input *input)
 	// set playback modes
 	if (is_key_pressed(input, KEY_G)) {
 		s->gate = !s->gate;
+		send_playback(s, sp_state);
 	}
 	if (is_key_pressed(input, KEY_V)) {
 		s->reverse = !s->reverse;
-		s->speed *= -1.0;
+		send_sample_command(sp_state, CMD_REVERSE, s);
 	}
 	if (is_key_pressed(input, KEY_L)) {
 		if (s->loop_mode == PING_PONG) s->loop_mode = LOOP_OFF;
 		else s->loop_mode += 1;
+		send_playback(s, sp_state);
+	}
+
+	// voices
+	if (is_key_pressed(input, KEY_P)) {
+		if (alt && s->polyphony > 1) s->polyphony -= 1;
+		else if (!alt && s->polyphony < MAX_POLYPHONY) s->polyphony += 1;
+		send_playback(s, sp_state);
+	}
+	if (is_key_pressed(input, KEY_Y)) {
+		if (s->steal_mode == STEAL_QUIETEST) s->steal_mode = STEAL_OLDEST;
+		else s->steal_mode = STEAL_QUIETEST;
+		send_playback(s, sp_state);
 	}
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
 /// File Browser Update
 
-// change sample's sample rate from rate_in to rate_out
-static int resample(struct sample* s, int rate_in, int rate_out)
+// designing a filter takes far longer than resampling a short sample,
+// so each loading thread keeps its last design for the next file
+static _Thread_local struct PFilter *resample_filter;
+static _Thread_local int resample_filter_in, resample_filter_out;
+
+// smarc filter converting rate_in to rate_out, owned by the calling thread
+// returns NULL on failure
+static struct PFilter *get_resample_filter(int rate_in, int rate_out)
 {
+	if (resample_filter && resample_filter_in == rate_in && resample_filter_out == rate_out)
+		return resample_filter;
+	if (resample_filter) smarc_destroy_pfilter(resample_filter);
+
 	double bandwidth = 0.95;  // bandwidth
 	double rp = 0.1; // passband ripple factor
 	double rs = 140; // stopband attenuation
 	double tol = 0.000001; // tolerance
 
-	// initialize smarc filter
-	struct PFilter* pfilt = smarc_init_pfilter(rate_in, rate_out, 
-			bandwidth, rp, rs, tol, NULL, 0);
+	resample_filter = smarc_init_pfilter(rate_in, rate_out, bandwidth, rp, rs, tol, NULL, 0);
+	resample_filter_in = rate_in;
+	resample_filter_out = rate_out;
+	return resample_filter;
+}
+
+#define RESAMPLE_CHUNK_FRAMES 65536	// frames resampled between progress reports
+
+// change sample's sample rate from rate_in to rate_out
+static int resample(struct sample* s, int rate_in, int rate_out)
+{
+	struct PFilter* pfilt = get_resample_filter(rate_in, rate_out);
 	if (!pfilt)
 		return -1;
 
-	struct PState* pstate[NUM_CHANNELS];
-	pstate[0] = smarc_init_pstate(pfilt);
-	pstate[1] = smarc_init_pstate(pfilt);
-
+	const int ch = s->channels;
 	const int OUT_SIZE = 
 		(int) smarc_get_output_buffer_size(pfilt, s->num_frames);
 	double* outbuf = malloc(OUT_SIZE * sizeof(double));
-	double* left_inbuf = malloc(s->num_frames * sizeof(double));
-	double* right_inbuf = malloc(s->num_frames * sizeof(double));
+	double* inbuf = malloc(s->num_frames * sizeof(double));
 
-	if (!outbuf || !left_inbuf || !right_inbuf) {
-		fprintf(stderr, "Error allocating memory for resampling\n");
+	if (!outbuf || !inbuf) {
+		log_msg(LOG_ERROR, "Error allocating memory for resampling");
 		exit(1);
 	}
 
-	// extract left and right channels
-	for (int i = 0; i < s->num_frames; i++) {
-		left_inbuf[i] = s->data[i * NUM_CHANNELS];
-		right_inbuf[i] = s->data[i * NUM_CHANNELS + 1];
-	}
-	s->data = realloc(s->data, sizeof(double) * OUT_SIZE * NUM_CHANNELS);
-	if (!s->data)
+	float *data = malloc(sizeof(float) * (OUT_SIZE + 1) * ch);
+	if (!data) {
+		free(inbuf);
+		free(outbuf);
 		return -1;
+	}
+
+	// resample each channel, smarc filters in double precision
+	int w = 0;
+	for (int c = 0; c < ch; c++) {
+		for (int i = 0; i < s->num_frames; i++)
+			inbuf[i] = s->data[i * ch + c];
+
+		// in chunks to report progress, filter state carries across them
+		struct PState* pstate = smarc_init_pstate(pfilt);
+		w = 0;
+		for (int f = 0; f < s->num_frames; f += RESAMPLE_CHUNK_FRAMES) {
+			const int n = s->num_frames - f < RESAMPLE_CHUNK_FRAMES ?
+				s->num_frames - f : RESAMPLE_CHUNK_FRAMES;
+			w += smarc_resample(pfilt, pstate, inbuf + f, n, outbuf + w, OUT_SIZE - w);
+			report_load_progress((int64_t) c * s->num_frames + f + n,
+					(int64_t) ch * s->num_frames);
+		}
+		smarc_destroy_pstate(pstate);
+
+		for (int i = 0; i < w; i++)
+			data[i * ch + c] = outbuf[i];
+	}
+	// silent guard frame
+	for (int c = 0; c < ch; c++)
+		data[w * ch + c] = 0.0f;
 
-	// resample left channel
-	int w = smarc_resample( pfilt, pstate[0], left_inbuf, 
-			s->num_frames, outbuf, OUT_SIZE);
-	for (int i = 0; i < w; i++)
-		s->data[i * NUM_CHANNELS] = outbuf[i];
-
-	// resample right channel
-	w = smarc_resample( pfilt, pstate[1], right_inbuf, 
-			s->num_frames, outbuf, OUT_SIZE);
-	for (int i = 0; i < w; i++)
-		s->data[i * NUM_CHANNELS + 1] = outbuf[i];
-
-	smarc_destroy_pstate(pstate[0]);
-	smarc_destroy_pstate(pstate[1]);
-	free(left_inbuf);
-	free(right_inbuf);
+	free(s->data);
+	s->data = data;
+	free(inbuf);
 	free(outbuf);
 	return w;
 }
 
-// used for debugging
-// TODO: delete and replace with logging
-static void print_sample(const struct sample* s)
+// resamples src from rate_in to rate_out into a temp file of float frames
+// works a chunk at a time so memory use does not grow with the length
+// returns 0 on success and -1 on failure
+static int resample_stream_source(struct stream_source *dest, struct stream_source *src,
+		int rate_in, int rate_out)
 {
-	printf(
-			"***********************\n"
-			"Sample Info:\n"
-			"-----------------------\n"
-			"Frame size: %dB\n"
-			"Sample Rate: %dHz\n"
-			"Num Frames: %d\n"
-			"***********************\n",
-			s->frame_size,
-			s->rate,
-			s->num_frames);
+	struct PFilter *pfilt = get_resample_filter(rate_in, rate_out);
+	if (!pfilt) return -1;
+
+	const int ch = src->channels;
+	const int OUT_SIZE = smarc_get_output_buffer_size(pfilt, STREAM_CHUNK_FRAMES);
+	float *in = malloc(sizeof(float) * STREAM_CHUNK_FRAMES * ch);
+	double *inbuf = malloc(sizeof(double) * STREAM_CHUNK_FRAMES);
+	double *outbuf = malloc(sizeof(double) * OUT_SIZE);
+	float *out = malloc(sizeof(float) * OUT_SIZE * ch);
+	struct PState *pstate[NUM_CHANNELS] = { NULL };
+	for (int c = 0; c < ch; c++) pstate[c] = smarc_init_pstate(pfilt);
+
+	int err = !in || !inbuf || !outbuf || !out || !pstate[0] || !pstate[ch - 1];
+	long offset = 0;
+	for (int32_t f = 0; !err && f < src->num_frames; f += STREAM_CHUNK_FRAMES) {
+		const int n = src->num_frames - f < STREAM_CHUNK_FRAMES ?
+			src->num_frames - f : STREAM_CHUNK_FRAMES;
+		read_stream_frames(src, in, f, n);
+
+		// each channel keeps its own filter state across chunks
+		int w = 0;
+		for (int c = 0; c < ch; c++) {
+			for (int i = 0; i < n; i++)
+				inbuf[i] = in[i * ch + c];
+			w = smarc_resample(pfilt, pstate[c], inbuf, n, outbuf, OUT_SIZE);
+			for (int i = 0; i < w; i++)
+				out[i * ch + c] = outbuf[i];
+		}
+
+		const long bytes = sizeof(float) * w * ch;
+		if (platform_write_file_at(dest->file, out, bytes, offset) != bytes) err = 1;
+		offset += bytes;
+		report_load_progress(f + n, src->num_frames);
+	}
+	dest->num_frames = offset / (sizeof(float) * ch);
+
+	for (int c = 0; c < ch; c++) {
+		if (pstate[c]) smarc_destroy_pstate(pstate[c]);
+	}
+	if (in) free(in);
+	if (inbuf) free(inbuf);
+	if (outbuf) free(outbuf);
+	if (out) free(out);
+	return err ? -1 : 0;
 }
 
 // check endianess of system at runtime
@@ -714,128 +853,74 @@ static inline bool is_little_endian(void)
 	return false;
 }
 
-static inline void invalid_wav_file(void *buffer, struct sample *s, const char *path) 
-{
-	fprintf(stderr, "Unsupported file: %s\n", path);
-	platform_free_file_buffer(&buffer);
-	free(s);
-}
-
-// loads sample from a buffer in wav format
+// layout of a wav file, see parse_wav_header
+struct wav_info {
+	int channels;
+	int rate;
+	int frame_size;
+	int bit_depth;
+	int32_t num_frames;
+	long data_offset;	// byte offset of the first frame
+};
+
+// parses the headers of a wav file up to the start of its data chunk
+// buffer holds the whole file
 // currently supports only non compressed WAV files
-// sample should be initialized before being passed to load_wav()
-// returns 0 iff success
-static struct sample *load_sample_from_wav(const char *path)
+// returns 0 on success and -1 if the file is not supported
+static int parse_wav_header(const char *buffer, long bytes, struct wav_info *info, const char *path)
 {
-	// TODO support big_endian systems as well
-	if (!is_little_endian) {
-		fprintf(stderr, "Only little-endian systems are supported\n");
-		return NULL;
-	}
-
-	// load file
-	void *file_buffer = NULL;
-	long buf_bytes = platform_load_entire_file(&file_buffer, path);
-	if (!buf_bytes) {
-		fprintf(stderr, "Failed to open: %s\n", path);
-		return NULL;
-	}
-	char *buffer = (char *) file_buffer;
-
-
-	// init sample
-	struct sample *new_samp = calloc(1, sizeof(struct sample));
-	if (!new_samp) {
-		fprintf(stderr, "Error allocating sample");
-		platform_free_file_buffer(file_buffer);
-	}
-
-	new_samp->speed = 1.0;	
-
-	// extract file name
-	int name_start = 0;
-	for (int i = 0; i < (int) strlen(path) - 1; i++)
-	{
-		// TODO this might not work for windows be careful when porting
-		if (path[i] == '/') name_start = i + 1;
-	}
-
-	new_samp->name = malloc(strlen(path) - name_start + 1);
-	if (new_samp->name) strcpy(new_samp->name, path + name_start);
-
-
 	// any read should not read the end_ptr or anything past it
 	// data is stored in 4 byte words
-	const char *end_ptr = buffer + buf_bytes;
+	const char *start = buffer;
+	const char *end_ptr = buffer + bytes;
 	const int word = 4;
 
 	/* parse headers */
 	// check for 'RIFF' tag bytes [0, 3]
-	if (*(int32_t *) buffer ^ 0x46464952) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
+	// the fixed part of the headers ends at byte 40
+	if (bytes < 10 * word || *(int32_t *) buffer ^ 0x46464952) goto invalid;
 
 	// get master chunk_size 
 	buffer += word;
 	const int64_t mstr_ck_size = *(int32_t *) buffer;
-	// verify we won't access data outside buffer
+	// verify we won't access data outside the file
 	// TODO more bounds checking should be added in case wav file is not properly formatted
-	if (buffer + word + mstr_ck_size > end_ptr) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
-
+	if (2 * word + mstr_ck_size > bytes) goto invalid;
 
 	// check for 'WAVE' tag
 	// TODO spec does not require wave tag here
 	buffer += word;
-	if (*(int32_t *) buffer ^ 0x45564157) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
-
+	if (*(int32_t *) buffer ^ 0x45564157) goto invalid;
 
 	// check for 'fmt ' tag
 	buffer += word;
-	if (*(int32_t *) buffer ^ 0x20746D66) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
-
+	if (*(int32_t *) buffer ^ 0x20746D66) goto invalid;
 
 	// support only non-extended PCM for now
 	buffer += word;
 	const int32_t fmt_ck_size = *buffer;
-	if (fmt_ck_size != 16) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
-
+	if (fmt_ck_size != 16) goto invalid;
 
 	/* parse 'fmt ' chunk */
 	// check PCM format and number of channels
 	buffer += word;
-	if ((*(int32_t *) buffer & 0xFFFF) != 1) {
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
-	}
+	if ((*(int32_t *) buffer & 0xFFFF) != 1) goto invalid;
 
-	const int num_channels = *(int32_t *) buffer >> 16;
-	if (num_channels != 1 && num_channels != 2) {
-		fprintf(stderr, "%d channel(s) not supported\n", num_channels);
-		invalid_wav_file(file_buffer, new_samp, path);
-		return NULL;
+	info->channels = *(int32_t *) buffer >> 16;
+	if (info->channels != 1 && info->channels != 2) {
+		log_msg(LOG_ERROR, "%d channel(s) not supported", info->channels);
+		goto invalid;
 	}
 
 	buffer += word;
-	const int sample_rate = *(int32_t *) buffer;
+	info->rate = *(int32_t *) buffer;
 
 	buffer += 2 * word;
-	const int frame_size = *(int32_t *) buffer & 0xFFFF;
-	const int bit_depth = *(int32_t *) buffer >> 16;
-	if (bit_depth != 16)
-		fprintf(stderr, "Warning bitdepth is %d\n", bit_depth);
+	info->frame_size = *(int32_t *) buffer & 0xFFFF;
+	info->bit_depth = *(int32_t *) buffer >> 16;
+	if (!info->frame_size || info->rate <= 0) goto invalid;
+	if (info->bit_depth != 16)
+		log_msg(LOG_WARN, "%s: bitdepth is %d", path, info->bit_depth);
 
 	// TODO if extended format (fmt_ck_size > 16) then more data needs to be read
 
@@ -846,87 +931,270 @@ static struct sample *load_sample_from_wav(const char *path)
 		// find current chunk size and seek to next chunk
 		// bounds checking is performed in case 'data' chunk is never found
 		buffer += word;
-		if (buffer + word > end_ptr) {
-			invalid_wav_file(file_buffer, new_samp, path);
-			return NULL;
-		}
+		if (buffer + word > end_ptr) goto invalid;
 
 		const int s = *(int32_t *) buffer;
 		buffer += word + s;
-		if (buffer + word > end_ptr) {
-			invalid_wav_file(file_buffer, new_samp, path);
-			return NULL;
-		}
-
+		if (buffer + word > end_ptr) goto invalid;
 	}
 
 	buffer += word;
+	if (buffer + word > end_ptr) goto invalid;
 	const int32_t data_size = *(int32_t *) buffer;
-	const int32_t num_frames = data_size / frame_size;
+	info->num_frames = data_size / info->frame_size;
+	info->data_offset = buffer + word - start;
+
+	// frames are read from the mapping, a truncated file plays what it has
+	if ((int64_t) info->num_frames * info->frame_size > bytes - info->data_offset)
+		info->num_frames = (bytes - info->data_offset) / info->frame_size;
+	return 0;
+
+invalid:
+	log_msg(LOG_ERROR, "Unsupported file: %s", path);
+	return -1;
+}
+
+// allocates a sample named after the file at path with default settings
+// returns NULL on failure
+static struct sample *init_sample(const char *path)
+{
+	struct sample *new_samp = calloc(1, sizeof(struct sample));
+	if (!new_samp) {
+		log_msg(LOG_ERROR, "Error allocating sample");
+		return NULL;
+	}
+
+	new_samp->speed = 1.0;	
+	new_samp->polyphony = DEFAULT_POLYPHONY;
+
+	// extract file name
+	int name_start = 0;
+	for (int i = 0; i < (int) strlen(path) - 1; i++)
+	{
+		// TODO this might not work for windows be careful when porting
+		if (path[i] == '/') name_start = i + 1;
+	}
+
+	new_samp->name = malloc(strlen(path) - name_start + 1);
+	if (new_samp->name) strcpy(new_samp->name, path + name_start);
+	return new_samp;
+}
+
+// loads the frames of a wav file mapped at map into a new sample
+// converted to float at engine_rate
+// returns NULL on failure
+static struct sample *load_wav_frames(const char *map, const struct wav_info *info,
+		const char *path, int engine_rate)
+{
+	struct sample *new_samp = init_sample(path);
+	if (!new_samp) return NULL;
 
 	/* register sample info and pcm data */
 	// register some fields
-	new_samp->frame_size = frame_size;
+	const int32_t num_frames = info->num_frames;
+	const int num_channels = info->channels;
+	new_samp->frame_size = info->frame_size;
 	new_samp->num_frames = num_frames;
 	new_samp->end_frame = num_frames;
-	new_samp->rate = sample_rate;
+	new_samp->rate = info->rate;
+	new_samp->channels = num_channels;
 
 	// allocate sample memory
-	new_samp->data = malloc(num_frames * NUM_CHANNELS * sizeof(double));
+	// +1 for silent guard frame read when interpolating the last frame
+	new_samp->data = malloc((num_frames + 1) * num_channels * sizeof(float));
 	if (!new_samp->data) {
-		fprintf(stderr, "Sample memory allocation error\n");
-		platform_free_file_buffer(&file_buffer);
-		free(new_samp);
+		log_msg(LOG_ERROR, "Sample memory allocation error");
+		destroy_sample(new_samp);
 		return NULL;
 	}
 
-	// convert samples from int to double and mono to stereo if necassary
-	// then store data in s->data
-	buffer += word;
-	for (int i = 0; i < num_frames; i++) {
-		double l;
-		double r;
-		// left = right if data is mono
-		if (num_channels == 1)
-		{
-			l = ((double) ((int16_t *) buffer)[i]) / 32768.0;
-			r = l;
-		} else {
-			l = ((double) ((int16_t *) buffer)[NUM_CHANNELS * i]) / 32768.0;
-
-			r = ((double) ((int16_t *) buffer)[NUM_CHANNELS * i + 1]) / 32768.0;
-		}
+	// convert samples from int to float straight from the mapping,
+	// mono data stays mono
+	const int16_t *pcm = (const int16_t *) (map + info->data_offset);
+	const int num_samples = num_frames * num_channels;
+	for (int i = 0; i < num_samples; i++) {
+		float x = ((float) pcm[i]) / 32768.0f;
 		// bounds checking
-		if (l > 1.0) l = 1.0;
-		else if (l < -1.0) l = -1.0;
-		if (r > 1.0) r = 1.0;
-		else if (r < -1.0) r = -1.0;
+		if (x > 1.0f) x = 1.0f;
+		else if (x < -1.0f) x = -1.0f;
 
-		new_samp->data[NUM_CHANNELS * i] = l;
-		new_samp->data[NUM_CHANNELS * i + 1] = r;
+		new_samp->data[i] = x;
 	}
-
-	// resample to SAMPLE_RATE constant if necessary
-	if (new_samp->rate != SAMPLE_RATE) {
-		const int r = resample(new_samp, new_samp->rate, SAMPLE_RATE);
+	for (int c = 0; c < num_channels; c++)
+		new_samp->data[num_samples + c] = 0.0f;
+
+	// resample to engine rate if necessary
+	if (new_samp->rate != engine_rate) {
+		TRACE_BEGIN("resample");
+		const int r = resample(new_samp, new_samp->rate, engine_rate);
+		TRACE_END("resample");
 		if (r == -1) {
-			fprintf(stderr, "Resampling Error\n");
-			platform_free_file_buffer(&file_buffer);
-			free(new_samp);
-			free(new_samp->data);
+			log_msg(LOG_ERROR, "Resampling Error");
+			destroy_sample(new_samp);
 			return NULL;
 		}
 		new_samp->num_frames = r;
 		new_samp->end_frame = r;
-		new_samp->rate = SAMPLE_RATE;
+		new_samp->rate = engine_rate;
+	}
+
+	// audio thread reads data from the first trigger on
+	platform_prefault(new_samp->data,
+			sizeof(float) * (new_samp->num_frames + 1) * new_samp->channels);
+
+	log_msg(LOG_DEBUG, "Loaded %s: %dB frames, %d channel(s), %dHz, %d frames",
+			path, new_samp->frame_size, new_samp->channels, new_samp->rate,
+			new_samp->num_frames);
+	return new_samp;
+}
+
+// loads sample from a wav file
+// currently supports only non compressed WAV files
+// returns NULL on failure
+static struct sample *load_sample_from_wav(const char *path, int engine_rate)
+{
+	// TODO support big_endian systems as well
+	if (!is_little_endian) {
+		log_msg(LOG_ERROR, "Only little-endian systems are supported");
+		return NULL;
 	}
 
-	// clean up
-	platform_free_file_buffer(&file_buffer);
-	print_sample(new_samp);
+	long bytes = 0;
+	const char *map = platform_map_file(path, &bytes);
+	if (!map) {
+		log_msg(LOG_ERROR, "Failed to open: %s", path);
+		return NULL;
+	}
+
+	struct wav_info info;
+	struct sample *new_samp = NULL;
+	if (!parse_wav_header(map, bytes, &info, path))
+		new_samp = load_wav_frames(map, &info, path, engine_rate);
+
+	platform_unmap_file(map, bytes);
 	return new_samp;
 }
 
+// source of the wav data at info in the mapped file map, at the engine rate
+// wavs at another rate are resampled into a temp file first
+// takes ownership of map, it is unmapped on failure
+// returns NULL on failure
+static struct stream_source *open_stream_source(struct stream_pool *pool, const char *map,
+		long bytes, const struct wav_info *info, int engine_rate)
+{
+	struct stream_source *src = calloc(1, sizeof(*src));
+	if (!src) {
+		platform_unmap_file(map, bytes);
+		return NULL;
+	}
+	src->map = map;
+	src->map_bytes = bytes;
+	src->offset = info->data_offset;
+	src->channels = info->channels;
+	src->num_frames = info->num_frames;
+	src->pool = pool;
+	if (info->rate == engine_rate) return src;
+
+	struct stream_source *resampled = calloc(1, sizeof(*resampled));
+	if (resampled) {
+		resampled->file = platform_create_temp_file();
+		resampled->is_float = true;
+		resampled->channels = info->channels;
+		resampled->pool = pool;
+	}
+
+	TRACE_BEGIN("resample");
+	const int err = !resampled || !resampled->file
+		|| resample_stream_source(resampled, src, info->rate, engine_rate);
+	TRACE_END("resample");
+	close_stream_source(src);
+	if (err) {
+		log_msg(LOG_ERROR, "Resampling Error");
+		if (resampled) close_stream_source(resampled);
+		return NULL;
+	}
+	return resampled;
+}
+
+// loads the wav at info in the mapped file map as a sample streamed from disk
+// by streams
+// takes ownership of map
+// returns NULL on failure
+static struct sample *load_streamed_sample(const char *map, long bytes, const struct wav_info *info,
+		const char *path, struct stream_pool *streams, int engine_rate)
+{
+	struct stream_source *src = open_stream_source(streams, map, bytes, info, engine_rate);
+	if (!src) return NULL;
+
+	struct sample *new_samp = init_sample(path);
+	if (new_samp) {
+		new_samp->frame_size = info->frame_size;
+		new_samp->channels = info->channels;
+		new_samp->rate = engine_rate;
+		new_samp->num_frames = src->num_frames;
+		new_samp->end_frame = src->num_frames;
+		new_samp->stream = init_sample_stream(src, 0, src->num_frames);
+	}
+	if (!new_samp || !new_samp->stream) {
+		log_msg(LOG_ERROR, "Error allocating sample");
+		if (new_samp) destroy_sample(new_samp);
+		// no ring has seen the source yet
+		close_stream_source(src);
+		return NULL;
+	}
+
+	log_msg(LOG_DEBUG, "Streaming %s: %dB frames, %d channel(s), %dHz, %d frames",
+			path, new_samp->frame_size, new_samp->channels, new_samp->rate,
+			new_samp->num_frames);
+	return new_samp;
+}
+
+// loads wav at path, streaming it from disk by streams if it is longer than
+// stream_threshold frames at engine_rate, 0 turns streaming off
+// only reads its arguments so it can run on any thread
+// returns NULL on failure
+static struct sample *load_sample(const char *path, int engine_rate,
+		int32_t stream_threshold, struct stream_pool *streams)
+{
+	if (!stream_threshold) return load_sample_from_wav(path, engine_rate);
+
+	long bytes = 0;
+	const char *map = platform_map_file(path, &bytes);
+	if (!map) {
+		log_msg(LOG_ERROR, "Failed to open: %s", path);
+		return NULL;
+	}
+
+	struct wav_info info;
+	if (parse_wav_header(map, bytes, &info, path)) {
+		platform_unmap_file(map, bytes);
+		return NULL;
+	}
+
+	// frames once resampled to the engine rate
+	const int64_t frames = (int64_t) info.num_frames * engine_rate / info.rate;
+	if (frames > stream_threshold) {
+		if (streams) return load_streamed_sample(map, bytes, &info, path, streams, engine_rate);
+		log_msg(LOG_WARN, "stream: no prefetch thread, loading %s into memory", path);
+	}
+
+	struct sample *new_samp = load_wav_frames(map, &info, path, engine_rate);
+	platform_unmap_file(map, bytes);
+	return new_samp;
+}
+
+// stream pool of m, started on first use if streaming is on
+// returns NULL if streaming is off or the prefetch thread could not be started
+static struct stream_pool *get_stream_pool(struct mixer *m)
+{
+	if (!m->stream_threshold || m->streams) return m->streams;
+
+	m->streams = start_stream_pool();
+	// visible to the audio thread with the plan that adds the first streamed sample
+	m->voices.streams = m->streams;
+	return m->streams;
+}
+
 static int load_directory_to_browser(struct file_browser *fb, const char *dir)
 {
 	if (fb->dir) free(fb->dir);
@@ -934,7 +1202,7 @@ static int load_directory_to_browser(struct file_browser *fb, const char *dir)
 	// TODO See about removing the need for this check eventually
 	fb->dir = platform_get_realpath(dir);
 	if (!fb->dir) {
-		fprintf(stderr, "Error allocating file browser memory\n");
+		log_msg(LOG_ERROR, "Error allocating file browser memory");
 		return -1;
 	}
 
@@ -944,7 +1212,7 @@ static int load_directory_to_browser(struct file_browser *fb, const char *dir)
 		fb->num_files = platform_num_valid_items_in_dir(dir_handle);
 		fb->files = realloc(fb->files, sizeof(struct file_item) * fb->num_files);
 		if (fb->num_files && !fb->files) {
-			fprintf(stderr, "Error allocating file browser memory\n");
+			log_msg(LOG_ERROR, "Error allocating file browser memory");
 			fb->num_files = 0;
 			free(fb->dir);
 			return -1;
@@ -956,63 +1224,384 @@ static int load_directory_to_browser(struct file_browser *fb, const char *dir)
 		}
 
 		if (platform_closedir(dir_handle)) {
-			fprintf(stderr, "Error closing directory\n");
+			log_msg(LOG_ERROR, "Error closing directory");
 		}
 	} else {
-		fprintf(stderr, "Error opening directory: %s", fb->dir);
+		log_msg(LOG_ERROR, "Error opening directory: %s", fb->dir);
 		return -1;
 	}
 }
 
-static void load_sample_from_browser(struct sp_state *sp_state, int pad)
+// marks loads queued for pad of bank as superseded so a sample placed there
+// now is not replaced when they finish
+static void supersede_loads(struct loader *l, int bank, int pad)
+{
+	for (int i = 0; l->num_jobs && i < MAX_LOAD_JOBS; i++) {
+		struct load_job *job = l->jobs + i;
+		if (job->path && job->bank == bank && job->pad == pad) job->superseded = true;
+	}
+}
+
+// places new_samp on pad of bank and gives it a bus on master
+// a sample already on the pad is unloaded
+// returns 0 on success and -1 on failure, new_samp is freed on failure
+static int place_sample_on_pad(struct sp_state *sp_state, struct sample *new_samp, int bank, int pad)
 {
-	struct file_browser *fb = &sp_state->file_browser;
 	struct sampler *sampler = &(sp_state->sampler);
+	struct sample **dest_pad = sampler->banks[bank] + pad;
 
-	const char *file = fb->files[fb->selected_file].name;
-	const char *dir = fb->dir;
+	// if target pad is occupied delete that sample
+	if (*dest_pad) unload_sample(*dest_pad, sp_state);
 
+	// create new bus and attach to master
+	struct bus *new_bus = init_bus(sp_state);
+	if (!new_bus) {
+		log_msg(LOG_ERROR, "Error initializing bus");
+		destroy_sample(new_samp);
+		return -1;
+	}
+	new_bus->label = malloc(strlen(new_samp->name) + 1);
+	strcpy(new_bus->label, new_samp->name);
+	new_bus->type = SAMPLE;
+	attach_bus(new_bus, &sp_state->mixer.master, sp_state);
+
+	// assign new sample to pad and attach to bus
+	new_samp->play = get_playback(new_samp);
+	*dest_pad = new_samp;
+	attach_sample_to_bus(*dest_pad, new_bus, sp_state);
+
+	// set current sampler paramaters
+	if (bank == sampler->curr_bank) {
+		sampler->active_sample = new_samp;
+		sampler->curr_pad = pad;
+	}
+	return 0;
+}
+
+// loads wav at path onto pad of the current bank and gives it a bus on master
+// returns 0 on success and -1 on failure
+static int load_sample_to_pad(struct sp_state *sp_state, const char *path, int pad)
+{
+	struct mixer *m = &sp_state->mixer;
+
+	TRACE_BEGIN("load_sample");
+	struct sample *new_samp = load_sample(path, m->sample_rate, m->stream_threshold,
+			get_stream_pool(m));
+	TRACE_END("load_sample");
+	if (!new_samp) return -1;
+
+	const int bank = sp_state->sampler.curr_bank;
+	supersede_loads(&sp_state->loader, bank, pad);
+	return place_sample_on_pad(sp_state, new_samp, bank, pad);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Background Loading
+///
+/// Loads from the file browser run on a pool of worker threads so the ui
+/// keeps drawing while files are read and resampled. Jobs live in a fixed
+/// array. The ui thread fills a free job, marks it queued and posts a
+/// semaphore. A worker claims a queued job with a compare and swap, loads
+/// the sample and marks the job done. Once a frame the ui thread places
+/// finished samples on their pads, so the sampler and mixer stay ui thread
+/// only and the audio thread sees new samples with the next mix plan.
+
+static void *run_load_worker(void *arg)
+{
+	struct loader *l = arg;
+	trace_register_thread("loader");
+
+	for (;;) {
+		platform_semaphore_wait(l->pending);
+		if (atomic_load_explicit(&l->stop, memory_order_acquire)) break;
+
+		// each post follows one queued job, so a job is left to claim
+		struct load_job *job = NULL;
+		for (int i = 0; !job && i < MAX_LOAD_JOBS; i++) {
+			int queued = LOAD_QUEUED;
+			if (atomic_compare_exchange_strong_explicit(&l->jobs[i].state, &queued,
+						LOAD_RUNNING, memory_order_acquire, memory_order_relaxed))
+				job = l->jobs + i;
+		}
+		if (!job) continue;
+
+		load_progress = &job->progress;
+		TRACE_BEGIN("load_sample");
+		job->sample = load_sample(job->path, job->engine_rate,
+				job->stream_threshold, job->streams);
+		TRACE_END("load_sample");
+		load_progress = NULL;
+
+		atomic_store_explicit(&job->state, LOAD_DONE, memory_order_release);
+	}
+	return NULL;
+}
+
+// starts one worker per cpu if not started yet
+// returns 0 if at least one worker runs and -1 on failure
+static int start_loader(struct loader *l)
+{
+	if (l->num_workers) return 0;
+	if (!l->pending) l->pending = platform_init_semaphore();
+	if (!l->pending) return -1;
+
+	const int n = platform_get_cpu_count();
+	if (!l->workers) l->workers = calloc(n, sizeof(*l->workers));
+	if (!l->workers) return -1;
+	for (int i = 0; i < n; i++) {
+		l->workers[l->num_workers] = platform_create_thread(run_load_worker, l);
+		if (!l->workers[l->num_workers]) break;
+		l->num_workers++;
+	}
+	return l->num_workers ? 0 : -1;
+}
+
+// makes the workers exit once their current load is done and waits for them
+// loads not started yet are dropped
+static void stop_loader(struct loader *l)
+{
+	atomic_store_explicit(&l->stop, 1, memory_order_release);
+	for (int i = 0; i < l->num_workers; i++)
+		platform_semaphore_post(l->pending);
+	for (int i = 0; i < l->num_workers; i++)
+		platform_join_thread(l->workers[i]);
+	l->num_workers = 0;
+	free(l->workers);
+	l->workers = NULL;
+
+	for (int i = 0; l->num_jobs && i < MAX_LOAD_JOBS; i++) {
+		struct load_job *job = l->jobs + i;
+		if (atomic_load_explicit(&job->state, memory_order_relaxed) == LOAD_FREE) continue;
+		if (job->sample) destroy_sample(job->sample);
+		free(job->path);
+		job->path = NULL;
+		job->sample = NULL;
+		atomic_store_explicit(&job->state, LOAD_FREE, memory_order_relaxed);
+		l->num_jobs--;
+	}
+}
+
+// queues a load of the wav at path onto pad of bank as part of batch,
+// 0 for a single load
+// takes ownership of path on success
+// returns 0 on success and -1 if the load could not be queued
+static int queue_sample_load(struct sp_state *sp_state, char *path, int bank, int pad, int batch)
+{
+	struct loader *l = &sp_state->loader;
+	if (atomic_load_explicit(&l->stop, memory_order_relaxed) || start_loader(l)) return -1;
+
+	// only the ui thread frees jobs
+	struct load_job *job = NULL;
+	for (int i = 0; !job && i < MAX_LOAD_JOBS; i++) {
+		if (atomic_load_explicit(&l->jobs[i].state, memory_order_relaxed) == LOAD_FREE)
+			job = l->jobs + i;
+	}
+	if (!job) {
+		log_msg(LOG_WARN, "load: %d loads are already queued", MAX_LOAD_JOBS);
+		return -1;
+	}
+
+	// the newest load to a pad wins
+	supersede_loads(l, bank, pad);
+
+	struct mixer *m = &sp_state->mixer;
+	job->path = path;
+	job->bank = bank;
+	job->pad = pad;
+	job->batch = batch;
+	job->superseded = false;
+	job->engine_rate = m->sample_rate;
+	job->stream_threshold = m->stream_threshold;
+	job->streams = get_stream_pool(m);
+	job->sample = NULL;
+	atomic_store_explicit(&job->progress, 0, memory_order_relaxed);
+
+	atomic_store_explicit(&job->state, LOAD_QUEUED, memory_order_release);
+	platform_semaphore_post(l->pending);
+	l->num_jobs++;
+	return 0;
+}
+
+// true if no job of batch is still queued or running
+static bool is_batch_done(const struct loader *l, int batch)
+{
+	for (int i = 0; i < MAX_LOAD_JOBS; i++) {
+		const struct load_job *job = l->jobs + i;
+		if (job->path && job->batch == batch
+				&& atomic_load_explicit(&job->state, memory_order_relaxed) != LOAD_DONE)
+			return false;
+	}
+	return true;
+}
+
+// places samples of finished loads on their pads and frees their jobs
+// samples of a folder load are placed together once all of them are loaded,
+// so the folder reaches the audio thread with a single mix plan
+// called once a frame before the mix plan is published
+static void finish_sample_loads(struct sp_state *sp_state)
+{
+	struct loader *l = &sp_state->loader;
+	int loaded = 0;
+	for (int i = 0; l->num_jobs && i < MAX_LOAD_JOBS; i++) {
+		struct load_job *job = l->jobs + i;
+		if (atomic_load_explicit(&job->state, memory_order_acquire) != LOAD_DONE) continue;
+		if (job->batch && !is_batch_done(l, job->batch)) continue;
+
+		// failed loads were logged by the worker
+		if (job->sample && job->superseded) {
+			destroy_sample(job->sample);
+		} else if (job->sample) {
+			if (!place_sample_on_pad(sp_state, job->sample, job->bank, job->pad)) loaded++;
+		}
+
+		free(job->path);
+		job->path = NULL;
+		job->sample = NULL;
+		atomic_store_explicit(&job->state, LOAD_FREE, memory_order_relaxed);
+		l->num_jobs--;
+	}
+
+	if (loaded == 1) {
+		shell_print("File loaded!", sp_state);
+	} else if (loaded > 1) {
+		char txt[64];
+		snprintf(txt, sizeof(txt), "Loaded %d files", loaded);
+		shell_print(txt, sp_state);
+	}
+}
+
+// returns dir and file joined by '/' in a new buffer or NULL on failure
+static char *join_path(const char *dir, const char *file)
+{
 	// +2 to add '/' charactor and null temination character
 	char *path = malloc(sizeof(char) * (strlen(file) + strlen(dir) + 2));
-	if (!path) {
-		fprintf(stderr, "Error loading file\n");
-		return;
-	}
+	if (!path) return NULL;
 	strcpy(path, dir);
 	strcat(path, "/");
 	strcat(path, file);
+	return path;
+}
 
-	struct sample *new_samp = load_sample_from_wav(path);
-	free(path);
+// appends an empty bank to the sampler
+// returns 0 on success and -1 on failure
+static int add_bank(struct sampler *sampler)
+{
+	struct sample **bank = calloc(NUM_PADS, sizeof(struct sample *));
+	if (!bank) return -1;
 
-	if (new_samp) {
-		struct sample **dest_pad = sampler->banks[sampler->curr_bank] + pad;
+	struct sample ***banks = realloc(sampler->banks, sizeof(struct sample **) * (sampler->num_banks + 1));
+	if (!banks) {
+		free(bank);
+		return -1;
+	}
+	sampler->banks = banks;
+	sampler->banks[sampler->num_banks++] = bank;
+	return 0;
+}
 
-		// if target pad is occupied delete that sample
-		if (*dest_pad) unload_sample(*dest_pad, sp_state);
+// true if bank has no sample and no load queued to it
+static bool is_bank_free(const struct sp_state *sp_state, int bank)
+{
+	for (int p = PAD_Q; p <= PAD_F; p++) {
+		if (sp_state->sampler.banks[bank][p]) return false;
+	}
+	const struct loader *l = &sp_state->loader;
+	for (int i = 0; l->num_jobs && i < MAX_LOAD_JOBS; i++) {
+		if (l->jobs[i].path && l->jobs[i].bank == bank) return false;
+	}
+	return true;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
 
-		// create new bus and attach to master
-		struct bus *new_bus = init_bus(sp_state);
-		if (new_bus) {
-			new_bus->label = malloc(strlen(new_samp->name) + 1);
-			strcpy(new_bus->label, new_samp->name);
-			new_bus->type = SAMPLE;
-			attach_bus(new_bus, &sp_state->mixer.master, sp_state);
+// loads every wav in dir, in name order, onto successive pads of the free
+// banks at the end of the sampler, adding banks as needed
+// files are loaded in parallel by the load workers as one batch
+static void load_folder_to_banks(struct sp_state *sp_state, const char *dir)
+{
+	SP_DIR *dir_handle = platform_opendir(dir);
+	if (!dir_handle) {
+		log_msg(LOG_ERROR, "Error opening directory: %s", dir);
+		return;
+	}
 
-			// assign new sample to pad and attach to bus
-			*dest_pad = new_samp;
-			attach_sample_to_bus(*dest_pad, new_bus, sp_state);
+	const int num_items = platform_num_valid_items_in_dir(dir_handle);
+	char **files = malloc(sizeof(char *) * (num_items ? num_items : 1));
+	int num_files = 0;
+	for (int i = 0; files && i < num_items; i++) {
+		char *name;
+		int is_dir;
+		if (platform_read_next_valid_item(dir_handle, &name, &is_dir)) break;
+		if (is_dir) free(name);
+		else files[num_files++] = name;
+	}
+	if (platform_closedir(dir_handle)) {
+		log_msg(LOG_ERROR, "Error closing directory");
+	}
+	if (!files) {
+		log_msg(LOG_ERROR, "Error loading folder");
+		return;
+	}
+	qsort(files, num_files, sizeof(char *), compare_names);
 
-			// set current sampler paramaters
-			sp_state->sampler.active_sample = new_samp;
-			sp_state->sampler.curr_pad = pad;
+	// start after the last bank in use
+	struct sampler *sampler = &sp_state->sampler;
+	int first_bank = sampler->num_banks;
+	while (first_bank > 0 && is_bank_free(sp_state, first_bank - 1)) first_bank--;
+
+	const int batch = ++sp_state->loader.num_batches;
+	int queued = 0;
+	for (int i = 0; i < num_files; i++) {
+		const int bank = first_bank + queued / NUM_PADS;
+		if (bank == sampler->num_banks && add_bank(sampler)) {
+			log_msg(LOG_ERROR, "Error allocating sample bank");
+			break;
+		}
 
-			shell_print("File loaded!", sp_state);
-		} else {
-			fprintf(stderr, "Error initializing bus\n");
+		char *path = join_path(dir, files[i]);
+		if (!path || queue_sample_load(sp_state, path, bank, queued % NUM_PADS, batch)) {
+			if (path) free(path);
+			break;
 		}
+		queued++;
+	}
+
+	for (int i = 0; i < num_files; i++) free(files[i]);
+	free(files);
+
+	if (queued < num_files)
+		log_msg(LOG_WARN, "load: only %d of %d files in %s queued", queued, num_files, dir);
+	if (!queued) return;
+
+	sampler->curr_bank = first_bank;
+	char txt[96];
+	snprintf(txt, sizeof(txt), "Loading %d files into banks %d to %d...", queued,
+			first_bank + 1, first_bank + (queued - 1) / NUM_PADS + 1);
+	shell_print(txt, sp_state);
+}
+
+static void load_sample_from_browser(struct sp_state *sp_state, int pad)
+{
+	struct file_browser *fb = &sp_state->file_browser;
 
+	char *path = join_path(fb->dir, fb->files[fb->selected_file].name);
+	if (!path) {
+		log_msg(LOG_ERROR, "Error loading file");
+		return;
+	}
+
+	// without workers the load blocks the ui
+	if (!queue_sample_load(sp_state, path, sp_state->sampler.curr_bank, pad, 0)) {
+		shell_print("Loading file...", sp_state);
+	} else {
+		if (!load_sample_to_pad(sp_state, path, pad))
+			shell_print("File loaded!", sp_state);
+		free(path);
 	}
+
 	fb->loading_to_pad = 0;
 }
 
@@ -1062,7 +1651,7 @@ static void update_file_browser(struct sp_state *sp_state, struct key_input *inp
 			if (fb->selected_file > 0) fb->selected_file--;
 		}
 
-		// load wav or enter directory
+		// load wav, enter directory or load directory into banks
 		if (is_key_pressed(input, KEY_RIGHT) && fb->num_files) {
 
 			if (fb->files[fb->selected_file].is_dir) {
@@ -1077,7 +1666,9 @@ static void update_file_browser(struct sp_state *sp_state, struct key_input *inp
 					strcpy(dir, fb->dir);
 					strcat(dir, "/");
 					strcat(dir, fb->files[fb->selected_file].name);
-					load_directory_to_browser(fb, dir);
+					// shift loads the whole folder into fresh banks
+					if (alt) load_folder_to_banks(sp_state, dir);
+					else load_directory_to_browser(fb, dir);
 					free(dir);
 				}
 			} else {
@@ -1097,6 +1688,137 @@ static void update_file_browser(struct sp_state *sp_state, struct key_input *inp
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Mixer Plan
+///
+/// The ui thread owns the bus tree. After graph edits the tree is compiled
+/// into a flat mix_plan which is handed to the audio thread with an atomic
+/// pointer swap. Replaced plans, and any busses or samples removed along with
+/// them, are freed once the audio thread has finished a block with a newer plan.
+
+// appends b and its inputs to plan in render order
+// returns index of b's node or -1 if b contributes nothing to the mix
+static int add_plan_nodes(struct mix_plan *p, struct bus *b, int *num_blocks)
+{
+	int first_input = p->num_nodes;
+	if (!b->sample_in) {
+		for (int i = 0; i < b->num_bus_ins; i++)
+			add_plan_nodes(p, b->bus_ins[i], num_blocks);
+
+		// skip busses with nothing to mix, except master
+		if (first_input == p->num_nodes && b->type != MASTER) return -1;
+	}
+
+	const int n = p->num_nodes++;
+	p->nodes[n].bus = b;
+	p->nodes[n].sample = b->sample_in;
+	p->nodes[n].output = -1;
+	p->nodes[n].block = p->blocks + (*num_blocks)++ * NUM_CHANNELS * MIX_BLOCK_FRAMES;
+
+	for (int i = first_input; i < n; i++) {
+		if (p->nodes[i].output == -1) p->nodes[i].output = n;
+	}
+	return n;
+}
+
+static void free_mix_plan(struct mix_plan *p)
+{
+	for (int i = 0; i < p->num_dead_busses; i++) destroy_bus(p->dead_busses[i]);
+	for (int i = 0; i < p->num_dead_samples; i++) destroy_sample(p->dead_samples[i]);
+
+	if (p->dead_busses) free(p->dead_busses);
+	if (p->dead_samples) free(p->dead_samples);
+	if (p->nodes) free(p->nodes);
+	if (p->blocks) free(p->blocks);
+	if (p->scratch) free(p->scratch);
+	if (p->live) free(p->live);
+	free(p);
+}
+
+// builds a plan from the current bus tree
+// returns NULL on failure
+static struct mix_plan *compile_mix_plan(struct mixer *m)
+{
+	struct mix_plan *p = calloc(1, sizeof(*p));
+	if (!p) return NULL;
+
+	// every bus is at most one node
+	const int BLOCK_SIZE = NUM_CHANNELS * MIX_BLOCK_FRAMES;
+	p->nodes = malloc(sizeof(struct mix_node) * m->num_bus);
+	p->blocks = malloc(sizeof(float) * BLOCK_SIZE * m->num_bus);
+	p->scratch = malloc(sizeof(float) * BLOCK_SIZE);
+	p->live = malloc(sizeof(bool) * m->num_bus);
+	if (!p->nodes || !p->blocks || !p->scratch || !p->live) {
+		free_mix_plan(p);
+		return NULL;
+	}
+
+	// blocks are first written by the audio thread
+	platform_prefault(p->blocks, sizeof(float) * BLOCK_SIZE * m->num_bus);
+	platform_prefault(p->scratch, sizeof(float) * BLOCK_SIZE);
+
+	int num_blocks = 0;
+	add_plan_nodes(p, &m->master, &num_blocks);
+
+	p->seq = ++m->plan_seq;
+	return p;
+}
+
+// compiles bus tree and swaps new plan in for the audio thread
+static void publish_mix_plan(struct sp_state *sp_state)
+{
+	struct mixer *m = &sp_state->mixer;
+
+	struct mix_plan *p = compile_mix_plan(m);
+	if (!p) {
+		log_msg(LOG_ERROR, "Error compiling mixer");
+		return;
+	}
+
+	struct mix_plan *old = atomic_exchange_explicit(&m->plan, p, memory_order_acq_rel);
+	m->graph_changed = false;
+	if (!old) return;
+
+	// anything removed from the graph is freed along with the old plan
+	old->dead_busses = m->dead_busses;
+	old->num_dead_busses = m->num_dead_busses;
+	old->dead_samples = m->dead_samples;
+	old->num_dead_samples = m->num_dead_samples;
+	m->dead_busses = NULL;
+	m->num_dead_busses = 0;
+	m->dead_samples = NULL;
+	m->num_dead_samples = 0;
+
+	// delayed commands sent before now may still refer to them
+	old->cmd_head = atomic_load_explicit(&m->cmd_queue->head, memory_order_relaxed);
+
+	old->next_retired = m->retired_plans;
+	m->retired_plans = old;
+}
+
+// frees retired plans the audio thread can no longer be using
+// a plan is kept until the audio thread has finished a block with a newer plan
+// and has applied every command sent before the plan was retired
+static void reclaim_mix_plans(struct sp_state *sp_state)
+{
+	struct mixer *m = &sp_state->mixer;
+	const uint64_t done = atomic_load_explicit(&m->plan_done, memory_order_acquire);
+	const uint32_t tail = atomic_load_explicit(&m->cmd_queue->tail, memory_order_acquire);
+
+	struct mix_plan **p = &m->retired_plans;
+	while (*p) {
+		if ((*p)->seq < done && (int32_t) (tail - (*p)->cmd_head) >= 0) {
+			struct mix_plan *tmp = *p;
+			*p = tmp->next_retired;
+			free_mix_plan(tmp);
+		} else {
+			p = &(*p)->next_retired;
+		}
+	}
+
+	reclaim_stream_caches(m, tail);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /// Mixer Update
 
@@ -1219,6 +1941,7 @@ static void update_mixer(struct sp_state *sp_state, struct key_input *input)
 						else 
 							mixer->bus_list[mixer->selected_bus]->atten = 1.0f;
 					}
+					send_bus_gain(mixer->bus_list[mixer->selected_bus], sp_state);
 				}
 
 				// pan
@@ -1234,6 +1957,7 @@ static void update_mixer(struct sp_state *sp_state, struct key_input *input)
 						else 
 							mixer->bus_list[mixer->selected_bus]->pan = 1.0f;
 					}
+					send_bus_gain(mixer->bus_list[mixer->selected_bus], sp_state);
 				}
 
 				// create new bus
@@ -0,0 +1,335 @@
+#include "sp_voice.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#define VOICE_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// dest is run r starting n frames later
+static void skip_frames(const struct voice_run *r, struct voice_run *dest, int n)
+{
+	*dest = *r;
+	const double pos = r->frac + (double) n * r->step;
+	dest->base = r->base + (int32_t) floor(pos);
+	dest->frac = pos - floor(pos);
+	dest->attack += n * r->attack_inc;
+	dest->release += n * r->release_inc;
+	dest->gate += n * r->gate_inc;
+}
+
+/* Scalar */
+
+static void render_stereo_run_scalar(const struct voice_run *r, float *out, int frames)
+{
+	for (int i = 0; i < frames; i++) {
+		const double pos = fmax(r->frac + (double) i * r->step, -r->base);
+		const double fl = floor(pos);
+		const double t = pos - fl;
+		const float *f0 = r->data + (r->base + (int32_t) fl) * 2;
+
+		double g = fmin(1.0, fmin(r->attack + (double) i * r->attack_inc, 
+					r->release + (double) i * r->release_inc));
+		if (r->gate_closed) g *= r->gate + (double) i * r->gate_inc;
+
+		out[i * 2] = (f0[0] + (f0[2] - f0[0]) * t) * g;
+		out[i * 2 + 1] = (f0[1] + (f0[3] - f0[1]) * t) * g;
+	}
+}
+
+static void render_mono_run_scalar(const struct voice_run *r, float *out, int frames)
+{
+	for (int i = 0; i < frames; i++) {
+		const double pos = fmax(r->frac + (double) i * r->step, -r->base);
+		const double fl = floor(pos);
+		const double t = pos - fl;
+		const float *f0 = r->data + r->base + (int32_t) fl;
+
+		double g = fmin(1.0, fmin(r->attack + (double) i * r->attack_inc, 
+					r->release + (double) i * r->release_inc));
+		if (r->gate_closed) g *= r->gate + (double) i * r->gate_inc;
+
+		out[i * 2] = out[i * 2 + 1] = (f0[0] + (f0[1] - f0[0]) * t) * g;
+	}
+}
+
+void render_voice_run_scalar(const struct voice_run *r, float *out, int frames)
+{
+	if (r->channels == 1) render_mono_run_scalar(r, out, frames);
+	else render_stereo_run_scalar(r, out, frames);
+}
+
+#ifdef VOICE_KERNEL_X86
+
+/* SSE2, 4 frames per iteration */
+
+static void render_stereo_run_sse2(const struct voice_run *r, float *out, int frames)
+{
+	const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 frac = _mm_set1_ps(r->frac);
+	const __m128 step = _mm_set1_ps(r->step);
+	const __m128 attack = _mm_set1_ps(r->attack);
+	const __m128 attack_inc = _mm_set1_ps(r->attack_inc);
+	const __m128 release = _mm_set1_ps(r->release);
+	const __m128 release_inc = _mm_set1_ps(r->release_inc);
+	const __m128 gate = _mm_set1_ps(r->gate_closed ? r->gate : 1.0f);
+	const __m128 gate_inc = _mm_set1_ps(r->gate_closed ? r->gate_inc : 0.0f);
+	const __m128 lo = _mm_set1_ps((float) -r->base);
+	const float *data = r->data + r->base * 2;
+
+	int i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 idx = _mm_add_ps(_mm_set1_ps((float) i), lane);
+
+		// floor of position, sse2 has no floor so fix up truncation
+		const __m128 pos = _mm_max_ps(_mm_add_ps(frac, _mm_mul_ps(idx, step)), lo);
+		__m128 fl = _mm_cvtepi32_ps(_mm_cvttps_epi32(pos));
+		fl = _mm_sub_ps(fl, _mm_and_ps(_mm_cmpgt_ps(fl, pos), one));
+		const __m128 t = _mm_sub_ps(pos, fl);
+
+		int32_t f[4];
+		_mm_storeu_si128((__m128i *) f, _mm_cvttps_epi32(fl));
+
+		// no gather in sse2, load both interpolation frames of each lane
+		// and transpose into l0, r0, l1, r1
+		__m128 l0 = _mm_loadu_ps(data + f[0] * 2);
+		__m128 r0 = _mm_loadu_ps(data + f[1] * 2);
+		__m128 l1 = _mm_loadu_ps(data + f[2] * 2);
+		__m128 r1 = _mm_loadu_ps(data + f[3] * 2);
+		_MM_TRANSPOSE4_PS(l0, r0, l1, r1);
+
+		__m128 g = _mm_min_ps(
+				_mm_add_ps(attack, _mm_mul_ps(idx, attack_inc)),
+				_mm_add_ps(release, _mm_mul_ps(idx, release_inc)));
+		g = _mm_min_ps(g, one);
+		g = _mm_mul_ps(g, _mm_add_ps(gate, _mm_mul_ps(idx, gate_inc)));
+
+		const __m128 left = _mm_mul_ps(_mm_add_ps(l0, _mm_mul_ps(_mm_sub_ps(l1, l0), t)), g);
+		const __m128 right = _mm_mul_ps(_mm_add_ps(r0, _mm_mul_ps(_mm_sub_ps(r1, r0), t)), g);
+
+		_mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(left, right));
+		_mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(left, right));
+	}
+
+	// tail
+	if (i < frames) {
+		struct voice_run tail;
+		skip_frames(r, &tail, i);
+		render_stereo_run_scalar(&tail, out + i * 2, frames - i);
+	}
+}
+
+static void render_mono_run_sse2(const struct voice_run *r, float *out, int frames)
+{
+	const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 frac = _mm_set1_ps(r->frac);
+	const __m128 step = _mm_set1_ps(r->step);
+	const __m128 attack = _mm_set1_ps(r->attack);
+	const __m128 attack_inc = _mm_set1_ps(r->attack_inc);
+	const __m128 release = _mm_set1_ps(r->release);
+	const __m128 release_inc = _mm_set1_ps(r->release_inc);
+	const __m128 gate = _mm_set1_ps(r->gate_closed ? r->gate : 1.0f);
+	const __m128 gate_inc = _mm_set1_ps(r->gate_closed ? r->gate_inc : 0.0f);
+	const __m128 lo = _mm_set1_ps((float) -r->base);
+	const float *data = r->data + r->base;
+
+	int i = 0;
+	for (; i + 4 <= frames; i += 4) {
+		const __m128 idx = _mm_add_ps(_mm_set1_ps((float) i), lane);
+
+		const __m128 pos = _mm_max_ps(_mm_add_ps(frac, _mm_mul_ps(idx, step)), lo);
+		__m128 fl = _mm_cvtepi32_ps(_mm_cvttps_epi32(pos));
+		fl = _mm_sub_ps(fl, _mm_and_ps(_mm_cmpgt_ps(fl, pos), one));
+		const __m128 t = _mm_sub_ps(pos, fl);
+
+		int32_t f[4];
+		_mm_storeu_si128((__m128i *) f, _mm_cvttps_epi32(fl));
+
+		// load both interpolation samples of each lane as a pair
+		__m128 a = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) (data + f[0]));
+		a = _mm_loadh_pi(a, (const __m64 *) (data + f[1]));
+		__m128 b = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *) (data + f[2]));
+		b = _mm_loadh_pi(b, (const __m64 *) (data + f[3]));
+		const __m128 x0 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+		const __m128 x1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+		__m128 g = _mm_min_ps(
+				_mm_add_ps(attack, _mm_mul_ps(idx, attack_inc)),
+				_mm_add_ps(release, _mm_mul_ps(idx, release_inc)));
+		g = _mm_min_ps(g, one);
+		g = _mm_mul_ps(g, _mm_add_ps(gate, _mm_mul_ps(idx, gate_inc)));
+
+		const __m128 x = _mm_mul_ps(_mm_add_ps(x0, _mm_mul_ps(_mm_sub_ps(x1, x0), t)), g);
+
+		_mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(x, x));
+		_mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(x, x));
+	}
+
+	// tail
+	if (i < frames) {
+		struct voice_run tail;
+		skip_frames(r, &tail, i);
+		render_mono_run_scalar(&tail, out + i * 2, frames - i);
+	}
+}
+
+static void render_voice_run_sse2(const struct voice_run *r, float *out, int frames)
+{
+	if (r->channels == 1) render_mono_run_sse2(r, out, frames);
+	else render_stereo_run_sse2(r, out, frames);
+}
+
+/* AVX2, 8 frames per iteration */
+
+// gathers one channel of frames f
+__attribute__((target("avx2")))
+static inline __m256 gather_channel(const float *data, __m256i f, int offset)
+{
+	const __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(f, 1), _mm256_set1_epi32(offset));
+	return _mm256_i32gather_ps(data, idx, 4);
+}
+
+__attribute__((target("avx2")))
+static void render_stereo_run_avx2(const struct voice_run *r, float *out, int frames)
+{
+	const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 frac = _mm256_set1_ps(r->frac);
+	const __m256 step = _mm256_set1_ps(r->step);
+	const __m256 attack = _mm256_set1_ps(r->attack);
+	const __m256 attack_inc = _mm256_set1_ps(r->attack_inc);
+	const __m256 release = _mm256_set1_ps(r->release);
+	const __m256 release_inc = _mm256_set1_ps(r->release_inc);
+	const __m256 gate = _mm256_set1_ps(r->gate_closed ? r->gate : 1.0f);
+	const __m256 gate_inc = _mm256_set1_ps(r->gate_closed ? r->gate_inc : 0.0f);
+	const __m256 lo = _mm256_set1_ps((float) -r->base);
+	const float *data = r->data + r->base * 2;
+
+	int i = 0;
+	for (; i + 8 <= frames; i += 8) {
+		const __m256 idx = _mm256_add_ps(_mm256_set1_ps((float) i), lane);
+
+		const __m256 pos = _mm256_max_ps(_mm256_add_ps(frac, _mm256_mul_ps(idx, step)), lo);
+		const __m256 fl = _mm256_floor_ps(pos);
+		const __m256 t = _mm256_sub_ps(pos, fl);
+		const __m256i f = _mm256_cvttps_epi32(fl);
+
+		const __m256 l0 = gather_channel(data, f, 0);
+		const __m256 r0 = gather_channel(data, f, 1);
+		const __m256 l1 = gather_channel(data, f, 2);
+		const __m256 r1 = gather_channel(data, f, 3);
+
+		__m256 g = _mm256_min_ps(
+				_mm256_add_ps(attack, _mm256_mul_ps(idx, attack_inc)),
+				_mm256_add_ps(release, _mm256_mul_ps(idx, release_inc)));
+		g = _mm256_min_ps(g, one);
+		g = _mm256_mul_ps(g, _mm256_add_ps(gate, _mm256_mul_ps(idx, gate_inc)));
+
+		const __m256 left = _mm256_mul_ps(_mm256_add_ps(l0, _mm256_mul_ps(_mm256_sub_ps(l1, l0), t)), g);
+		const __m256 right = _mm256_mul_ps(_mm256_add_ps(r0, _mm256_mul_ps(_mm256_sub_ps(r1, r0), t)), g);
+
+		// unpack works within 128 bit lanes, permute back to frame order
+		const __m256 lo = _mm256_unpacklo_ps(left, right);
+		const __m256 hi = _mm256_unpackhi_ps(left, right);
+		_mm256_storeu_ps(out + i * 2, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(out + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+
+	// finish with sse2
+	if (i < frames) {
+		struct voice_run tail;
+		skip_frames(r, &tail, i);
+		render_stereo_run_sse2(&tail, out + i * 2, frames - i);
+	}
+}
+
+__attribute__((target("avx2")))
+static void render_mono_run_avx2(const struct voice_run *r, float *out, int frames)
+{
+	const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 frac = _mm256_set1_ps(r->frac);
+	const __m256 step = _mm256_set1_ps(r->step);
+	const __m256 attack = _mm256_set1_ps(r->attack);
+	const __m256 attack_inc = _mm256_set1_ps(r->attack_inc);
+	const __m256 release = _mm256_set1_ps(r->release);
+	const __m256 release_inc = _mm256_set1_ps(r->release_inc);
+	const __m256 gate = _mm256_set1_ps(r->gate_closed ? r->gate : 1.0f);
+	const __m256 gate_inc = _mm256_set1_ps(r->gate_closed ? r->gate_inc : 0.0f);
+	const __m256 lo = _mm256_set1_ps((float) -r->base);
+	const float *data = r->data + r->base;
+
+	int i = 0;
+	for (; i + 8 <= frames; i += 8) {
+		const __m256 idx = _mm256_add_ps(_mm256_set1_ps((float) i), lane);
+
+		const __m256 pos = _mm256_max_ps(_mm256_add_ps(frac, _mm256_mul_ps(idx, step)), lo);
+		const __m256 fl = _mm256_floor_ps(pos);
+		const __m256 t = _mm256_sub_ps(pos, fl);
+		const __m256i f = _mm256_cvttps_epi32(fl);
+
+		const __m256 x0 = _mm256_i32gather_ps(data, f, 4);
+		const __m256 x1 = _mm256_i32gather_ps(data + 1, f, 4);
+
+		__m256 g = _mm256_min_ps(
+				_mm256_add_ps(attack, _mm256_mul_ps(idx, attack_inc)),
+				_mm256_add_ps(release, _mm256_mul_ps(idx, release_inc)));
+		g = _mm256_min_ps(g, one);
+		g = _mm256_mul_ps(g, _mm256_add_ps(gate, _mm256_mul_ps(idx, gate_inc)));
+
+		const __m256 x = _mm256_mul_ps(_mm256_add_ps(x0, _mm256_mul_ps(_mm256_sub_ps(x1, x0), t)), g);
+
+		const __m256 lo = _mm256_unpacklo_ps(x, x);
+		const __m256 hi = _mm256_unpackhi_ps(x, x);
+		_mm256_storeu_ps(out + i * 2, _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(out + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+
+	// finish with sse2
+	if (i < frames) {
+		struct voice_run tail;
+		skip_frames(r, &tail, i);
+		render_mono_run_sse2(&tail, out + i * 2, frames - i);
+	}
+}
+
+__attribute__((target("avx2")))
+static void render_voice_run_avx2(const struct voice_run *r, float *out, int frames)
+{
+	if (r->channels == 1) render_mono_run_avx2(r, out, frames);
+	else render_stereo_run_avx2(r, out, frames);
+}
+
+#endif
+
+/* Dispatch */
+
+static void (*voice_kernel)(const struct voice_run *, float *, int) = render_voice_run_scalar;
+static const char *voice_kernel_name = "scalar";
+
+void init_voice_kernel(void)
+{
+#ifdef VOICE_KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		voice_kernel = render_voice_run_avx2;
+		voice_kernel_name = "avx2";
+	} else {
+		voice_kernel = render_voice_run_sse2;
+		voice_kernel_name = "sse2";
+	}
+#endif
+}
+
+void render_voice_run(const struct voice_run *run, float *out, int frames)
+{
+	voice_kernel(run, out, frames);
+}
+
+const char *get_voice_kernel_name(void)
+{
+	return voice_kernel_name;
+}
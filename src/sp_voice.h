@@ -0,0 +1,52 @@
+#ifndef SP_VOICE_H
+#define SP_VOICE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//////////////////////////////////////////////////////////////////
+/// Voice Kernel
+///
+/// Renders runs of sample playback with interpolation, envelope and
+/// gate release fused into one pass. A run must not cross a playback
+/// event (start/end bounds, loop points, end of gate release) so that
+/// playback position and gains are linear over the whole run.
+
+// run parameters, gains are linear ramps over the run
+// gain of frame i is:
+// 	min(1, attack + i * attack_inc, release + i * release_inc) 
+// 	* (gate + i * gate_inc)		if gate_closed
+struct voice_run {
+	const float *data;	// mono or interleaved stereo frames
+	int channels;		// channels in data, mono is rendered to both outputs
+	int32_t base;		// integer part of position of first frame
+	float frac;		// fractional part of position of first frame, [0, 1)
+	float step;		// position increment per frame, negative when reversed
+
+	float attack;
+	float attack_inc;
+	float release;
+	float release_inc;
+
+	bool gate_closed;
+	float gate;
+	float gate_inc;
+};
+
+void init_voice_kernel(void);
+// selects fastest kernel supported by the cpu
+// must be called before render_voice_run
+
+void render_voice_run(const struct voice_run *run, float *out, int frames);
+// renders frames of interleaved stereo to out
+// mono data is interpolated once and copied to both channels
+// reads data frames from base up to one frame past the last position of the run
+// positions before the first data frame are clamped to it
+
+void render_voice_run_scalar(const struct voice_run *run, float *out, int frames);
+// reference implementation of render_voice_run
+
+const char *get_voice_kernel_name(void);
+// name of kernel selected by init_voice_kernel
+
+#endif
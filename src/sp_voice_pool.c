@@ -0,0 +1,233 @@
+////////////////////////////////////////////////////////////////////////////////
+/// Voice Pool
+///
+/// Every trigger of a sample plays on its own voice taken from a fixed pool,
+/// so a sample can sound several times at once. All functions here are only
+/// called by the audio thread, the ui thread sends a command instead.
+/// Nothing here allocates memory.
+
+static void init_voice_pool(struct voice_pool *p)
+{
+	p->num_active = 0;
+	p->num_free = MAX_VOICES;
+	for (int i = 0; i < MAX_VOICES; i++)
+		p->free[i] = p->voices + MAX_VOICES - 1 - i;
+}
+
+static inline double get_envelope_gain(const struct voice *v)
+{
+	const struct sample *s = v->sample;
+	double g = 1.0;
+	if (s->play.attack && v->next_frame - s->play.start_frame < s->play.attack) {
+		g = (v->next_frame - s->play.start_frame) / s->play.attack;
+	} else if (s->play.release && s->play.end_frame - v->next_frame <= s->play.release) {
+		g = (s->play.end_frame - v->next_frame) / s->play.release;
+	}
+	return g;
+}
+
+// gain of the gate release ramp, 1 if gate is open
+static inline double get_gate_gain(const struct voice *v)
+{
+	if (!v->gate_closed) return 1.0;
+	if (!v->gate_release) return 0.0;
+	return v->gate_close_gain * (v->gate_release - v->gate_release_cnt) / v->gate_release;
+}
+
+// returns a voice to the pool
+static void release_voice(struct voice_pool *p, struct voice *v)
+{
+	struct sample *s = v->sample;
+	if (!v->stolen) s->num_voices--;
+	if (s->newest_voice == v) {
+		s->newest_voice = NULL;
+		s->next_frame = s->speed < 0 ? s->play.end_frame - 1 : s->play.start_frame;
+	}
+
+	// swap last active voice into v's place
+	struct voice *last = p->active[--p->num_active];
+	p->active[v->index] = last;
+	last->index = v->index;
+
+	if (v->ring) release_stream_ring(p->streams, v->ring);
+	v->sample = NULL;
+	p->free[p->num_free++] = v;
+}
+
+// fades v out over STEAL_FADE_FRAMES by closing its gate with a short release
+static void steal_voice(struct voice *v)
+{
+	if (v->stolen) return;
+
+	const double gain = get_gate_gain(v);
+	v->gate_closed = true;
+	v->gate_close_gain = gain;
+	v->gate_release = ceil(STEAL_FADE_FRAMES * fabs(v->speed));
+	if (v->gate_release < 1) v->gate_release = 1;
+	v->gate_release_cnt = 0.0;
+
+	v->stolen = true;
+	v->sample->num_voices--;
+}
+
+// picks the voice to steal using s's steal mode
+// only voices of s are considered if only_s is set
+// returns NULL if every candidate is already stolen
+static struct voice *find_steal_victim(struct voice_pool *p, const struct sample *s, bool only_s)
+{
+	struct voice *victim = NULL;
+	for (int i = 0; i < p->num_active; i++) {
+		struct voice *v = p->active[i];
+		if (v->stolen || (only_s && v->sample != s)) continue;
+
+		if (!victim) victim = v;
+		else if (s->play.steal_mode == STEAL_QUIETEST && v->level < victim->level) victim = v;
+		else if (s->play.steal_mode == STEAL_OLDEST && v->age < victim->age) victim = v;
+	}
+	return victim;
+}
+
+// takes a voice from the pool for s, stealing one if needed
+static struct voice *alloc_voice(struct voice_pool *p, struct sample *s)
+{
+	struct voice *victim = NULL;
+	if (s->num_voices >= s->play.polyphony)
+		victim = find_steal_victim(p, s, true);
+	else if (p->num_free <= VOICE_HEADROOM)
+		victim = find_steal_victim(p, s, false);
+	if (victim) steal_voice(victim);
+
+	// headroom is used up by fading voices, cut the oldest one
+	if (!p->num_free) {
+		struct voice *oldest = p->active[0];
+		for (int i = 1; i < p->num_active; i++) {
+			if (p->active[i]->age < oldest->age) oldest = p->active[i];
+		}
+		release_voice(p, oldest);
+	}
+
+	struct voice *v = p->free[--p->num_free];
+	memset(v, 0, sizeof(*v));
+	v->sample = s;
+	v->age = p->num_triggers++;
+	v->index = p->num_active;
+	p->active[p->num_active++] = v;
+
+	s->num_voices++;
+	s->newest_voice = v;
+	return v;
+}
+
+// closes gate of every voice of s with an open gate
+static void close_gate(struct voice_pool *p, struct sample* s)
+{
+	if (!s || !s->play.gate) return;
+
+	for (int i = 0; i < p->num_active; i++) {
+		struct voice *v = p->active[i];
+		if (v->sample != s || v->gate_closed) continue;
+
+		v->gate_release_cnt = 0.0;
+		v->gate_closed = true;
+		v->gate_close_gain = get_envelope_gain(v);
+		// if sample is playing forward compare to release
+		if (v->speed > 0) {
+			v->gate_release = s->play.release;
+			if (s->play.end_frame - v->next_frame < s->play.release)
+				v->gate_release_cnt = s->play.release - (s->play.end_frame - v->next_frame);
+			// if sample is playing backward compare to attack
+		} else {
+			v->gate_release = s->play.attack;
+			if (v->next_frame - s->play.start_frame < s->play.attack)
+				v->gate_release_cnt = s->play.release - (v->next_frame - s->play.start_frame);
+		}
+	}
+}
+
+// stops every voice of s, fading out if fade is set
+static void stop_sample(struct voice_pool *p, struct sample *s, bool fade)
+{
+	// iterate backwards as released voices are swapped with the last voice
+	for (int i = p->num_active - 1; i >= 0; i--) {
+		struct voice *v = p->active[i];
+		if (v->sample != s) continue;
+
+		if (fade) steal_voice(v);
+		else release_voice(p, v);
+	}
+}
+
+// gives a voice of a streamed sample a ring read ahead from its position
+// without one the voice plays the sample's cached frames only
+static void start_voice_stream(struct voice_pool *p, struct voice *v)
+{
+	v->ring = claim_stream_ring(p->streams, v->sample->stream->source, v->next_frame, v->speed);
+	if (!v->ring) {
+		log_msg(LOG_WARN, "stream: all %d rings in use, %s plays its cached frames only",
+				STREAM_MAX_VOICES, v->sample->name);
+	}
+}
+
+static void trigger_sample(struct voice_pool *p, struct sample* s)
+{
+	// in loop modes a trigger stops a playing sample
+	if (s->play.loop_mode && s->num_voices) {
+		stop_sample(p, s, true);
+		return;
+	}
+
+	struct voice *v = alloc_voice(p, s);
+	v->playing = true;
+	v->speed = s->speed;
+	if (v->speed < 0) v->next_frame = s->play.end_frame - 1.0;
+	else v->next_frame = s->play.start_frame;
+
+	s->next_frame = v->next_frame;
+	if (s->stream) start_voice_stream(p, v);
+}
+
+static inline int kill_sample(struct voice_pool *p, struct sample* s)
+{
+	if (!s) return 1;
+	stop_sample(p, s, false);
+	s->next_frame = s->speed < 0 ? s->play.end_frame - 1 : s->play.start_frame;
+	return 0;
+}
+
+// sets speed of s and its voices keeping their playback direction
+static void set_sample_speed(struct voice_pool *p, struct sample *s, float speed)
+{
+	s->speed = s->speed < 0.0f ? -speed : speed;
+	for (int i = 0; i < p->num_active; i++) {
+		struct voice *v = p->active[i];
+		if (v->sample == s) v->speed = v->speed < 0.0f ? -speed : speed;
+	}
+}
+
+// flips playback direction of s and its voices
+static void reverse_sample(struct voice_pool *p, struct sample *s)
+{
+	s->speed *= -1.0f;
+	for (int i = 0; i < p->num_active; i++) {
+		if (p->active[i]->sample == s) p->active[i]->speed *= -1.0f;
+	}
+}
+
+// binds samples to their node in plan p
+// voices of samples that are no longer in the mixer are dropped
+static void bind_voices(struct mixer *m, const struct mix_plan *p)
+{
+	for (int i = 0; i < p->num_nodes; i++) {
+		struct sample *s = p->nodes[i].sample;
+		if (!s) continue;
+		s->mix_node = i;
+		s->mix_seq = p->seq;
+	}
+
+	struct voice_pool *pool = &m->voices;
+	for (int i = pool->num_active - 1; i >= 0; i--) {
+		struct voice *v = pool->active[i];
+		if (v->sample->mix_seq != p->seq) release_voice(pool, v);
+	}
+	m->bound_plan = p;
+}
@@ -0,0 +1,110 @@
+/*
+ *  Checks the vectorized output conversion kernels against the scalar reference.
+ *
+ *  build: gcc -O2 -o convert-kernel-test convert-kernel-test.c -lm
+ */
+
+#include "../src/sp_convert.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FRAMES 300
+#define NUM_RUNS 5000
+
+static const enum audio_format formats[] = {
+	AUDIO_FORMAT_S16, AUDIO_FORMAT_S24_3, AUDIO_FORMAT_S24,
+	AUDIO_FORMAT_S32, AUDIO_FORMAT_FLOAT,
+};
+static const char *format_names[] = {"s16", "s24_3", "s24", "s32", "float"};
+
+static float rand_float(float lo, float hi)
+{
+	return lo + (hi - lo) * (float) rand() / RAND_MAX;
+}
+
+// returns number of runs where kernel output differs from scalar reference
+static int check_kernel(void (*kernel)(void *, const float *, float, float, int,
+			enum audio_format, struct dither_state *), enum audio_format format)
+{
+	static float src[MAX_FRAMES * 2];
+	static char ref[MAX_FRAMES * 2 * 4];
+	static char out[MAX_FRAMES * 2 * 4];
+	struct dither_state ref_dither, out_dither;
+	init_dither(&ref_dither, 7);
+	init_dither(&out_dither, 7);
+
+	int failed = 0;
+	srand(1);
+	for (int i = 0; i < NUM_RUNS; i++) {
+		// odd lengths exercise the scalar tail, loud samples the clipping
+		const int frames = rand() % MAX_FRAMES;
+		for (int j = 0; j < frames * 2; j++)
+			src[j] = rand_float(-1.5f, 1.5f);
+		const float gain_l = rand_float(0.0f, 1.2f);
+		const float gain_r = rand_float(0.0f, 1.2f);
+
+		const int bytes = frames * 2 * get_format_bytes(format);
+		convert_block_scalar(ref, src, gain_l, gain_r, frames, format, &ref_dither);
+		kernel(out, src, gain_l, gain_r, frames, format, &out_dither);
+		failed += memcmp(ref, out, bytes) != 0;
+	}
+	// dither must also stay in step across calls
+	failed += memcmp(&ref_dither, &out_dither, sizeof(ref_dither)) != 0;
+	return failed;
+}
+
+static int check_formats(const char *name, void (*kernel)(void *, const float *, float, float, int,
+			enum audio_format, struct dither_state *))
+{
+	int failed = 0;
+	for (int i = 0; i < (int) (sizeof(formats) / sizeof(formats[0])); i++) {
+		const int f = check_kernel(kernel, formats[i]);
+		printf("%s %s: %d mismatched runs\n", name, format_names[i], f);
+		failed |= f;
+	}
+	return failed;
+}
+
+// dither must be triangular in (-1, 1) LSB with zero mean
+static int check_dither(void)
+{
+	struct dither_state d;
+	init_dither(&d, 3);
+	double sum = 0.0, sum_sq = 0.0;
+	const int n = 1 << 20;
+	for (int i = 0; i < n; i++) {
+		const float x = tpdf_dither(d.lanes + (i & (DITHER_LANES - 1)));
+		if (x <= -1.0f || x >= 1.0f) return 1;
+		sum += x;
+		sum_sq += x * x;
+	}
+	// variance of triangular distribution on (-1, 1) is 1/6
+	const double mean = sum / n, var = sum_sq / n - mean * mean;
+	printf("dither: mean %g variance %g\n", mean, var);
+	return fabs(mean) > 0.01 || fabs(var - 1.0 / 6.0) > 0.01;
+}
+
+int main(void)
+{
+	int failed = check_dither();
+
+#ifdef CONVERT_KERNEL_X86
+	failed |= check_formats("sse2", convert_block_sse2);
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		failed |= check_formats("avx2", convert_block_avx2);
+	else
+		printf("avx2: not supported, skipped\n");
+#endif
+
+	init_convert_kernel();
+	char name[64];
+	snprintf(name, sizeof(name), "%s (selected)", get_convert_kernel_name());
+	failed |= check_formats(name, convert_block);
+
+	printf(failed ? "FAILED\n" : "PASSED\n");
+	return failed;
+}
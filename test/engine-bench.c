@@ -0,0 +1,318 @@
+/*
+ *  Headless benchmarks of the engine against a stub platform, printed as JSON.
+ *
+ *  build: ./build.sh b (from src), or
+ *  gcc -O2 -I../src/external -o engine-bench engine-bench.c ../src/sp_raster.c \
+ *  	../src/sp_voice.c ../src/sp_convert.c ../src/sp_trace.c ../src/sp_log.c -lm -L../lib -lsmarc
+ *  run from a directory next to fonts/, e.g. bin/ or test/
+ */
+
+#include "../src/sp_plus.c"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RATE 48000
+#define PERIOD_FRAMES 256
+#define MIX_PERIODS 1000		// periods timed per mixer configuration
+#define WAV_SECONDS 8			// test wav outlasts warm up and MIX_PERIODS
+#define LOAD_RUNS 20
+#define RESAMPLE_RATE 44100
+#define RESAMPLE_SECONDS 2
+#define DRAW_RUNS 200
+
+static const int voice_counts[] = {1, 8, 64, 256};
+static const int bus_depths[] = {1, 4, 16};
+
+/* Stub platform */
+
+long platform_load_entire_file(void **buffer, const char *path)
+{
+	*buffer = NULL;
+	FILE *f = fopen(path, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	const long size = ftell(f);
+	rewind(f);
+	*buffer = malloc(size);
+	if (!*buffer || fread(*buffer, size, 1, f) != 1) {
+		free(*buffer);
+		*buffer = NULL;
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	return size;
+}
+
+void platform_free_file_buffer(void **buffer)
+{
+	free(*buffer);
+	*buffer = NULL;
+}
+
+// wavs are mapped as on linux so the load bench measures the same path
+const void *platform_map_file(const char *path, long *size)
+{
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) return NULL;
+	struct stat st;
+	void *data = fstat(fd, &st) || st.st_size <= 0 ? MAP_FAILED
+		: mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return data;
+}
+
+void platform_unmap_file(const void *data, long size) { munmap((void *) data, size); }
+
+// samples are always loaded into memory, streaming is off by default
+void *platform_create_temp_file(void) { return NULL; }
+long platform_read_file_at(void *file, void *dest, long bytes, long offset)
+{
+	(void) file; (void) dest; (void) bytes; (void) offset;
+	return -1;
+}
+long platform_write_file_at(void *file, const void *src, long bytes, long offset)
+{
+	(void) file; (void) src; (void) bytes; (void) offset;
+	return -1;
+}
+void platform_close_file(void *file) { (void) file; }
+
+// the bench never browses, every directory looks empty
+SP_DIR *platform_opendir(const char *path) { return (SP_DIR *) opendir(path); }
+int platform_closedir(SP_DIR *dir) { return closedir((DIR *) dir); }
+int platform_num_valid_items_in_dir(SP_DIR *dir) { (void) dir; return 0; }
+int platform_read_next_valid_item(SP_DIR *dir, char **path, int *is_dir)
+{
+	(void) dir; (void) path; (void) is_dir;
+	return 1;
+}
+char *platform_get_realpath(const char *dir) { return realpath(dir, NULL); }
+char *platform_get_parent_dir(const char *dir) { return realpath(dir, NULL); }
+
+void *platform_init_mutex(void) { return NULL; }
+int platform_mutex_lock(void *mutex) { (void) mutex; return 0; }
+int platform_mutex_unlock(void *mutex) { (void) mutex; return 0; }
+void *platform_init_semaphore(void) { return NULL; }
+void platform_semaphore_post(void *sem) { (void) sem; }
+void platform_semaphore_wait(void *sem) { (void) sem; }
+int platform_get_cpu_count(void) { return 1; }
+
+// the bench is single threaded and never starts the log thread
+void *platform_create_thread(void *(*func)(void *), void *arg)
+{
+	(void) func; (void) arg;
+	return NULL;
+}
+int platform_join_thread(void *thread) { (void) thread; return -1; }
+void platform_sleep_ns(uint64_t ns) { (void) ns; }
+
+void platform_prefault(void *buffer, long size) { (void) buffer; (void) size; }
+
+void platform_get_audio_info(struct audio_info *info)
+{
+	info->period_frames = PERIOD_FRAMES;
+	info->buffer_frames = 2 * PERIOD_FRAMES;
+	info->sample_rate = RATE;
+	info->format = AUDIO_FORMAT_FLOAT;
+}
+
+void platform_get_audio_stats(struct audio_stats *stats) { memset(stats, 0, sizeof(*stats)); }
+void platform_reset_audio_stats(void) {}
+
+uint64_t platform_get_time_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Test data */
+
+// writes seconds of 16 bit stereo noise at rate to path
+static int write_test_wav(const char *path, int rate, int seconds)
+{
+	const uint32_t frames = rate * seconds;
+	const uint32_t data_bytes = frames * 4;
+	FILE *f = fopen(path, "wb");
+	if (!f) return -1;
+
+	const uint32_t riff_size = 36 + data_bytes, fmt_size = 16, byte_rate = rate * 4;
+	const uint16_t pcm = 1, channels = 2, align = 4, bits = 16;
+	fwrite("RIFF", 4, 1, f);
+	fwrite(&riff_size, 4, 1, f);
+	fwrite("WAVEfmt ", 8, 1, f);
+	fwrite(&fmt_size, 4, 1, f);
+	fwrite(&pcm, 2, 1, f);
+	fwrite(&channels, 2, 1, f);
+	fwrite(&rate, 4, 1, f);
+	fwrite(&byte_rate, 4, 1, f);
+	fwrite(&align, 2, 1, f);
+	fwrite(&bits, 2, 1, f);
+	fwrite("data", 4, 1, f);
+	fwrite(&data_bytes, 4, 1, f);
+
+	srand(1);
+	for (uint32_t i = 0; i < frames * 2; i++) {
+		const int16_t x = rand() % 20000 - 10000;
+		fwrite(&x, 2, 1, f);
+	}
+	return fclose(f);
+}
+
+static double seconds_since(uint64_t start)
+{
+	return (platform_get_time_ns() - start) * 1e-9;
+}
+
+/* Benchmarks */
+
+// ns per frame of fill_audio_buffer with voices playing through depth buses to master
+// returns voices actually active in *active
+static double bench_mix(const char *wav, int voices, int depth, int *active)
+{
+	struct sp_state *sp = sp_plus_allocate_state(RATE);
+
+	// chain of depth - 1 buses below master, every pad bus feeds the last one
+	struct bus *parent = &sp->mixer.master;
+	for (int i = 1; i < depth; i++) {
+		struct bus *b = init_bus(sp);
+		attach_bus(b, parent, sp);
+		parent = b;
+	}
+	for (int p = 0; p < NUM_PADS; p++) {
+		sp_plus_load_pad(sp, p, wav);
+		struct sample *s = sp->sampler.banks[0][p];
+		s->polyphony = MAX_POLYPHONY;
+		detach_bus_from_mixer(s->output_bus, sp);
+		attach_bus(s->output_bus, parent, sp);
+	}
+	publish_mix_plan(sp);
+
+	for (int i = 0; i < voices; i++)
+		sp_plus_trigger_pad(sp, i % NUM_PADS, 0);
+
+	static float buf[PERIOD_FRAMES * NUM_CHANNELS];
+	for (int i = 0; i < 16; i++)
+		sp_plus_fill_audio_buffer(sp, buf, PERIOD_FRAMES, AUDIO_FORMAT_FLOAT);
+	*active = sp->mixer.voices.num_active;
+
+	const uint64_t start = platform_get_time_ns();
+	for (int i = 0; i < MIX_PERIODS; i++)
+		sp_plus_fill_audio_buffer(sp, buf, PERIOD_FRAMES, AUDIO_FORMAT_FLOAT);
+	return seconds_since(start) * 1e9 / ((double) MIX_PERIODS * PERIOD_FRAMES);
+}
+
+// MB/s of wav file read and decoded by load_sample_from_wav
+static double bench_load(const char *wav)
+{
+	struct stat st;
+	if (stat(wav, &st)) return 0.0;
+
+	const uint64_t start = platform_get_time_ns();
+	for (int i = 0; i < LOAD_RUNS; i++) {
+		struct sample *s = load_sample_from_wav(wav, RATE);
+		if (s) destroy_sample(s);
+	}
+	return (double) st.st_size * LOAD_RUNS / seconds_since(start) / 1e6;
+}
+
+// millions of input frames per second resampled from RESAMPLE_RATE to RATE
+static double bench_resample(const char *wav)
+{
+	struct sample *s = load_sample_from_wav(wav, RATE);
+	if (!s) return 0.0;
+	const int frames = s->num_frames;
+
+	const uint64_t start = platform_get_time_ns();
+	resample(s, RESAMPLE_RATE, RATE);
+	const double t = seconds_since(start);
+	destroy_sample(s);
+	return frames / t / 1e6;
+}
+
+// microseconds per draw_waveform and draw_text call on a 1920x1080 frame
+// waveform origin is the centre line of a 500 pixel high view
+static void bench_draw(const char *wav, double *waveform_us, double *text_us)
+{
+	struct sp_state *sp = sp_plus_allocate_state(RATE);
+	sp_plus_load_pad(sp, 0, wav);
+
+	const int w = 1920, h = 1080, bytes = 4;
+	struct pixel_buffer buf = { malloc(w * h * bytes), bytes, w, h };
+
+	uint64_t start = platform_get_time_ns();
+	for (int i = 0; i < DRAW_RUNS; i++)
+		draw_waveform(sp, &buf, (vec2i) {10, 300}, w - 20, 500);
+	*waveform_us = seconds_since(start) * 1e6 / DRAW_RUNS;
+
+	const char *line = "audio: 48000Hz float, period 128, buffer 384, latency 8.0ms";
+	start = platform_get_time_ns();
+	for (int i = 0; i < DRAW_RUNS; i++)
+		draw_text(&buf, line, sp->fonts + MED, (vec2i) {10, 600}, WHITE);
+	*text_us = seconds_since(start) * 1e6 / DRAW_RUNS;
+
+	free(buf.buffer);
+}
+
+int main(void)
+{
+	char wav[] = "/tmp/sp-bench-XXXXXX";
+	char resample_wav[] = "/tmp/sp-bench-XXXXXX";
+	const int fd = mkstemp(wav), resample_fd = mkstemp(resample_wav);
+	if (fd < 0 || resample_fd < 0) {
+		fprintf(stderr, "Could not create test wav\n");
+		return 1;
+	}
+	close(fd);
+	close(resample_fd);
+	if (write_test_wav(wav, RATE, WAV_SECONDS)
+			|| write_test_wav(resample_wav, RESAMPLE_RATE, RESAMPLE_SECONDS)) {
+		fprintf(stderr, "Could not write test wav\n");
+		return 1;
+	}
+
+	init_voice_kernel();
+	init_convert_kernel();
+	printf("{\n");
+	printf("  \"voice_kernel\": \"%s\",\n", get_voice_kernel_name());
+	printf("  \"convert_kernel\": \"%s\",\n", get_convert_kernel_name());
+	printf("  \"sample_rate\": %d,\n", RATE);
+	printf("  \"period_frames\": %d,\n", PERIOD_FRAMES);
+
+	printf("  \"mix\": [\n");
+	const int num_voice_counts = sizeof(voice_counts) / sizeof(voice_counts[0]);
+	const int num_depths = sizeof(bus_depths) / sizeof(bus_depths[0]);
+	for (int v = 0; v < num_voice_counts; v++) {
+		for (int d = 0; d < num_depths; d++) {
+			int active;
+			const double ns = bench_mix(wav, voice_counts[v], bus_depths[d], &active);
+			printf("    {\"voices\": %d, \"active_voices\": %d, \"bus_depth\": %d, "
+					"\"ns_per_frame\": %.2f}%s\n",
+					voice_counts[v], active, bus_depths[d], ns,
+					v == num_voice_counts - 1 && d == num_depths - 1 ? "" : ",");
+		}
+	}
+	printf("  ],\n");
+
+	printf("  \"load_wav_mb_per_s\": %.1f,\n", bench_load(wav));
+	printf("  \"resample_mframes_per_s\": %.2f,\n", bench_resample(resample_wav));
+
+	double waveform_us, text_us;
+	bench_draw(wav, &waveform_us, &text_us);
+	printf("  \"draw_waveform_us\": %.1f,\n", waveform_us);
+	printf("  \"draw_text_us\": %.1f\n", text_us);
+	printf("}\n");
+
+	unlink(wav);
+	unlink(resample_wav);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ *  Checks that releasing a pad in gate mode stops its voice after the release,
+ *  through the scripted pad calls bounce scripts use.
+ *
+ *  build: gcc -O2 -Wextra -I../src/external -o gate-release-test gate-release-test.c ../src/sp_raster.c \
+ *  	../src/sp_voice.c ../src/sp_convert.c ../src/sp_trace.c ../src/sp_log.c -lm -L../lib -lsmarc
+ *  run from a directory next to fonts/, e.g. bin/ or test/
+ */
+
+#include "../src/sp_plus.c"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RATE 48000
+#define PERIOD_FRAMES 256
+#define WAV_FRAMES RATE			// outlasts the release
+#define RELEASE_FRAME 4800
+#define RELEASE_FRAMES 2400		// fade after the gate closes
+
+/* Stub platform */
+
+// loads the ui font, wavs are mapped
+long platform_load_entire_file(void **buffer, const char *path)
+{
+	*buffer = NULL;
+	FILE *f = fopen(path, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	const long size = ftell(f);
+	rewind(f);
+	*buffer = malloc(size);
+	if (!*buffer || fread(*buffer, size, 1, f) != 1) {
+		free(*buffer);
+		*buffer = NULL;
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	return size;
+}
+
+void platform_free_file_buffer(void **buffer)
+{
+	free(*buffer);
+	*buffer = NULL;
+}
+
+const void *platform_map_file(const char *path, long *size)
+{
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) return NULL;
+	struct stat st;
+	void *data = fstat(fd, &st) || st.st_size <= 0 ? MAP_FAILED
+		: mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return data;
+}
+
+void platform_unmap_file(const void *data, long size) { munmap((void *) data, size); }
+
+// the test wav is short, nothing is streamed
+void *platform_create_temp_file(void) { return NULL; }
+long platform_read_file_at(void *file, void *dest, long bytes, long offset)
+{
+	(void) file; (void) dest; (void) bytes; (void) offset;
+	return -1;
+}
+long platform_write_file_at(void *file, const void *src, long bytes, long offset)
+{
+	(void) file; (void) src; (void) bytes; (void) offset;
+	return -1;
+}
+void platform_close_file(void *file) { (void) file; }
+
+// the test never browses, every directory looks empty
+SP_DIR *platform_opendir(const char *path) { (void) path; return NULL; }
+int platform_closedir(SP_DIR *dir) { (void) dir; return 0; }
+int platform_num_valid_items_in_dir(SP_DIR *dir) { (void) dir; return 0; }
+int platform_read_next_valid_item(SP_DIR *dir, char **path, int *is_dir)
+{
+	(void) dir; (void) path; (void) is_dir;
+	return 1;
+}
+char *platform_get_realpath(const char *dir) { return realpath(dir, NULL); }
+char *platform_get_parent_dir(const char *dir) { return realpath(dir, NULL); }
+
+void *platform_init_mutex(void) { return NULL; }
+int platform_mutex_lock(void *mutex) { (void) mutex; return 0; }
+int platform_mutex_unlock(void *mutex) { (void) mutex; return 0; }
+void *platform_init_semaphore(void) { return NULL; }
+void platform_semaphore_post(void *sem) { (void) sem; }
+void platform_semaphore_wait(void *sem) { (void) sem; }
+int platform_get_cpu_count(void) { return 1; }
+
+// single threaded, loads run on the calling thread
+void *platform_create_thread(void *(*func)(void *), void *arg)
+{
+	(void) func; (void) arg;
+	return NULL;
+}
+int platform_join_thread(void *thread) { (void) thread; return -1; }
+void platform_sleep_ns(uint64_t ns) { (void) ns; }
+
+void platform_prefault(void *buffer, long size) { (void) buffer; (void) size; }
+
+void platform_get_audio_info(struct audio_info *info)
+{
+	info->period_frames = PERIOD_FRAMES;
+	info->buffer_frames = 2 * PERIOD_FRAMES;
+	info->sample_rate = RATE;
+	info->format = AUDIO_FORMAT_FLOAT;
+}
+
+void platform_get_audio_stats(struct audio_stats *stats) { memset(stats, 0, sizeof(*stats)); }
+void platform_reset_audio_stats(void) {}
+
+uint64_t platform_get_time_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+/* Test */
+
+// writes a 16 bit mono wav of constant level at RATE to path
+static int write_test_wav(const char *path)
+{
+	const uint32_t data_bytes = WAV_FRAMES * 2;
+	FILE *f = fopen(path, "wb");
+	if (!f) return -1;
+
+	const uint32_t riff_size = 36 + data_bytes, fmt_size = 16, rate = RATE, byte_rate = RATE * 2;
+	const uint16_t pcm = 1, channels = 1, align = 2, bits = 16;
+	fwrite("RIFF", 4, 1, f);
+	fwrite(&riff_size, 4, 1, f);
+	fwrite("WAVEfmt ", 8, 1, f);
+	fwrite(&fmt_size, 4, 1, f);
+	fwrite(&pcm, 2, 1, f);
+	fwrite(&channels, 2, 1, f);
+	fwrite(&rate, 4, 1, f);
+	fwrite(&byte_rate, 4, 1, f);
+	fwrite(&align, 2, 1, f);
+	fwrite(&bits, 2, 1, f);
+	fwrite("data", 4, 1, f);
+	fwrite(&data_bytes, 4, 1, f);
+
+	const int16_t x = 16384;
+	for (uint32_t i = 0; i < WAV_FRAMES; i++) fwrite(&x, 2, 1, f);
+	return fclose(f);
+}
+
+// triggers pad 0 on frame 0 and releases it on RELEASE_FRAME with gate mode set to gate
+// returns the frame from which the output stays silent once the voice is freed,
+// or -1 if the voice is still playing at the end
+static long render_release(const char *wav, int gate)
+{
+	struct sp_state *sp = sp_plus_allocate_state(RATE);
+	if (sp_plus_load_pad(sp, 0, wav) || sp_plus_set_pad_gate(sp, 0, gate)) {
+		fprintf(stderr, "Could not load test wav\n");
+		exit(1);
+	}
+	struct sample *s = sp->sampler.banks[0][0];
+	s->release = RELEASE_FRAMES;
+	send_playback(s, sp);
+	sp_plus_trigger_pad(sp, 0, 0);
+	sp_plus_release_pad(sp, 0, RELEASE_FRAME);
+
+	static float buf[PERIOD_FRAMES * NUM_CHANNELS];
+	long silent_from = RELEASE_FRAME;
+	for (long f = 0; f < WAV_FRAMES - PERIOD_FRAMES; f += PERIOD_FRAMES) {
+		sp_plus_fill_audio_buffer(sp, buf, PERIOD_FRAMES, AUDIO_FORMAT_FLOAT);
+		for (int i = 0; i < PERIOD_FRAMES * NUM_CHANNELS; i++) {
+			if (buf[i] != 0.0f && f + i / NUM_CHANNELS >= silent_from)
+				silent_from = f + i / NUM_CHANNELS + 1;
+		}
+	}
+	return sp->mixer.voices.num_active ? -1 : silent_from;
+}
+
+int main(void)
+{
+	char wav[] = "/tmp/sp-gate-XXXXXX";
+	const int fd = mkstemp(wav);
+	if (fd < 0 || close(fd) || write_test_wav(wav)) {
+		fprintf(stderr, "Could not write test wav\n");
+		return 1;
+	}
+	init_voice_kernel();
+	init_convert_kernel();
+
+	int failed = 0;
+
+	// gated voice fades over the release and is freed
+	const long gated = render_release(wav, 1);
+	if (gated < RELEASE_FRAME || gated > RELEASE_FRAME + RELEASE_FRAMES + 1) {
+		printf("gate on: voice not stopped by release (silent from %ld)\n", gated);
+		failed = 1;
+	} else {
+		printf("gate on: silent %ld frames after release\n", gated - RELEASE_FRAME);
+	}
+
+	// without gate mode a release leaves the voice playing
+	if (render_release(wav, 0) >= 0) {
+		printf("gate off: voice stopped on release\n");
+		failed = 1;
+	} else {
+		printf("gate off: voice plays on\n");
+	}
+
+	unlink(wav);
+	printf(failed ? "FAILED\n" : "OK\n");
+	return failed;
+}
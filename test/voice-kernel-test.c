@@ -0,0 +1,106 @@
+/*
+ *  Checks the vectorized voice kernels against the scalar reference.
+ *
+ *  build: gcc -O2 -o voice-kernel-test voice-kernel-test.c -lm
+ */
+
+#include "../src/sp_voice.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_FRAMES 4096
+#define MAX_RUN 256
+#define NUM_RUNS 20000
+#define TOLERANCE 1e-3
+
+static float data[NUM_FRAMES * 2];
+
+static float rand_float(float lo, float hi)
+{
+	return lo + (hi - lo) * (float) rand() / RAND_MAX;
+}
+
+// random run that stays inside data
+static void rand_run(struct voice_run *r, int frames)
+{
+	r->data = data;
+	r->channels = 1 + rand() % 2;
+	r->step = rand_float(0.1f, 4.0f);
+	if (rand() % 2) r->step *= -1.0f;
+
+	const int span = (int) (fabsf(r->step) * frames) + 2;
+	r->base = span + rand() % (NUM_FRAMES - 2 * span - 2);
+	r->frac = rand_float(0.0f, 0.999f);
+
+	// some runs play backward past the first frame, which is clamped
+	if (rand() % 8 == 0) {
+		r->base = rand() % 4;
+		r->step = -fabsf(r->step);
+	}
+
+	r->attack = rand_float(-0.5f, 3.0f);
+	r->attack_inc = rand_float(-0.01f, 0.01f);
+	r->release = rand_float(-0.5f, 3.0f);
+	r->release_inc = rand_float(-0.01f, 0.01f);
+
+	r->gate_closed = rand() % 2;
+	r->gate = rand_float(0.0f, 1.0f);
+	r->gate_inc = -rand_float(0.0f, 0.002f);
+}
+
+// returns max difference between kernel and scalar reference
+static double check_kernel(void (*kernel)(const struct voice_run *, float *, int))
+{
+	static float ref[MAX_RUN * 2];
+	static float out[MAX_RUN * 2];
+	double max_diff = 0.0;
+
+	srand(1);
+	for (int i = 0; i < NUM_RUNS; i++) {
+		const int frames = 1 + rand() % MAX_RUN;
+		struct voice_run r;
+		rand_run(&r, frames);
+
+		render_voice_run_scalar(&r, ref, frames);
+		kernel(&r, out, frames);
+
+		for (int j = 0; j < frames * 2; j++) {
+			const double d = fabs(ref[j] - out[j]);
+			if (d > max_diff) max_diff = d;
+		}
+	}
+	return max_diff;
+}
+
+int main(void)
+{
+	for (int i = 0; i < NUM_FRAMES * 2; i++)
+		data[i] = rand_float(-1.0f, 1.0f);
+
+	int failed = 0;
+	double d;
+
+#ifdef VOICE_KERNEL_X86
+	d = check_kernel(render_voice_run_sse2);
+	printf("sse2: max diff %g\n", d);
+	failed |= d > TOLERANCE;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		d = check_kernel(render_voice_run_avx2);
+		printf("avx2: max diff %g\n", d);
+		failed |= d > TOLERANCE;
+	} else {
+		printf("avx2: not supported, skipped\n");
+	}
+#endif
+
+	init_voice_kernel();
+	d = check_kernel(render_voice_run);
+	printf("%s (selected): max diff %g\n", get_voice_kernel_name(), d);
+	failed |= d > TOLERANCE;
+
+	printf(failed ? "FAILED\n" : "PASSED\n");
+	return failed;
+}